@@ -19,7 +19,9 @@ import checkModelMiddleware from "../middleware/checkModelMiddleware.ts";
 import inlineLoadMiddleware from "../middleware/inlineLoadMiddleware.ts";
 import oaiContextMiddleware from "../middleware/oaiContextMiddleware.ts";
 import { CompletionRequest, CompletionResponse } from "./types/completions.ts";
+import { EmbeddingsRequest, EmbeddingsResponse } from "./types/embeddings.ts";
 import { generateCompletion, streamCompletion } from "./utils/completion.ts";
+import { generateEmbeddings } from "./utils/embeddings.ts";
 
 const router = new Hono();
 
@@ -115,4 +117,39 @@ router.post(
     },
 );
 
+const embeddingsRoute = describeRoute({
+    responses: {
+        200: jsonContent(EmbeddingsResponse, "Response to embeddings"),
+    },
+});
+
+router.post(
+    "/v1/embeddings",
+    embeddingsRoute,
+    authMiddleware("api"),
+    sValidator("json", EmbeddingsRequest),
+    async (c, next) => {
+        const params = c.req.valid("json");
+        await inlineLoadMiddleware(c.req, next, params.model);
+    },
+    checkModelMiddleware,
+    oaiContextMiddleware,
+    async (c) => {
+        const params = c.req.valid("json");
+
+        if (!c.var.model.supportsEmbeddings) {
+            throw new HTTPException(422, {
+                message:
+                    "Embeddings are disabled. Set embeddings to true in the model config.",
+            });
+        }
+
+        const embeddingsResult = await generateEmbeddings(
+            c.var.oaiCtx,
+            params,
+        );
+        return c.json(embeddingsResult);
+    },
+);
+
 export default router;
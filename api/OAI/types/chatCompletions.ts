@@ -59,10 +59,27 @@ export const ChatCompletionRequest = z.aliasedObject(
 
 export type ChatCompletionRequest = z.infer<typeof ChatCompletionRequest>;
 
+const ChatCompletionTopLogprob = z.object({
+    token: z.string(),
+    logprob: z.number(),
+    bytes: z.array(z.number()),
+});
+
+export const ChatCompletionLogprobs = z.object({
+    content: z.array(
+        ChatCompletionTopLogprob.extend({
+            top_logprobs: z.array(ChatCompletionTopLogprob),
+        }),
+    ),
+});
+
+export type ChatCompletionLogprobs = z.infer<typeof ChatCompletionLogprobs>;
+
 export const ChatCompletionRespChoice = z.object({
     index: z.number().default(0),
     finish_reason: z.string().optional(),
     message: ChatCompletionMessage,
+    logprobs: ChatCompletionLogprobs.optional(),
 });
 
 export type ChatCompletionRespChoice = z.infer<typeof ChatCompletionRespChoice>;
@@ -83,6 +100,7 @@ export const ChatCompletionStreamChoice = z.object({
     finish_reason: z.string().optional(),
     delta: z.union([ChatCompletionMessage, z.record(z.string(), z.unknown())])
         .default({}),
+    logprobs: ChatCompletionLogprobs.optional(),
 });
 
 export const ChatCompletionStreamChunk = z.object({
@@ -21,7 +21,6 @@ export type UsageStats = z.infer<typeof UsageStats>;
 export const CommonCompletionRequest = z.object({
     model: z.string().cleanOptional(),
     stream: z.boolean().nullish().coalesce(false),
-    logprobs: z.number().gte(0).nullish().coalesce(0),
     response_format: CompletionResponseFormat.nullish().coalesce(
         CompletionResponseFormat.parse({}),
     ),
@@ -55,10 +54,20 @@ export const CompletionRequest = z.object({
 
 export type CompletionRequest = z.infer<typeof CompletionRequest>;
 
+export const CompletionLogprobs = z.object({
+    tokens: z.array(z.string()),
+    token_logprobs: z.array(z.number()),
+    top_logprobs: z.array(z.record(z.string(), z.number())),
+    text_offset: z.array(z.number()),
+});
+
+export type CompletionLogprobs = z.infer<typeof CompletionLogprobs>;
+
 export const CompletionRespChoice = z.object({
     index: z.number().default(0),
     finish_reason: z.string().optional(),
     text: z.string(),
+    logprobs: CompletionLogprobs.optional(),
 });
 
 export type CompletionRespChoice = z.infer<typeof CompletionRespChoice>;
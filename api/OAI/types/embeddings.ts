@@ -0,0 +1,37 @@
+import * as z from "@/common/myZod.ts";
+
+export const EmbeddingsRequest = z.object({
+    input: z.union([
+        z.string().transform((str) => [str]),
+        z.array(z.string()),
+    ]),
+    model: z.string().cleanOptional(),
+    encoding_format: z.enum(["float", "base64"]).nullish().coalesce("float"),
+    normalize: z.boolean().nullish().coalesce(true),
+    user: z.string().cleanOptional(),
+})
+    .describe("Embeddings Request parameters");
+
+export type EmbeddingsRequest = z.infer<typeof EmbeddingsRequest>;
+
+export const EmbeddingObject = z.object({
+    object: z.string().default("embedding"),
+    embedding: z.union([z.array(z.number()), z.string()]),
+    index: z.number(),
+});
+
+export type EmbeddingObject = z.infer<typeof EmbeddingObject>;
+
+export const EmbeddingsUsage = z.object({
+    prompt_tokens: z.number(),
+    total_tokens: z.number(),
+});
+
+export const EmbeddingsResponse = z.object({
+    object: z.string().default("list"),
+    data: z.array(EmbeddingObject),
+    model: z.string(),
+    usage: EmbeddingsUsage,
+});
+
+export type EmbeddingsResponse = z.infer<typeof EmbeddingsResponse>;
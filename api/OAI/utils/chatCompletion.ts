@@ -3,17 +3,23 @@ import { SSEStreamingApi } from "hono/streaming";
 
 import {
     convertFinishReason,
+    createStreamGenerators,
     createUsageStats,
     GenerationType,
     staticGenerate,
     streamCollector,
 } from "@/api/OAI/utils/generation.ts";
 import { Model } from "@/bindings/bindings.ts";
-import { FinishChunk, GenerationChunk } from "@/bindings/types.ts";
+import {
+    FinishChunk,
+    GenerationChunk,
+    TokenLogprobs,
+} from "@/bindings/types.ts";
 import { toGeneratorError } from "@/common/networking.ts";
 import { PromptTemplate } from "@/common/templating.ts";
 
 import {
+    ChatCompletionLogprobs,
     ChatCompletionMessage,
     ChatCompletionMessagePart,
     ChatCompletionRequest,
@@ -37,6 +43,25 @@ interface TemplateFormatOptions {
     responsePrefix?: string;
 }
 
+function createLogprobs(logprobs?: TokenLogprobs[]) {
+    if (!logprobs) {
+        return undefined;
+    }
+
+    return ChatCompletionLogprobs.parse({
+        content: logprobs.map((entry) => ({
+            token: entry.text,
+            logprob: entry.logprob,
+            bytes: entry.bytes,
+            top_logprobs: entry.top.map((alternative) => ({
+                token: alternative.text,
+                logprob: alternative.logprob,
+                bytes: alternative.bytes,
+            })),
+        })),
+    });
+}
+
 function createResponse(chunks: FinishChunk[], modelName: string) {
     const choices: ChatCompletionRespChoice[] = [];
 
@@ -54,6 +79,7 @@ function createResponse(chunks: FinishChunk[], modelName: string) {
             index: chunk.taskIdx,
             message: message,
             finish_reason: convertFinishReason(chunk),
+            logprobs: createLogprobs(chunk.logprobs),
         });
 
         choices.push(choice);
@@ -88,6 +114,7 @@ function createStreamChunk(
     const choice = ChatCompletionStreamChoice.parse({
         index: chunk.taskIdx,
         delta: message,
+        logprobs: createLogprobs(chunk.logprobs),
     });
 
     if (chunk.kind === "finish") {
@@ -228,20 +255,15 @@ export async function streamChatCompletion(
 
     try {
         const queue = new Queue<GenerationChunk | Error>();
-        const genTasks = [];
-
-        for (let i = 0; i < params.n; i++) {
-            const task = streamCollector(
-                ctx,
-                prompt,
-                params,
-                genAbortController.signal,
-                i,
-                queue,
-            );
-
-            genTasks.push(task);
-        }
+        const generators = createStreamGenerators(
+            ctx,
+            prompt,
+            params,
+            genAbortController.signal,
+        );
+        const genTasks = generators.map((generator) =>
+            streamCollector(generator, queue)
+        );
 
         let completedTasks = 0;
         while (true) {
@@ -3,23 +3,56 @@ import { SSEStreamingApi } from "hono/streaming";
 
 import {
     convertFinishReason,
+    createStreamGenerators,
     createUsageStats,
     GenerationType,
     staticGenerate,
     streamCollector,
 } from "@/api/OAI/utils/generation.ts";
-import { GenerationChunk } from "@/bindings/types.ts";
+import { GenerationChunk, TokenLogprobs } from "@/bindings/types.ts";
 import { CancellationError } from "@/common/errors.ts";
 import { toGeneratorError } from "@/common/networking.ts";
 import { logger } from "@/common/logging.ts";
 import {
+    CompletionLogprobs,
     CompletionRequest,
     CompletionRespChoice,
     CompletionResponse,
 } from "../types/completions.ts";
 import { OAIContext } from "../types/context.ts";
 
-function createResponse(chunks: GenerationChunk[], modelName: string) {
+// Offsets count from the start of the generated text
+function createLogprobs(logprobs?: TokenLogprobs[], textOffset: number = 0) {
+    if (!logprobs) {
+        return undefined;
+    }
+
+    const offsets: number[] = [];
+    for (const entry of logprobs) {
+        offsets.push(textOffset);
+        textOffset += entry.text.length;
+    }
+
+    return CompletionLogprobs.parse({
+        tokens: logprobs.map((entry) => entry.text),
+        token_logprobs: logprobs.map((entry) => entry.logprob),
+        top_logprobs: logprobs.map((entry) =>
+            Object.fromEntries(
+                entry.top.map((alternative) => [
+                    alternative.text,
+                    alternative.logprob,
+                ]),
+            )
+        ),
+        text_offset: offsets,
+    });
+}
+
+function createResponse(
+    chunks: GenerationChunk[],
+    modelName: string,
+    textOffsets?: number[],
+) {
     const choices: CompletionRespChoice[] = [];
     for (const chunk of chunks) {
         const finishReason = chunk.kind === "finish"
@@ -30,6 +63,10 @@ function createResponse(chunks: GenerationChunk[], modelName: string) {
             index: chunk.taskIdx,
             text: chunk.text,
             finish_reason: finishReason,
+            logprobs: createLogprobs(
+                chunk.logprobs,
+                textOffsets?.[chunk.taskIdx],
+            ),
         });
 
         choices.push(choice);
@@ -73,21 +110,17 @@ export async function streamCompletion(
 
     try {
         const queue = new Queue<GenerationChunk | Error>();
-        const genTasks = [];
-
-        for (let i = 0; i < params.n; i++) {
-            const task = streamCollector(
-                ctx,
-                params.prompt,
-                params,
-                genAbortController.signal,
-                i,
-                queue,
-            );
-
-            genTasks.push(task);
-        }
-
+        const generators = createStreamGenerators(
+            ctx,
+            params.prompt,
+            params,
+            genAbortController.signal,
+        );
+        const genTasks = generators.map((generator) =>
+            streamCollector(generator, queue)
+        );
+
+        const textOffsets = new Array<number>(params.n).fill(0);
         let completedTasks = 0;
         while (true) {
             // Abort if the signal is set
@@ -103,7 +136,12 @@ export async function streamCompletion(
                 throw chunk;
             }
 
-            const streamChunk = createResponse([chunk], ctx.model.path.name);
+            const streamChunk = createResponse(
+                [chunk],
+                ctx.model.path.name,
+                textOffsets,
+            );
+            textOffsets[chunk.taskIdx] += chunk.text.length;
             await stream.writeSSE({ data: JSON.stringify(streamChunk) });
 
             if (chunk.kind === "finish") {
@@ -0,0 +1,53 @@
+import { logger } from "@/common/logging.ts";
+import { OAIContext } from "../types/context.ts";
+import {
+    EmbeddingObject,
+    EmbeddingsRequest,
+    EmbeddingsResponse,
+} from "../types/embeddings.ts";
+
+// Little-endian float32 bytes, the OAI base64 format
+function floatsToBase64(values: Float32Array) {
+    const bytes = new Uint8Array(
+        values.buffer,
+        values.byteOffset,
+        values.byteLength,
+    );
+
+    let binary = "";
+    for (let i = 0; i < bytes.length; i++) {
+        binary += String.fromCharCode(bytes[i]);
+    }
+
+    return btoa(binary);
+}
+
+export async function generateEmbeddings(
+    ctx: OAIContext,
+    params: EmbeddingsRequest,
+) {
+    logger.info(`Received embeddings request ${ctx.requestId}`);
+
+    const result = await ctx.model.embed(params.input, params.normalize);
+
+    const data = result.embeddings.map((embedding, index) =>
+        EmbeddingObject.parse({
+            embedding: params.encoding_format === "base64"
+                ? floatsToBase64(embedding)
+                : Array.from(embedding),
+            index,
+        })
+    );
+
+    const response = EmbeddingsResponse.parse({
+        data,
+        model: ctx.model.path.name,
+        usage: {
+            prompt_tokens: result.promptTokens,
+            total_tokens: result.promptTokens,
+        },
+    });
+
+    logger.info(`Finished embeddings request ${ctx.requestId}`);
+    return response;
+}
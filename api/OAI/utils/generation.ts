@@ -59,23 +59,14 @@ export async function staticGenerate(
     });
 
     try {
-        const genTasks: Promise<FinishChunk>[] = [];
-
-        for (let i = 0; i < params.n; i++) {
-            const genRequestId = params.n > 1
-                ? `${ctx.requestId}-${i}`
-                : ctx.requestId;
-
-            const task = ctx.model.generate(
-                genRequestId,
-                prompt,
-                params,
-                abortController.signal,
-                i,
-            );
-
-            genTasks.push(task);
-        }
+        // The n completions share one prefill
+        const genTasks = ctx.model.generateForks(
+            ctx.requestId,
+            prompt,
+            params,
+            abortController.signal,
+            params.n,
+        );
 
         const genResults = await Promise.allSettled(genTasks);
         const generations = genResults.reduce((acc, result) => {
@@ -96,27 +87,27 @@ export async function staticGenerate(
     }
 }
 
-export async function streamCollector(
+// One stream per completion. The n completions share one prefill.
+export function createStreamGenerators(
     ctx: OAIContext,
     prompt: string,
     params: CommonCompletionRequest,
     genAbortSignal: AbortSignal,
-    taskIdx: number,
+) {
+    return ctx.model.generateForkGens(
+        ctx.requestId,
+        prompt,
+        params,
+        genAbortSignal,
+        params.n,
+    );
+}
+
+export async function streamCollector(
+    generator: AsyncGenerator<GenerationChunk>,
     genQueue: Queue<GenerationChunk | Error>,
 ) {
     try {
-        const genRequestId = params.n > 1
-            ? `${ctx.requestId}-${taskIdx}`
-            : ctx.requestId;
-
-        const generator = ctx.model.generateGen(
-            genRequestId,
-            prompt,
-            params,
-            genAbortSignal,
-            taskIdx,
-        );
-
         for await (const chunk of generator) {
             genQueue.push(chunk);
 
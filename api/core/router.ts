@@ -10,6 +10,7 @@ import {
     ModelList,
     ModelLoadRequest,
 } from "@/api/core/types/model.ts";
+import { ScoreRequest, ScoreResponse } from "@/api/core/types/score.ts";
 import {
     TemplateList,
     TemplateSwitchRequest,
@@ -28,6 +29,7 @@ import { PromptTemplate } from "@/common/templating.ts";
 
 import authMiddleware from "../middleware/authMiddleware.ts";
 import checkModelMiddleware from "../middleware/checkModelMiddleware.ts";
+import { formatPrometheusMetrics } from "./utils/metrics.ts";
 import { apiLoadModel } from "./utils/model.ts";
 
 const router = new Hono();
@@ -325,4 +327,94 @@ router.post(
     },
 );
 
+const metricsRoute = describeRoute({
+    responses: {
+        200: {
+            description: "Engine metrics in the Prometheus text format",
+        },
+    },
+});
+
+router.get(
+    "/metrics",
+    metricsRoute,
+    authMiddleware("api"),
+    checkModelMiddleware,
+    (c) => {
+        const metrics = c.var.model.metrics();
+
+        return c.text(formatPrometheusMetrics(metrics), 200, {
+            "Content-Type": "text/plain; version=0.0.4",
+        });
+    },
+);
+
+const traceRoute = describeRoute({
+    responses: {
+        200: {
+            description: "Chrome trace-event JSON of the processor timeline",
+        },
+    },
+});
+
+router.get(
+    "/v1/trace",
+    traceRoute,
+    authMiddleware("admin"),
+    checkModelMiddleware,
+    (c) => {
+        return c.body(c.var.model.dumpTrace(), 200, {
+            "Content-Type": "application/json",
+        });
+    },
+);
+
+const scoreRoute = describeRoute({
+    responses: {
+        200: jsonContent(
+            ScoreResponse,
+            "Logprobs of each candidate given the context",
+        ),
+    },
+});
+
+router.post(
+    "/v1/score",
+    scoreRoute,
+    authMiddleware("api"),
+    checkModelMiddleware,
+    sValidator("json", ScoreRequest),
+    async (c) => {
+        const params = c.req.valid("json");
+
+        const results = await c.var.model.score(
+            c.var.requestId,
+            params.context,
+            params.candidates,
+            params.top_logprobs,
+            c.req.raw.signal,
+        );
+
+        const resp = ScoreResponse.parse({
+            data: results.map((result, index) => ({
+                index,
+                tokens: result.tokens.map((entry) => ({
+                    token: entry.token,
+                    text: entry.text,
+                    logprob: entry.logprob,
+                    top_logprobs: entry.top.map((alternative) => ({
+                        token: alternative.token,
+                        text: alternative.text,
+                        logprob: alternative.logprob,
+                    })),
+                })),
+                sum_logprob: result.sumLogprob,
+                is_greedy: result.isGreedy,
+            })),
+        });
+
+        return c.json(resp);
+    },
+);
+
 export default router;
@@ -0,0 +1,34 @@
+import * as z from "@/common/myZod.ts";
+
+export const ScoreRequest = z.object({
+    context: z.string(),
+    candidates: z.array(z.string()).nullish().coalesce([]),
+    top_logprobs: z.number().min(0).max(20).nullish().coalesce(1),
+});
+
+export type ScoreRequest = z.infer<typeof ScoreRequest>;
+
+export const ScoredToken = z.object({
+    token: z.number(),
+    text: z.string(),
+    logprob: z.number(),
+    top_logprobs: z.array(z.object({
+        token: z.number(),
+        text: z.string(),
+        logprob: z.number(),
+    })),
+});
+
+export const ScoreObject = z.object({
+    index: z.number(),
+    tokens: z.array(ScoredToken),
+    sum_logprob: z.number(),
+    is_greedy: z.boolean(),
+});
+
+export const ScoreResponse = z.object({
+    object: z.string().default("list"),
+    data: z.array(ScoreObject),
+});
+
+export type ScoreResponse = z.infer<typeof ScoreResponse>;
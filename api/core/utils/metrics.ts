@@ -0,0 +1,43 @@
+import { MetricsHistogram, ProcessorMetrics } from "@/bindings/metrics.ts";
+
+const PREFIX = "yals";
+
+function formatBound(bound: number) {
+    return bound === Infinity ? "+Inf" : bound.toString();
+}
+
+function formatHistogram(name: string, histogram: MetricsHistogram) {
+    const lines = [`# TYPE ${name} histogram`];
+
+    // Prometheus buckets are cumulative
+    let cumulative = 0;
+    histogram.bounds.forEach((bound, i) => {
+        cumulative += histogram.counts[i];
+        lines.push(`${name}_bucket{le="${formatBound(bound)}"} ${cumulative}`);
+    });
+
+    lines.push(`${name}_sum ${histogram.sum}`);
+    lines.push(`${name}_count ${histogram.count}`);
+    return lines;
+}
+
+// Prometheus text exposition format
+export function formatPrometheusMetrics(metrics: ProcessorMetrics) {
+    const lines: string[] = [];
+
+    for (const [key, value] of Object.entries(metrics.gauges)) {
+        const name = `${PREFIX}_${key}`;
+        lines.push(`# TYPE ${name} gauge`, `${name} ${value}`);
+    }
+
+    for (const [key, value] of Object.entries(metrics.counters)) {
+        const name = `${PREFIX}_${key}`;
+        lines.push(`# TYPE ${name} counter`, `${name} ${value}`);
+    }
+
+    for (const [key, histogram] of Object.entries(metrics.histograms)) {
+        lines.push(...formatHistogram(`${PREFIX}_${key}`, histogram));
+    }
+
+    return lines.join("\n") + "\n";
+}
@@ -8,16 +8,22 @@ import { BaseSamplerRequest } from "@/common/sampling.ts";
 import { PromptTemplate } from "@/common/templating.ts";
 import { defer } from "@/common/utils.ts";
 import { MaybePromise } from "@/types/utils.ts";
+import { EmbeddingBuffer } from "./embeddingBuffer.ts";
 import { GenerationResources } from "./generationResources.ts";
 import { YALSGrammar } from "./grammar.ts";
 import { lib } from "./lib.ts";
 import { Job } from "./job.ts";
+import { readProcessorMetrics } from "./metrics.ts";
 import { SamplerBuilder } from "./samplers.ts";
 import {
     FinishChunk,
     GenerationChunk,
     GGMLTensorSplitMode,
+    LogprobToken,
     ReadbackFinishChunk,
+    ReadbackTokenLogprobs,
+    ScoreResult,
+    TokenLogprobs,
 } from "./types.ts";
 import { adjustCacheSize, pointerArrayFromStrings } from "./utils.ts";
 
@@ -49,6 +55,9 @@ class Tokenizer {
     eotToken?: Token;
     addBosToken: boolean = true;
 
+    // Decoded pieces by token ID, logprobs look up the same tokens over and over
+    private pieces: Map<number, Omit<LogprobToken, "logprob">> = new Map();
+
     constructor(model: Deno.PointerValue) {
         const bosTokenId = lib.symbols.model_vocab_bos(model);
         const eosTokenId = lib.symbols.model_vocab_eos(model);
@@ -86,6 +95,41 @@ class Tokenizer {
         return cString.getCString();
     }
 
+    tokenPiece(tokenId: number) {
+        let piece = this.pieces.get(tokenId);
+        if (piece) {
+            return piece;
+        }
+
+        let buf = new Uint8Array(64);
+        let size = lib.symbols.model_vocab_token_to_piece(
+            this.model,
+            tokenId,
+            buf,
+            buf.length,
+        );
+
+        if (size < 0) {
+            buf = new Uint8Array(-size);
+            size = lib.symbols.model_vocab_token_to_piece(
+                this.model,
+                tokenId,
+                buf,
+                buf.length,
+            );
+        }
+
+        const bytes = buf.slice(0, Math.max(size, 0));
+        piece = {
+            token: tokenId,
+            text: new TextDecoder().decode(bytes),
+            bytes: [...bytes],
+        };
+        this.pieces.set(tokenId, piece);
+
+        return piece;
+    }
+
     async tokenize(
         text: string,
         addSpecial: boolean = true,
@@ -170,6 +214,9 @@ export class Model {
     private context: Deno.PointerValue;
     private cache: Deno.PointerValue;
     private processor: Deno.PointerValue;
+    private draftModel: Deno.PointerValue;
+    private draftContext: Deno.PointerValue;
+    private embeddingContext: Deno.PointerValue;
 
     // Concurrency
     private activeJobIds: Map<string, Job | undefined> = new Map();
@@ -186,6 +233,9 @@ export class Model {
         context: Deno.PointerValue,
         cache: Deno.PointerValue,
         processor: Deno.PointerValue,
+        draftModel: Deno.PointerValue,
+        draftContext: Deno.PointerValue,
+        embeddingContext: Deno.PointerValue,
         path: Path.ParsedPath,
         tokenizer: Tokenizer,
         maxSeqLen: number,
@@ -195,6 +245,9 @@ export class Model {
         this.context = context;
         this.cache = cache;
         this.processor = processor;
+        this.draftModel = draftModel;
+        this.draftContext = draftContext;
+        this.embeddingContext = embeddingContext;
         this.path = path;
         this.tokenizer = tokenizer;
         this.promptTemplate = promptTemplate;
@@ -331,13 +384,124 @@ export class Model {
             );
         }
 
+        // Optional draft model for speculative decoding
+        let draftModel: Deno.PointerValue = null;
+        let draftContext: Deno.PointerValue = null;
+        if (params.draft_model_name) {
+            const draftPath = Path.join(
+                params.model_dir,
+                params.draft_model_name,
+            );
+
+            draftModel = await lib.symbols.model_load(
+                new TextEncoder().encode(draftPath + "\0"),
+                params.draft_num_gpu_layers ?? params.num_gpu_layers,
+                params.gpu_split_mode,
+                tensorSplitPtr,
+                null,
+                null,
+                params.mmap,
+                config.developer.realtime_process_priority,
+            );
+
+            // Drafts are token ids, the draft model has to share the target's vocabulary
+            const draftVocabMatches = !draftModel ||
+                lib.symbols.model_vocab_n_tokens(draftModel) ===
+                    lib.symbols.model_vocab_n_tokens(model);
+
+            if (draftModel && draftVocabMatches) {
+                draftContext = await lib.symbols.ctx_make(
+                    draftModel,
+                    cacheSize,
+                    params.chunk_size,
+                    params.physical_chunk_size ?? params.chunk_size,
+                    params.num_slots,
+                    params.num_threads,
+                    params.flash_attention,
+                    0, // Draft uses its trained rope base
+                    false,
+                    params.cache_mode_k,
+                    params.cache_mode_v,
+                    -1.0,
+                    params.kv_offload,
+                );
+            }
+
+            if (draftContext) {
+                logger.info(
+                    `Using draft model ${params.draft_model_name} with ` +
+                        `${params.draft_num_tokens} draft tokens`,
+                );
+            } else {
+                logger.warn(
+                    (draftVocabMatches
+                        ? "Could not load the draft model. "
+                        : `Draft model ${params.draft_model_name} has a ` +
+                            "different vocabulary than the model. ") +
+                        "Continuing without speculative decoding.",
+                );
+
+                if (draftModel) {
+                    lib.symbols.model_free(draftModel);
+                    draftModel = null;
+                }
+            }
+        }
+
+        // Optional pooling context for embeddings, shares the model weights
+        let embeddingContext: Deno.PointerValue = null;
+        if (params.embeddings) {
+            const embeddingBatchSize = params.embedding_batch_size ??
+                params.chunk_size;
+
+            embeddingContext = await lib.symbols.ctx_make_embedding(
+                model,
+                embeddingBatchSize,
+                Math.min(64, embeddingBatchSize),
+                params.num_threads,
+                params.flash_attention,
+                params.embedding_pooling,
+            );
+
+            if (embeddingContext) {
+                logger.info(
+                    `Embeddings enabled with a batch of ${embeddingBatchSize} tokens`,
+                );
+            } else {
+                logger.warn(
+                    "Could not create the embedding context. " +
+                        "Continuing without embeddings.",
+                );
+            }
+        }
+
+        const diskCacheDirPtr = params.disk_cache_dir
+            ? new TextEncoder().encode(params.disk_cache_dir + "\0")
+            : null;
+
         const processor = await lib.symbols.processor_make(
             model,
             context,
             cache,
             params.num_slots,
+            params.step_token_budget ?? 0,
+            params.prefill_policy,
+            params.host_cache_size,
+            diskCacheDirPtr,
+            params.disk_cache_size,
+            params.cache_mode_k,
+            params.cache_mode_v,
+            params.flash_attention,
+            draftModel,
+            draftContext,
+            params.draft_num_tokens,
+            embeddingContext,
         );
 
+        if (config.developer.trace) {
+            lib.symbols.processor_set_tracing(processor, true);
+        }
+
         // Adjust the maxSeqLen to be the full context if -1
         // This needs to be done after cache size is established
         if (params.max_seq_len == -1) {
@@ -403,6 +567,9 @@ export class Model {
             context,
             cache,
             processor,
+            draftModel,
+            draftContext,
+            embeddingContext,
             parsedModelPath,
             tokenizer,
             maxSeqLen,
@@ -447,6 +614,178 @@ export class Model {
         lib.symbols.model_free(this.model);
         lib.symbols.ctx_free(this.context);
         lib.symbols.processor_free(this.processor);
+
+        if (this.draftContext) {
+            lib.symbols.ctx_free(this.draftContext);
+        }
+        if (this.draftModel) {
+            lib.symbols.model_free(this.draftModel);
+        }
+        if (this.embeddingContext) {
+            lib.symbols.ctx_free(this.embeddingContext);
+        }
+    }
+
+    // Chrome trace-event JSON of the recorded timeline
+    dumpTrace() {
+        const tracePtr = lib.symbols.processor_dump_trace(this.processor);
+
+        using _ = defer(() => {
+            lib.symbols.endpoint_free_string(tracePtr);
+        });
+
+        if (tracePtr === null) {
+            throw new Error("Could not dump the trace");
+        }
+
+        return new Deno.UnsafePointerView(tracePtr).getCString();
+    }
+
+    // Latest snapshot of the processor's engine metrics
+    metrics() {
+        return readProcessorMetrics(this.processor);
+    }
+
+    get supportsEmbeddings() {
+        return this.embeddingContext !== null;
+    }
+
+    async embed(inputs: string[], normalize: boolean = true) {
+        if (this.closing) {
+            throw new Error("Model is being unloaded. Cannot create embeddings.");
+        }
+
+        const buffer = new EmbeddingBuffer();
+        using _ = defer(() => buffer.close());
+
+        const inputPtrs = pointerArrayFromStrings(inputs);
+        await lib.symbols.processor_submit_embeddings(
+            this.processor,
+            buffer.rawPtr,
+            inputPtrs.inner,
+            inputs.length,
+            true, // Raw inputs, the vocab decides on BOS/EOS
+            normalize,
+        );
+
+        await buffer.wait();
+
+        const status = buffer.status();
+        if (status !== "Ok") {
+            throw new Error(`Embedding failed: ${status}`);
+        }
+
+        // Copy out of native memory before the buffer is released
+        return {
+            embeddings: buffer.rows().map((row) => row.slice()),
+            promptTokens: buffer.numTokens,
+        };
+    }
+
+    // Scores each candidate as a continuation of the context. The context is prefilled once and
+    // shared by all candidates. Without candidates, every token of the context after the first is scored.
+    async score(
+        requestId: string,
+        context: string,
+        candidates: string[],
+        topLogprobs: number,
+        abortSignal: AbortSignal,
+    ): Promise<ScoreResult[]> {
+        if (this.closing) {
+            throw new Error("Model is being unloaded. Cannot score prompts.");
+        }
+
+        // An already aborted signal never fires its listeners
+        abortSignal.throwIfAborted();
+
+        const resources = Array.from(
+            { length: candidates.length + 1 },
+            () => new GenerationResources(),
+        );
+        const jobIds = resources.map((_, i) => `${requestId}-${i}`);
+        using _ = defer(() => {
+            for (const id of jobIds) {
+                this.activeJobIds.delete(id);
+            }
+            for (const genResources of resources) {
+                genResources.close();
+            }
+        });
+
+        const contextPtr = new TextEncoder().encode(context + "\0");
+        const candidatesPtr = pointerArrayFromStrings(candidates);
+        const candidateResourcesPtr = new BigUint64Array(
+            resources.slice(1).map((genResources) =>
+                BigInt(Deno.UnsafePointer.value(genResources.rawPtr))
+            ),
+        );
+
+        const jobId = lib.symbols.processor_submit_scoring(
+            this.processor,
+            contextPtr,
+            candidatesPtr.inner,
+            candidates.length,
+            resources[0].rawPtr,
+            candidateResourcesPtr,
+            this.maxSeqLen,
+            this.tokenizer.addBosToken,
+            0,
+            topLogprobs,
+        );
+
+        // Candidates get the request IDs following the context's
+        const jobs = resources.map((genResources, i) =>
+            new Job(jobId + i, genResources.readbackBuffer, this.processor)
+        );
+        jobs.forEach((job, i) => this.activeJobIds.set(jobIds[i], job));
+
+        const onAbort = () => jobs.forEach((job) => job.cancel());
+        abortSignal.addEventListener("abort", onAbort);
+
+        // A failed candidate rejects the whole batch, the other jobs must not keep their slots
+        let scored = false;
+        using _abort = defer(() => {
+            abortSignal.removeEventListener("abort", onAbort);
+            if (!scored) {
+                onAbort();
+            }
+        });
+
+        const scoredJobs = candidates.length > 0 ? jobs.slice(1) : jobs;
+        const results = await Promise.all(
+            scoredJobs.map((job) => this.collectScores(requestId, job)),
+        );
+        scored = true;
+
+        abortSignal.throwIfAborted();
+        return results;
+    }
+
+    private async collectScores(
+        requestId: string,
+        job: Job,
+    ): Promise<ScoreResult> {
+        for await (const chunk of job.stream(true)) {
+            if (chunk.kind !== "finish") {
+                continue;
+            }
+
+            if (chunk.finishReason !== "Scored") {
+                this.handleReadbackFinish(requestId, chunk, "", 0);
+                throw new Error(`Scoring failed: ${chunk.finishReason}`);
+            }
+
+            const tokens = this.resolveLogprobs(chunk.logprobs) ?? [];
+            return {
+                tokens,
+                sumLogprob: tokens.reduce((sum, entry) => sum + entry.logprob, 0),
+                isGreedy: tokens.every((entry) =>
+                    entry.top.length > 0 && entry.top[0].token === entry.token
+                ),
+            };
+        }
+
+        throw new Error("Scoring completed without receiving finish chunk");
     }
 
     async generate(
@@ -456,15 +795,33 @@ export class Model {
         abortSignal: AbortSignal,
         taskIdx: number = 0,
     ): Promise<FinishChunk> {
-        let result: FinishChunk | undefined;
-
-        const generator = this.generateGen(
-            requestId,
-            prompt,
-            params,
-            abortSignal,
-            taskIdx,
+        return await this.collectGeneration(
+            this.generateGen(
+                requestId,
+                prompt,
+                params,
+                abortSignal,
+                taskIdx,
+            ),
         );
+    }
+
+    // n completions of one prompt. The prompt is prefilled once and forked.
+    generateForks(
+        requestId: string,
+        prompt: string,
+        params: BaseSamplerRequest,
+        abortSignal: AbortSignal,
+        n: number,
+    ): Promise<FinishChunk>[] {
+        return this.generateForkGens(requestId, prompt, params, abortSignal, n)
+            .map((generator) => this.collectGeneration(generator));
+    }
+
+    private async collectGeneration(
+        generator: AsyncGenerator<GenerationChunk>,
+    ): Promise<FinishChunk> {
+        let result: FinishChunk | undefined;
 
         for await (const chunk of generator) {
             if (chunk.kind === "finish") {
@@ -486,14 +843,30 @@ export class Model {
         return {
             ...result,
             text: result.fullText,
+            logprobs: result.fullLogprobs,
         };
     }
 
+    private resolveLogprobs(
+        logprobs?: ReadbackTokenLogprobs[],
+    ): TokenLogprobs[] | undefined {
+        return logprobs?.map((entry) => ({
+            ...this.tokenizer.tokenPiece(entry.token),
+            logprob: entry.logprob,
+            top: entry.top.map((alternative) => ({
+                ...this.tokenizer.tokenPiece(alternative.token),
+                logprob: alternative.logprob,
+            })),
+        }));
+    }
+
     handleReadbackFinish(
         requestId: string,
         finishResponse: ReadbackFinishChunk,
         fullText: string,
         taskIdx: number,
+        logprobs?: TokenLogprobs[],
+        fullLogprobs?: TokenLogprobs[],
     ): FinishChunk {
         switch (finishResponse.finishReason) {
             case "CtxExceeded":
@@ -527,65 +900,100 @@ export class Model {
                 } tokens)`,
         );
 
+        if (finishResponse.genTokens > 0) {
+            logger.info(
+                `Latency (ID: ${requestId}): ` +
+                    `TTFT ${finishResponse.ttftMs.toFixed(1)} ms ` +
+                    `(Tokenize: ${finishResponse.tokenizeMs.toFixed(1)} ms, ` +
+                    `Queue: ${finishResponse.queueMs.toFixed(1)} ms, ` +
+                    `Reused: ${finishResponse.prefixReuseTokens} tokens), ` +
+                    `ITL p50/p99/max ${finishResponse.itlP50Ms.toFixed(1)}/` +
+                    `${finishResponse.itlP99Ms.toFixed(1)}/` +
+                    `${finishResponse.itlMaxMs.toFixed(1)} ms`,
+            );
+        }
+
+        if (finishResponse.draftTokens > 0) {
+            logger.info(
+                `Speculative (ID: ${requestId}): ` +
+                    `${finishResponse.draftAcceptedTokens}/${finishResponse.draftTokens} ` +
+                    `draft tokens accepted ` +
+                    `(${(finishResponse.draftAcceptRate * 100).toFixed(1)}%)`,
+            );
+        }
+
         return {
             ...finishResponse,
             text: "",
             fullText,
+            logprobs,
+            fullLogprobs,
             taskIdx,
             requestId,
         };
     }
 
-    async *generateGen(
+    generateGen(
         requestId: string,
         prompt: string,
         params: BaseSamplerRequest,
         abortSignal: AbortSignal,
         taskIdx: number = 0,
     ): AsyncGenerator<GenerationChunk> {
-        // Get out if the model is shutting down
-        if (this.closing) {
-            throw new Error(
-                "Model is being unloaded. Cannot process new generation requests.",
-            );
-        }
+        // Append the Job ID first
+        this.activeJobIds.set(requestId, undefined);
 
-        // Fallback to the model's preference
-        // Ideally, this shouldn't be exposed, but frontends want it.
-        const addBosToken = params.add_bos_token ?? this.tokenizer.addBosToken;
+        const submission = this.submitJobs([requestId], prompt, params);
+        submission.catch(() => {});
 
-        const promptTokens = await this.tokenizer.tokenize(prompt, addBosToken, true);
-        const availableTokens = this.maxSeqLen - promptTokens.length;
-        const maxTokens = params.max_tokens === 0 ? availableTokens : params.max_tokens;
+        return this.streamJob(
+            requestId,
+            taskIdx,
+            submission,
+            0,
+            params,
+            abortSignal,
+        );
+    }
 
-        if (promptTokens.length + maxTokens > this.maxSeqLen) {
-            throw new Error(
-                `Prompt (${promptTokens.length} tokens) + max_tokens (${maxTokens} tokens) ` +
-                    `exceeds max context length of ${this.maxSeqLen} tokens`
-            );
+    // Streams for n completions of one prompt. Task indices follow the fork order.
+    generateForkGens(
+        requestId: string,
+        prompt: string,
+        params: BaseSamplerRequest,
+        abortSignal: AbortSignal,
+        n: number,
+    ): AsyncGenerator<GenerationChunk>[] {
+        const requestIds = n > 1
+            ? Array.from({ length: n }, (_, i) => `${requestId}-${i}`)
+            : [requestId];
+
+        // Append the Job IDs first
+        for (const id of requestIds) {
+            this.activeJobIds.set(id, undefined);
         }
 
-        // Initialize generation resources
-        const genResources = new GenerationResources();
-
-        using _ = defer(() => {
-            // Log generation params to console
-            logGenParams(requestId, params);
-
-            // Remove ID from active jobs
-            this.activeJobIds.delete(requestId);
-
-            // Mark shared generation resources for freeing
-            genResources.close();
-        });
-
-        // Append the Job ID first
-        this.activeJobIds.set(requestId, undefined);
-
-        const seed = params.seed && params.seed > 0
-            ? params.seed
-            : Math.floor(Math.random() * (0xFFFFFFFF + 1));
+        // Every stream rethrows a failed submission by itself
+        const submission = this.submitJobs(requestIds, prompt, params);
+        submission.catch(() => {});
+
+        return requestIds.map((id, taskIdx) =>
+            this.streamJob(
+                id,
+                taskIdx,
+                submission,
+                taskIdx,
+                params,
+                abortSignal,
+            )
+        );
+    }
 
+    private buildSampler(
+        genResources: GenerationResources,
+        params: BaseSamplerRequest,
+        seed: number,
+    ) {
         const logitBias: LogitBias[] = [];
         if (params.logit_bias) {
             for (const [tokenId, bias] of Object.entries(params.logit_bias)) {
@@ -696,8 +1104,64 @@ export class Model {
         }
 
         samplerBuilder.dist(seed);
+    }
 
-        const promptPtr = new TextEncoder().encode(prompt + "\0");
+    // Submits one prompt for every request ID. The first is the parent job, the rest are forks of it.
+    private async submitJobs(
+        requestIds: string[],
+        prompt: string,
+        params: BaseSamplerRequest,
+    ): Promise<{ jobs: Job[]; resources: GenerationResources[] }> {
+        // Get out if the model is shutting down
+        if (this.closing) {
+            throw new Error(
+                "Model is being unloaded. Cannot process new generation requests.",
+            );
+        }
+
+        // Fallback to the model's preference
+        // Ideally, this shouldn't be exposed, but frontends want it.
+        const addBosToken = params.add_bos_token ?? this.tokenizer.addBosToken;
+
+        const promptTokens = await this.tokenizer.tokenize(prompt, addBosToken, true);
+        const availableTokens = this.maxSeqLen - promptTokens.length;
+        const maxTokens = params.max_tokens === 0 ? availableTokens : params.max_tokens;
+
+        if (promptTokens.length + maxTokens > this.maxSeqLen) {
+            throw new Error(
+                `Prompt (${promptTokens.length} tokens) + max_tokens (${maxTokens} tokens) ` +
+                    `exceeds max context length of ${this.maxSeqLen} tokens`
+            );
+        }
+
+        // Initialize generation resources, each completion samples on its own
+        const resources: GenerationResources[] = [];
+        const seeds: number[] = [];
+
+        try {
+            for (let i = 0; i < requestIds.length; i++) {
+                const genResources = new GenerationResources();
+                resources.push(genResources);
+
+                // Forks start from the same KV, a shared seed would make them identical.
+                // The parent keeps the requested seed, so n = 1 is unchanged.
+                const seed = params.seed && params.seed > 0
+                    ? (params.seed + i) % (0xFFFFFFFF + 1)
+                    : Math.floor(Math.random() * (0xFFFFFFFF + 1));
+                seeds.push(seed);
+
+                this.buildSampler(genResources, params, seed);
+            }
+        } catch (error) {
+            for (const genResources of resources) {
+                genResources.close();
+            }
+
+            throw error;
+        }
+
+        // The prompt was tokenized for the length check, the processor takes the tokens as they are
+        const promptTokensPtr = new Int32Array(promptTokens);
 
         // These are numbers and strings, TS doesn't understand for some reason
         const stopTokens = params.stop.filter((e) =>
@@ -711,6 +1175,11 @@ export class Model {
         const rewindPtrArray = pointerArrayFromStrings(params.banned_strings);
         const stopTokensPtr = new Int32Array(stopTokens);
         const stopStringsPtr = pointerArrayFromStrings(stopStrings);
+        const forkResourcesPtr = new BigUint64Array(
+            resources.slice(1).map((genResources) =>
+                BigInt(Deno.UnsafePointer.value(genResources.rawPtr))
+            ),
+        );
 
         // Log prompt with BOS token
         const promptBosToken = addBosToken
@@ -724,66 +1193,125 @@ export class Model {
             );
         }
 
-        const jobId = lib.symbols.processor_submit_work(
+        const jobId = lib.symbols.processor_submit_tokens(
             this.processor,
-            promptPtr,
-            genResources.rawPtr,
+            promptTokensPtr,
+            promptTokensPtr.length,
+            resources[0].rawPtr,
             maxTokens,
             params.min_tokens,
             this.maxSeqLen,
-            seed,
+            seeds[0],
             rewindPtrArray.inner,
             params.banned_strings.length,
             stopStringsPtr.inner,
             stopStrings.length,
             stopTokensPtr,
             stopTokens.length,
-            addBosToken,
+            params.priority,
+            params.prompt_lookup ? params.prompt_lookup_ngram_size : 0,
+            params.prompt_lookup ? params.prompt_lookup_num_tokens : 0,
+            Model.wantsLogprobs(params),
+            typeof params.logprobs === "number"
+                ? params.logprobs
+                : params.top_logprobs,
+            forkResourcesPtr,
+            forkResourcesPtr.length,
         );
 
-        // Add the new job to active jobs for cancellation if needed
-        const job = new Job(
-            jobId,
-            genResources.readbackBuffer,
-            this.processor,
+        // Forks get the request IDs following the parent's
+        const jobs = resources.map((genResources, i) =>
+            new Job(
+                jobId + i,
+                genResources.readbackBuffer,
+                this.processor,
+            )
         );
+
+        return { jobs, resources };
+    }
+
+    private async *streamJob(
+        requestId: string,
+        taskIdx: number,
+        submission: Promise<{ jobs: Job[]; resources: GenerationResources[] }>,
+        index: number,
+        params: BaseSamplerRequest,
+        abortSignal: AbortSignal,
+    ): AsyncGenerator<GenerationChunk> {
+        let genResources: GenerationResources | undefined;
+
+        using _ = defer(() => {
+            // Log generation params to console
+            logGenParams(requestId, params);
+
+            // Remove ID from active jobs
+            this.activeJobIds.delete(requestId);
+
+            // Mark shared generation resources for freeing
+            genResources?.close();
+        });
+
+        const { jobs, resources } = await submission;
+        genResources = resources[index];
+
+        // Add the new job to active jobs for cancellation if needed
+        const job = jobs[index];
         this.activeJobIds.set(requestId, job);
 
         let fullText = "";
+        const withLogprobs = Model.wantsLogprobs(params);
+        const fullLogprobs: TokenLogprobs[] = [];
 
         // Read from the read buffer
-        for await (const chunk of job.stream()) {
+        for await (const chunk of job.stream(withLogprobs)) {
             if (abortSignal.aborted) {
                 job.cancel();
                 abortSignal.throwIfAborted();
             }
 
             switch (chunk.kind) {
-                case "data":
+                case "data": {
                     fullText += chunk.text;
 
+                    const logprobs = this.resolveLogprobs(chunk.logprobs);
+                    fullLogprobs.push(...logprobs ?? []);
+
                     yield {
                         ...chunk,
+                        logprobs,
                         taskIdx,
                         requestId,
                     };
                     break;
-                case "finish":
+                }
+                case "finish": {
                     if (config.logging.log_prompt) {
                         logSection("Response", fullText);
                     }
 
+                    const logprobs = this.resolveLogprobs(chunk.logprobs);
+                    fullLogprobs.push(...logprobs ?? []);
+
                     yield this.handleReadbackFinish(
                         requestId,
                         chunk,
                         fullText,
                         taskIdx,
+                        logprobs,
+                        withLogprobs ? fullLogprobs : undefined,
                     );
                     break;
+                }
             }
         }
     }
 
+    // A number is the legacy completions form, the top-k count itself
+    private static wantsLogprobs(params: BaseSamplerRequest) {
+        return params.logprobs != null && params.logprobs !== false;
+    }
+
     static getChatTemplate(model: Deno.PointerValue) {
         const templatePtr = lib.symbols.model_chat_template(model);
 
@@ -0,0 +1,61 @@
+import { lib } from "./lib.ts";
+
+// Upper bound on a single blocking wait, so a stalled buffer is rechecked
+const EMBEDDING_WAIT_MS = 100;
+
+/**
+ * EmbeddingBuffer holds the pooled vectors of an embedding job.
+ * The rows are read in place from native memory until the buffer is closed.
+ */
+export class EmbeddingBuffer {
+    rawPtr: Deno.PointerValue;
+
+    constructor() {
+        this.rawPtr = lib.symbols.embedding_buffer_make();
+        if (!this.rawPtr) {
+            throw new Error("Could not allocate embedding buffer.");
+        }
+    }
+
+    async wait() {
+        while (!lib.symbols.embedding_buffer_is_finished(this.rawPtr)) {
+            await lib.symbols.embedding_buffer_wait(this.rawPtr, EMBEDDING_WAIT_MS);
+        }
+    }
+
+    status() {
+        const statusPtr = lib.symbols.embedding_buffer_status(this.rawPtr);
+        return statusPtr
+            ? new Deno.UnsafePointerView(statusPtr).getCString()
+            : undefined;
+    }
+
+    get numTokens() {
+        return lib.symbols.embedding_buffer_n_tokens(this.rawPtr);
+    }
+
+    // Views into native memory, only valid until close
+    rows(): Float32Array[] {
+        const numInputs = lib.symbols.embedding_buffer_n_inputs(this.rawPtr);
+        const numEmbd = lib.symbols.embedding_buffer_n_embd(this.rawPtr);
+        const dataPtr = lib.symbols.embedding_buffer_data(this.rawPtr);
+        if (!dataPtr || numInputs === 0) {
+            return [];
+        }
+
+        const data = new Float32Array(
+            new Deno.UnsafePointerView(dataPtr).getArrayBuffer(
+                numInputs * numEmbd * Float32Array.BYTES_PER_ELEMENT,
+            ),
+        );
+
+        return Array.from(
+            { length: numInputs },
+            (_, i) => data.subarray(i * numEmbd, (i + 1) * numEmbd),
+        );
+    }
+
+    close() {
+        lib.symbols.embedding_buffer_release(this.rawPtr);
+    }
+}
@@ -20,14 +20,23 @@ export class Job {
         this.processor = processor;
     }
 
-    async *stream(): AsyncGenerator<ReadbackGenerationChunk> {
-        for await (const readbackChunk of this.readbackBuffer.read()) {
+    async *stream(
+        withLogprobs = false,
+    ): AsyncGenerator<ReadbackGenerationChunk> {
+        for await (
+            const readbackChunk of this.readbackBuffer.read(withLogprobs)
+        ) {
             yield readbackChunk;
         }
 
         const status = await this.readbackBuffer.readStatus();
         if (status) {
-            yield status;
+            yield {
+                ...status,
+                logprobs: this.readbackBuffer.takeTrailingLogprobs(
+                    withLogprobs,
+                ),
+            };
         }
     }
 
@@ -0,0 +1,85 @@
+import { lib } from "./lib.ts";
+
+// Field order of ProcessorMetrics in metrics.hpp, every field is a double
+const GAUGES = [
+    "queue_depth",
+    "parked_requests",
+    "slots_idle",
+    "slots_prompt",
+    "slots_generating",
+    "kv_tokens_used",
+    "kv_tokens_total",
+] as const;
+
+const COUNTERS = [
+    "decode_steps_total",
+    "decode_errors_total",
+    "prefill_tokens_total",
+    "decode_tokens_total",
+    "requests_started_total",
+    "requests_finished_total",
+    "prefix_reuse_tokens_total",
+    "rewinds_total",
+    "cancellations_total",
+    "preemptions_total",
+] as const;
+
+const HISTOGRAMS = [
+    "batch_fill_ratio",
+    "prefill_tokens_per_step",
+    "decode_tokens_per_step",
+    "decode_seconds",
+    "prefix_reuse_tokens",
+] as const;
+
+const HISTOGRAM_BUCKETS = 12;
+const HISTOGRAM_SIZE = HISTOGRAM_BUCKETS * 2 + 2;
+const METRICS_SIZE = GAUGES.length + COUNTERS.length +
+    HISTOGRAMS.length * HISTOGRAM_SIZE;
+
+export interface MetricsHistogram {
+    // Upper bounds, the last is Infinity. Counts are per bucket, not cumulative.
+    bounds: number[];
+    counts: number[];
+    sum: number;
+    count: number;
+}
+
+export interface ProcessorMetrics {
+    gauges: Record<typeof GAUGES[number], number>;
+    counters: Record<typeof COUNTERS[number], number>;
+    histograms: Record<typeof HISTOGRAMS[number], MetricsHistogram>;
+}
+
+export function readProcessorMetrics(
+    processor: Deno.PointerValue,
+): ProcessorMetrics {
+    const values = new Float64Array(METRICS_SIZE);
+    lib.symbols.processor_get_metrics(processor, values);
+
+    let offset = 0;
+    const take = (count: number) => {
+        const slice = values.subarray(offset, offset + count);
+        offset += count;
+        return [...slice];
+    };
+
+    const gauges = Object.fromEntries(
+        GAUGES.map((name) => [name, take(1)[0]]),
+    ) as ProcessorMetrics["gauges"];
+
+    const counters = Object.fromEntries(
+        COUNTERS.map((name) => [name, take(1)[0]]),
+    ) as ProcessorMetrics["counters"];
+
+    const histograms = Object.fromEntries(
+        HISTOGRAMS.map((name) => {
+            const bounds = take(HISTOGRAM_BUCKETS);
+            const counts = take(HISTOGRAM_BUCKETS);
+            const [sum, count] = take(2);
+            return [name, { bounds, counts, sum, count }];
+        }),
+    ) as ProcessorMetrics["histograms"];
+
+    return { gauges, counters, histograms };
+}
@@ -1,8 +1,20 @@
-import { delay } from "@std/async/delay";
-
 import { logger } from "@/common/logging.ts";
 import { lib } from "./lib.ts";
-import { ReadbackFinishChunk, ReadbackGenerationChunk } from "./types.ts";
+import {
+    ReadbackFinishChunk,
+    ReadbackGenerationChunk,
+    ReadbackTokenLogprobs,
+} from "./types.ts";
+
+// Tokens drained from the native logprob array per call
+const LOGPROB_DRAIN_TOKENS = 64;
+
+// Entries and text bytes copied out of native memory per read
+const READBACK_BATCH_ENTRIES = 256;
+const READBACK_BATCH_BYTES = 16 * 1024;
+
+// Upper bound on a single blocking wait, so a stalled buffer is rechecked
+const READBACK_WAIT_MS = 100;
 
 /**
  * ReadbackBuffer provides an interface to read generated tokens and text
@@ -11,37 +23,134 @@ import { ReadbackFinishChunk, ReadbackGenerationChunk } from "./types.ts";
 export class ReadbackBuffer {
     private rawPtr: Deno.PointerValue;
 
+    // Logprobs drained from native memory, tagged with the data entry they belong to
+    private pendingLogprobs: { entry: number; logprobs: ReadbackTokenLogprobs }[] = [];
+    private entriesRead = 0;
+
     constructor(readbackPtr: Deno.PointerValue) {
         this.rawPtr = readbackPtr;
     }
 
-    async *read(): AsyncGenerator<ReadbackGenerationChunk> {
+    private drainLogprobs() {
+        // Logprobs are enabled once the request reaches a slot
+        const topK = lib.symbols.readback_logprobs_top_k(this.rawPtr);
+        if (topK < 0) {
+            return;
+        }
+
+        const stride = 1 + topK;
+
+        // TokenLogprob is an int32 token followed by a float logprob
+        const records = new ArrayBuffer(LOGPROB_DRAIN_TOKENS * stride * 8);
+        const tokens = new Int32Array(records);
+        const logprobs = new Float32Array(records);
+        const entries = new Uint32Array(LOGPROB_DRAIN_TOKENS);
+
+        while (true) {
+            const count = lib.symbols.readback_read_logprobs(
+                this.rawPtr,
+                new Uint8Array(records),
+                entries,
+                LOGPROB_DRAIN_TOKENS,
+            );
+
+            for (let i = 0; i < count; i++) {
+                const base = i * stride * 2;
+                const top = [];
+                for (let k = 1; k < stride; k++) {
+                    top.push({
+                        token: tokens[base + k * 2],
+                        logprob: logprobs[base + k * 2 + 1],
+                    });
+                }
+
+                this.pendingLogprobs.push({
+                    entry: entries[i],
+                    logprobs: {
+                        token: tokens[base],
+                        logprob: logprobs[base + 1],
+                        top,
+                    },
+                });
+            }
+
+            if (count < LOGPROB_DRAIN_TOKENS) {
+                break;
+            }
+        }
+    }
+
+    // Takes the drained logprobs of every entry up to and including the given one
+    private takeLogprobs(entry: number) {
+        const taken = [];
+        while (
+            this.pendingLogprobs.length > 0 &&
+            this.pendingLogprobs[0].entry <= entry
+        ) {
+            taken.push(this.pendingLogprobs.shift()!.logprobs);
+        }
+
+        return taken;
+    }
+
+    // Logprobs of tokens without text, only complete once the buffer is finished
+    takeTrailingLogprobs(withLogprobs: boolean) {
+        if (!withLogprobs) {
+            return undefined;
+        }
+
+        this.drainLogprobs();
+        return this.takeLogprobs(Number.MAX_SAFE_INTEGER);
+    }
+
+    async *read(withLogprobs = false): AsyncGenerator<ReadbackGenerationChunk> {
+        const decoder = new TextDecoder();
+        const lengths = new Uint32Array(READBACK_BATCH_ENTRIES);
+        const tokens = new Int32Array(READBACK_BATCH_ENTRIES);
+        const bytes = new Uint32Array(1);
+        let text = new Uint8Array(READBACK_BATCH_BYTES);
+
         while (!lib.symbols.readback_is_buffer_finished(this.rawPtr)) {
-            const charBuf = new Uint8Array(8);
-            const tokenBuf = new Int32Array(1);
-
-            if (
-                !await lib.symbols.readback_read_next(
-                    this.rawPtr,
-                    Deno.UnsafePointer.of(charBuf),
-                    Deno.UnsafePointer.of(tokenBuf),
-                )
-            ) {
-                await delay(1);
+            // Everything written so far is copied in one call, then block until the next write
+            const count = lib.symbols.readback_read_batch(
+                this.rawPtr,
+                text,
+                text.length,
+                lengths,
+                tokens,
+                READBACK_BATCH_ENTRIES,
+                bytes,
+            );
+
+            if (count === 0) {
+                // A single entry larger than the text buffer
+                if (bytes[0] > text.length) {
+                    text = new Uint8Array(bytes[0]);
+                    continue;
+                }
+
+                await lib.symbols.readback_wait(this.rawPtr, READBACK_WAIT_MS);
                 continue;
             }
 
-            const ptrVal = new BigUint64Array(charBuf.buffer)[0];
-            if (ptrVal === 0n) continue;
+            if (withLogprobs) {
+                this.drainLogprobs();
+            }
 
-            const charPtr = Deno.UnsafePointer.create(ptrVal);
-            if (!charPtr) continue;
+            let offset = 0;
+            for (let i = 0; i < count; i++) {
+                const entry = this.entriesRead++;
+                const end = offset + lengths[i];
 
-            yield {
-                kind: "data",
-                text: new Deno.UnsafePointerView(charPtr).getCString(),
-                token: tokenBuf[0],
-            };
+                yield {
+                    kind: "data",
+                    text: decoder.decode(text.subarray(offset, end)),
+                    token: tokens[i],
+                    logprobs: withLogprobs ? this.takeLogprobs(entry) : undefined,
+                };
+
+                offset = end;
+            }
         }
     }
 
@@ -0,0 +1,102 @@
+#ifndef BATCH_SCHEDULER_HPP
+#define BATCH_SCHEDULER_HPP
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+/*
+ * The batch scheduler decides how the tokens of a single llama_decode step are shared between slots.
+ *
+ * Provides:
+ * Decode-first planning. Generating slots are always given their decode token before any prompt is ingested.
+ * Chunked prefill. Whatever is left of the step budget is handed out to prompt slots in chunks.
+ *
+ * Mechanism:
+ * The processor reserves the decode tokens itself, then asks the scheduler to split the leftover budget
+ * between the slots that still have prompt tokens pending, using the configured policy.
+ */
+
+enum class PrefillPolicy {
+    // The first prompt slot takes as much as it can, the next one gets the leftovers. Best prefill throughput.
+    SLOT_ORDER = 0,
+
+    // The leftover budget is split evenly between prompt slots. Unused shares are handed to the others.
+    FAIR_SHARE = 1,
+};
+
+class BatchScheduler {
+    uint32_t step_token_budget;
+    PrefillPolicy policy;
+
+public:
+    explicit BatchScheduler(const uint32_t step_token_budget = 0, const PrefillPolicy policy = PrefillPolicy::FAIR_SHARE)
+        : step_token_budget(step_token_budget), policy(policy) {
+    }
+
+    // Tokens allowed per step. A budget of 0 (or a budget above the batch) means the whole batch.
+    [[nodiscard]] uint32_t step_budget(const uint32_t batch_size) const {
+        if (step_token_budget == 0 || step_token_budget > batch_size) {
+            return batch_size;
+        }
+        return step_token_budget;
+    }
+
+    // Prefill tokens every step keeps for prompts, however many decode tokens there are
+    [[nodiscard]] static uint32_t prefill_floor(const uint32_t step_budget) {
+        return std::max<uint32_t>(1, step_budget / 8);
+    }
+
+    // Prefill budget left after the decode tokens were reserved.
+    // A small floor is kept so prompts still make progress when decode tokens eat the whole budget.
+    [[nodiscard]] static uint32_t prefill_budget(const uint32_t step_budget, const uint32_t batch_size, const uint32_t decode_tokens) {
+        if (decode_tokens >= batch_size) {
+            return 0;
+        }
+
+        const uint32_t floor = prefill_floor(step_budget);
+        const uint32_t left = step_budget > decode_tokens ? step_budget - decode_tokens : 0;
+        return std::min(std::max(left, floor), batch_size - decode_tokens);
+    }
+
+    // Splits the prefill budget between prompt slots. remaining[i] is the number of prompt tokens slot i still needs,
+    // chunks[i] receives the number of tokens that slot may ingest this step.
+    void plan_prefill(const std::vector<uint32_t>& remaining, uint32_t budget, std::vector<uint32_t>& chunks) const {
+        chunks.assign(remaining.size(), 0);
+
+        if (policy == PrefillPolicy::SLOT_ORDER) {
+            for (size_t i = 0; i < remaining.size() && budget > 0; i++) {
+                chunks[i] = std::min(remaining[i], budget);
+                budget -= chunks[i];
+            }
+            return;
+        }
+
+        // Water filling: every unsatisfied slot gets an equal share, shares a slot can't use go back to the pool.
+        size_t unsatisfied = 0;
+        for (const auto tokens : remaining) {
+            unsatisfied += tokens > 0 ? 1 : 0;
+        }
+
+        while (budget > 0 && unsatisfied > 0) {
+            const uint32_t share = std::max<uint32_t>(1, budget / static_cast<uint32_t>(unsatisfied));
+
+            for (size_t i = 0; i < remaining.size() && budget > 0; i++) {
+                const uint32_t wanted = remaining[i] - chunks[i];
+                if (wanted == 0) {
+                    continue;
+                }
+
+                const uint32_t granted = std::min({share, wanted, budget});
+                chunks[i] += granted;
+                budget -= granted;
+
+                if (granted == wanted) {
+                    unsatisfied--;
+                }
+            }
+        }
+    }
+};
+
+#endif // BATCH_SCHEDULER_HPP
@@ -22,9 +22,16 @@ int processor_submit_work(
     const unsigned num_stopping_strings,
     const int32_t* stopping_tokens,
     const unsigned num_stopping_tokens,
-    const bool add_special) {
-
-    const std::string prompt_as_string(prompt);
+    const bool add_special,
+    const int priority,
+    const int ngram_size,
+    const int ngram_draft_tokens,
+    const bool logprobs,
+    const int top_logprobs,
+    GenerationResources** fork_resources,
+    const unsigned num_forks) {
+
+    std::string prompt_as_string(prompt);
     const InferenceArgs args(
         gen_resources,
         max_tokens,
@@ -37,20 +44,196 @@ int processor_submit_work(
         num_stopping_strings,
         stopping_tokens,
         num_stopping_tokens,
-        add_special
+        add_special,
+        priority,
+        ngram_size,
+        ngram_draft_tokens,
+        logprobs,
+        top_logprobs
     );
 
+    std::vector<GenerationResources*> forks;
+    if (fork_resources != nullptr && num_forks > 0) {
+        forks.assign(fork_resources, fork_resources + num_forks);
+    }
+
     return processor->submit_work(
-        prompt_as_string,
-        args);
+        std::move(prompt_as_string),
+        args,
+        forks);
+}
+
+int processor_submit_tokens(
+    Processor* processor,
+    const int32_t* prompt_tokens,
+    const unsigned num_prompt_tokens,
+    GenerationResources* gen_resources,
+    const int max_tokens,
+    const int min_tokens,
+    const uint32_t max_slot_n_ctx,
+    const unsigned seed,
+    const char** rewind_strings,
+    const unsigned num_rewind_strings,
+    const char** stopping_strings,
+    const unsigned num_stopping_strings,
+    const int32_t* stopping_tokens,
+    const unsigned num_stopping_tokens,
+    const int priority,
+    const int ngram_size,
+    const int ngram_draft_tokens,
+    const bool logprobs,
+    const int top_logprobs,
+    GenerationResources** fork_resources,
+    const unsigned num_forks) {
+
+    // Special tokens are already in the prompt
+    const InferenceArgs args(
+        gen_resources,
+        max_tokens,
+        min_tokens,
+        max_slot_n_ctx,
+        seed,
+        rewind_strings,
+        num_rewind_strings,
+        stopping_strings,
+        num_stopping_strings,
+        stopping_tokens,
+        num_stopping_tokens,
+        false,
+        priority,
+        ngram_size,
+        ngram_draft_tokens,
+        logprobs,
+        top_logprobs
+    );
+
+    std::vector<llama_token> tokens;
+    if (prompt_tokens != nullptr && num_prompt_tokens > 0) {
+        tokens.assign(prompt_tokens, prompt_tokens + num_prompt_tokens);
+    }
+
+    std::vector<GenerationResources*> forks;
+    if (fork_resources != nullptr && num_forks > 0) {
+        forks.assign(fork_resources, fork_resources + num_forks);
+    }
+
+    return processor->submit_tokens(
+        std::move(tokens),
+        args,
+        forks);
+}
+
+int processor_submit_scoring(
+    Processor* processor,
+    const char* context,
+    const char** candidates,
+    const unsigned num_candidates,
+    GenerationResources* gen_resources,
+    GenerationResources** candidate_resources,
+    const uint32_t max_slot_n_ctx,
+    const bool add_special,
+    const int priority,
+    const int top_logprobs) {
+
+    // Nothing is generated, the logprobs of the prompt are the result
+    const InferenceArgs args(
+        gen_resources,
+        0,
+        0,
+        max_slot_n_ctx,
+        0,
+        nullptr,
+        0,
+        nullptr,
+        0,
+        nullptr,
+        0,
+        add_special,
+        priority,
+        0,
+        0,
+        true,
+        top_logprobs
+    );
+
+    std::vector<std::string> candidate_strings;
+    std::vector<GenerationResources*> resources;
+    if (candidates != nullptr && candidate_resources != nullptr && num_candidates > 0) {
+        candidate_strings.assign(candidates, candidates + num_candidates);
+        resources.assign(candidate_resources, candidate_resources + num_candidates);
+    }
+
+    return processor->submit_scoring(
+        std::string(context),
+        candidate_strings,
+        args,
+        resources);
 }
 
 bool processor_cancel_work(Processor* processor, const int request_id_to_cancel) {
     return processor->cancel_work(request_id_to_cancel);
 }
 
-Processor* processor_make(llama_model* model, llama_context* ctx, llama_memory_t mem, const int num_processor_slots) {
-    return new Processor(model, ctx, mem, num_processor_slots);
+void processor_get_metrics(Processor* processor, ProcessorMetrics* out) {
+    processor->get_metrics(*out);
+}
+
+void processor_set_tracing(Processor* processor, const bool enable) {
+    processor->set_tracing(enable);
+}
+
+char* processor_dump_trace(Processor* processor) {
+    const std::string trace = processor->dump_trace();
+    const auto result = new char[trace.size() + 1];
+    std::memcpy(result, trace.c_str(), trace.size() + 1);
+    return result;
+}
+
+Processor* processor_make(
+    llama_model* model,
+    llama_context* ctx,
+    llama_memory_t mem,
+    const int num_processor_slots,
+    const uint32_t step_token_budget,
+    const int prefill_policy,
+    const uint32_t host_cache_mb,
+    const char* disk_cache_dir,
+    const uint32_t disk_cache_mb,
+    const int cache_type_k,
+    const int cache_type_v,
+    const bool flash_attn,
+    llama_model* draft_model,
+    llama_context* draft_ctx,
+    const int num_draft_tokens,
+    llama_context* embedding_ctx) {
+    return new Processor(
+        model,
+        ctx,
+        mem,
+        num_processor_slots,
+        step_token_budget,
+        static_cast<PrefillPolicy>(prefill_policy),
+        static_cast<size_t>(host_cache_mb) * 1024 * 1024,
+        disk_cache_dir,
+        static_cast<size_t>(disk_cache_mb) * 1024 * 1024,
+        cache_type_k,
+        cache_type_v,
+        flash_attn,
+        draft_model,
+        draft_ctx,
+        num_draft_tokens,
+        embedding_ctx);
+}
+
+bool processor_submit_embeddings(
+    Processor* processor,
+    EmbeddingBuffer* buffer,
+    const char** inputs,
+    const unsigned num_inputs,
+    const bool add_special,
+    const bool normalize) {
+    const std::vector<std::string> input_strings(inputs, inputs + num_inputs);
+    return processor->submit_embeddings(buffer, input_strings, add_special, normalize);
 }
 
 void processor_free(const Processor* processor) {
@@ -199,10 +382,19 @@ int32_t model_n_layer(const llama_model* model)
     return llama_model_n_layer(model);
 }
 
+int32_t model_vocab_n_tokens(const llama_model* model)
+{
+    return llama_vocab_n_tokens(&model->vocab);
+}
+
 const char* model_vocab_token_to_string(const llama_model* model, const llama_token token) {
     return llama_vocab_get_text(&model->vocab, token);
 }
 
+int32_t model_vocab_token_to_piece(const llama_model* model, const llama_token token, char* buf, const int32_t buf_size) {
+    return llama_token_to_piece(&model->vocab, token, buf, buf_size, 0, true);
+}
+
 llama_context* ctx_make(
     llama_model* model,
     const unsigned context_length,
@@ -223,6 +415,9 @@ llama_context* ctx_make(
     ctx_params.n_batch = num_batches;
     ctx_params.n_ubatch = num_physical_batches;
     ctx_params.n_seq_max = num_slots;
+
+    // One KV pool shared by every slot. Required for sharing prefix cells between slots with seq_cp.
+    ctx_params.kv_unified = true;
     ctx_params.no_perf = false;
     ctx_params.flash_attn_type = flash_attn ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
 
@@ -249,6 +444,34 @@ llama_context* ctx_make(
     return ctx;
 }
 
+// Pooling context for embedding jobs. Inputs are decoded whole, so the batch is also the context.
+llama_context* ctx_make_embedding(
+    llama_model* model,
+    const unsigned num_batch_tokens,
+    const int32_t num_seqs,
+    const int32_t num_threads,
+    const bool flash_attn,
+    const int pooling_type
+) {
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = num_batch_tokens;
+    ctx_params.n_batch = num_batch_tokens;
+    ctx_params.n_ubatch = num_batch_tokens;
+    ctx_params.n_seq_max = num_seqs;
+    ctx_params.kv_unified = true;
+
+    if (num_threads > 0) {
+        ctx_params.n_threads = num_threads;
+        ctx_params.n_threads_batch = num_threads;
+    }
+
+    ctx_params.embeddings = true;
+    ctx_params.pooling_type = static_cast<enum llama_pooling_type>(pooling_type);
+    ctx_params.flash_attn_type = flash_attn ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
+
+    return llama_init_from_model(model, ctx_params);
+}
+
 uint32_t ctx_max_seq_len(const llama_context* ctx)
 {
     return llama_n_ctx(ctx);
@@ -11,6 +11,9 @@ extern "C" {
     typedef struct Processor Processor;
     typedef struct ReadbackBuffer ReadbackBuffer;
     typedef struct GenerationResources GenerationResources;
+    typedef struct EmbeddingBuffer EmbeddingBuffer;
+    typedef struct TokenLogprob TokenLogprob;
+    typedef struct ProcessorMetrics ProcessorMetrics;
 
     // ~~~ Lcpp Model ~~~
 
@@ -51,17 +54,104 @@ extern "C" {
         const unsigned num_stopping_strings,
         const int32_t* stopping_tokens,
         const unsigned num_stopping_tokens,
-        const bool add_special);
+        const bool add_special,
+        const int priority,
+        const int ngram_size,
+        const int ngram_draft_tokens,
+        const bool logprobs,
+        const int top_logprobs,
+        GenerationResources** fork_resources,
+        const unsigned num_forks);
+
+    // Same as processor_submit_work with a prompt tokenized by the caller, BOS/EOS included
+    int processor_submit_tokens(
+        Processor* processor,
+        const int32_t* prompt_tokens,
+        unsigned num_prompt_tokens,
+        GenerationResources* gen_resources,
+        int max_tokens,
+        int min_tokens,
+        uint32_t max_slot_n_ctx,
+        unsigned seed,
+        const char** rewind_strings,
+        unsigned num_rewind_strings,
+        const char** stopping_strings,
+        unsigned num_stopping_strings,
+        const int32_t* stopping_tokens,
+        unsigned num_stopping_tokens,
+        int priority,
+        int ngram_size,
+        int ngram_draft_tokens,
+        bool logprobs,
+        int top_logprobs,
+        GenerationResources** fork_resources,
+        unsigned num_forks);
+
+    // Scores each candidate as a continuation of the context, or the context itself without candidates.
+    // Candidate i reports to candidate_resources[i] under the returned id + 1 + i.
+    int processor_submit_scoring(
+        Processor* processor,
+        const char* context,
+        const char** candidates,
+        unsigned num_candidates,
+        GenerationResources* gen_resources,
+        GenerationResources** candidate_resources,
+        uint32_t max_slot_n_ctx,
+        bool add_special,
+        int priority,
+        int top_logprobs);
 
+    // Queued and parked requests finish as "Aborted" right away. A running request is ended by the worker at its
+    // next step, so its "Aborted" readback arrives up to one step later. Returns false for ids never handed out.
     bool processor_cancel_work(
         Processor* processor,
         int request_id_to_cancel);
 
+    // Starts (with an empty timeline) or stops recording trace spans
+    void processor_set_tracing(
+        Processor* processor,
+        bool enable);
+
+    // LEAKABLE! Ensure you use endpoint_free_string to clean up.
+    // Chrome trace-event JSON of the recorded spans.
+    char* processor_dump_trace(
+        Processor* processor);
+
+    // Copies the latest metrics snapshot, an array of doubles laid out as in metrics.hpp. Never blocks the worker.
+    void processor_get_metrics(
+        Processor* processor,
+        ProcessorMetrics* out);
+
+    // step_token_budget: max tokens per decode step (0 = batch size)
+    // prefill_policy: 0 = slot order, 1 = fair share
+    // host_cache_mb: RAM for spilled KV sequences (0 = disabled)
+    // cache_type_k, cache_type_v, flash_attn: as given to ctx_make, disk snapshots are only valid for the same values
     Processor* processor_make(
         llama_model* model,
         llama_context* ctx,
         llama_memory_t mem,
-        int num_processor_slots);
+        int num_processor_slots,
+        uint32_t step_token_budget,
+        int prefill_policy,
+        uint32_t host_cache_mb,
+        const char* disk_cache_dir,
+        uint32_t disk_cache_mb,
+        int cache_type_k,
+        int cache_type_v,
+        bool flash_attn,
+        llama_model* draft_model,
+        llama_context* draft_ctx,
+        int num_draft_tokens,
+        llama_context* embedding_ctx);
+
+    // Returns false if the job was rejected, the reason is in the buffer status.
+    bool processor_submit_embeddings(
+        Processor* processor,
+        EmbeddingBuffer* buffer,
+        const char** inputs,
+        unsigned num_inputs,
+        bool add_special,
+        bool normalize);
 
     void processor_free(
         const Processor* processor);
@@ -107,11 +197,21 @@ extern "C" {
     int32_t model_n_layer(
         const llama_model* model);
 
+    int32_t model_vocab_n_tokens(
+        const llama_model* model);
+
     // LEAKABLE! Ensure you use endpoint_free_string to clean up.
     const char* model_vocab_token_to_string(
         const llama_model* model,
         llama_token token);
 
+    // Detokenized bytes of one token, not null terminated. Returns the negated size if buf is too small.
+    int32_t model_vocab_token_to_piece(
+        const llama_model* model,
+        llama_token token,
+        char* buf,
+        int32_t buf_size);
+
     // ~~~ Lcpp Context ~~~
 
     // LEAKABLE! Ensure you use ctx_free to clean up.
@@ -131,6 +231,17 @@ extern "C" {
         bool offload_kqv
     );
 
+    // LEAKABLE! Ensure you use ctx_free to clean up.
+    // pooling_type: -1 = model default, 1 = mean, 2 = cls, 3 = last
+    llama_context* ctx_make_embedding(
+        llama_model* model,
+        unsigned num_batch_tokens,
+        int32_t num_seqs,
+        int32_t num_threads,
+        bool flash_attn,
+        int pooling_type
+    );
+
     uint32_t ctx_max_seq_len(
         const llama_context* ctx);
 
@@ -148,16 +259,45 @@ extern "C" {
     bool readback_is_buffer_finished(
         ReadbackBuffer* buffer);
 
+    // The text stays valid until the next call
     bool readback_read_next(
         ReadbackBuffer* buffer,
         char** outChar,
         llama_token* outToken);
 
+    // Copies every pending entry that fits, see readback_buffer.hpp. Returns the number of entries.
+    // 0 with a non-zero *out_bytes means the next entry needs a text buffer of *out_bytes.
+    unsigned readback_read_batch(
+        ReadbackBuffer* buffer,
+        char* out_text,
+        uint32_t text_capacity,
+        uint32_t* out_lengths,
+        llama_token* out_tokens,
+        unsigned max_entries,
+        uint32_t* out_bytes);
+
+    // Blocks until a token is readable or the buffer is finished. False after timeout_ms without either.
+    bool readback_wait(
+        ReadbackBuffer* buffer,
+        uint32_t timeout_ms);
+
     //TODO::@Z Validate.
     //  Not leakable, owned by readback buffer ?
     char* readback_read_status(
         ReadbackBuffer* buffer);
 
+    // -1 if logprobs are disabled
+    int readback_logprobs_top_k(
+        ReadbackBuffer* buffer);
+
+    // Drains up to max_tokens tokens, out_logprobs holds max_tokens * (1 + top_k) records.
+    // out_entries receives the data entry index each token belongs to.
+    unsigned readback_read_logprobs(
+        ReadbackBuffer* buffer,
+        TokenLogprob* out_logprobs,
+        uint32_t* out_entries,
+        unsigned max_tokens);
+
     void readback_annihilate(
         ReadbackBuffer* buffer);
 
@@ -269,6 +409,39 @@ extern "C" {
     void generation_resources_release(
         GenerationResources* resources);
 
+    // ~~~ Embedding Buffer ~~~
+
+    //Leakable! Shared PTR behaviour, use release to free.
+    EmbeddingBuffer* embedding_buffer_make();
+
+    void embedding_buffer_release(
+        EmbeddingBuffer* buffer);
+
+    bool embedding_buffer_is_finished(
+        const EmbeddingBuffer* buffer);
+
+    // Blocks until the buffer is finished. False after timeout_ms without it.
+    bool embedding_buffer_wait(
+        EmbeddingBuffer* buffer,
+        uint32_t timeout_ms);
+
+    // Not leakable, static string
+    const char* embedding_buffer_status(
+        const EmbeddingBuffer* buffer);
+
+    // Owned by the buffer. n_inputs x n_embd floats, row-major.
+    const float* embedding_buffer_data(
+        const EmbeddingBuffer* buffer);
+
+    int32_t embedding_buffer_n_embd(
+        const EmbeddingBuffer* buffer);
+
+    int32_t embedding_buffer_n_inputs(
+        const EmbeddingBuffer* buffer);
+
+    int32_t embedding_buffer_n_tokens(
+        const EmbeddingBuffer* buffer);
+
     // ~~~ Features ~~~
 
     bool has_llguidance();
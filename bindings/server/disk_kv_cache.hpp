@@ -0,0 +1,433 @@
+#ifndef DISK_KV_CACHE_HPP
+#define DISK_KV_CACHE_HPP
+
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <filesystem>
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include "llama.h"
+#include "host_kv_cache.hpp"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * A persistent on-disk tier for prompt KV sequences, so warm restarts don't have to prefill again.
+ *
+ * Provides:
+ * Snapshots of prompt sequence state that survive process restarts and model reloads.
+ * Longest-prefix lookups over the snapshots of the loaded model, and lazy loading into a slot.
+ *
+ * Mechanism:
+ * Files are named after a fingerprint of the model and context plus a hash of the prompt tokens.
+ * Only headers and tokens are read at startup. The state itself is memory mapped when a prompt needs it.
+ * Serialization happens on the worker thread, the file write itself on a background writer thread.
+ */
+
+// Read-only memory map of a whole file.
+class MappedFile {
+    void* data {nullptr};
+    size_t size {0};
+
+#ifdef _WIN32
+    HANDLE file {INVALID_HANDLE_VALUE};
+    HANDLE mapping {nullptr};
+#endif
+
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+            return;
+        }
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            return;
+        }
+
+        data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (data) {
+            size = static_cast<size_t>(file_size.QuadPart);
+        }
+#else
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+
+        const off_t file_size = lseek(fd, 0, SEEK_END);
+        if (file_size > 0) {
+            void* addr = mmap(nullptr, static_cast<size_t>(file_size), PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED) {
+                data = addr;
+                size = static_cast<size_t>(file_size);
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data) munmap(data, size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    [[nodiscard]] const uint8_t* bytes() const { return static_cast<const uint8_t*>(data); }
+    [[nodiscard]] size_t length() const { return size; }
+};
+
+// Identifies the model and context a snapshot was taken with. The cache types and flash attention aren't exposed by
+// the context, they're the values it was made with.
+inline uint64_t kv_cache_fingerprint(const llama_model* model, const llama_context* ctx, const int type_k,
+                                     const int type_v, const bool flash_attn) {
+    char desc[256] = {};
+    llama_model_desc(model, desc, sizeof(desc));
+
+    const uint64_t params[] = {
+        llama_model_n_params(model),
+        llama_model_size(model),
+        static_cast<uint64_t>(llama_vocab_n_tokens(llama_model_get_vocab(model))),
+        static_cast<uint64_t>(llama_model_n_embd(model)),
+        static_cast<uint64_t>(llama_n_ctx(ctx)),
+        static_cast<uint64_t>(static_cast<uint32_t>(type_k)),
+        static_cast<uint64_t>(static_cast<uint32_t>(type_v)),
+        static_cast<uint64_t>(flash_attn),
+    };
+
+    std::vector<llama_token> key;
+    for (const char c : std::string(desc)) {
+        key.push_back(static_cast<llama_token>(c));
+    }
+    for (const uint64_t param : params) {
+        key.push_back(static_cast<llama_token>(param & 0xffffffff));
+        key.push_back(static_cast<llama_token>(param >> 32));
+    }
+    return hash_tokens(key.data(), key.size());
+}
+
+class DiskKVCache {
+    static constexpr char magic[8] = {'Y', 'A', 'L', 'S', 'K', 'V', '0', '1'};
+
+    struct FileHeader {
+        char magic[8];
+        uint64_t fingerprint;
+        uint64_t n_tokens;
+        uint64_t state_size;
+    };
+
+    struct Entry {
+        std::string path;
+        std::vector<llama_token> tokens;
+        uint64_t state_offset{0};
+        uint64_t state_size{0};
+        uint64_t last_used{0};
+    };
+
+    struct PendingWrite {
+        std::string path;
+        std::vector<llama_token> tokens;
+        std::vector<uint8_t> state;
+    };
+
+    std::filesystem::path directory;
+    uint64_t fingerprint{0};
+    size_t max_bytes{0};
+
+    // Index of snapshots on disk. Shared with the writer thread.
+    std::vector<Entry> entries;
+    size_t used_bytes{0};
+    uint64_t tick{0};
+    std::mutex mutex_entries;
+
+    std::deque<PendingWrite> queue_writes;
+    std::mutex mutex_writes;
+    std::condition_variable cv_writes;
+    std::thread writer_thread;
+    bool should_exit{false};
+
+    [[nodiscard]] std::string file_name(const std::vector<llama_token>& tokens) const {
+        char name[64];
+        snprintf(name, sizeof(name), "%016llx-%016llx.kv",
+                 static_cast<unsigned long long>(fingerprint),
+                 static_cast<unsigned long long>(hash_tokens(tokens.data(), tokens.size())));
+        return (directory / name).string();
+    }
+
+    // Reads only the header and tokens of a snapshot, the state stays on disk until needed.
+    bool read_index_entry(const std::filesystem::path& path, Entry& entry) const {
+        std::ifstream file(path, std::ios::binary);
+        FileHeader header{};
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+            return false;
+        }
+
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.fingerprint != fingerprint) {
+            return false;
+        }
+
+        entry.path = path.string();
+        entry.tokens.resize(header.n_tokens);
+        if (!file.read(reinterpret_cast<char*>(entry.tokens.data()), static_cast<std::streamsize>(header.n_tokens * sizeof(llama_token)))) {
+            return false;
+        }
+
+        entry.state_offset = sizeof(header) + header.n_tokens * sizeof(llama_token);
+        entry.state_size = header.state_size;
+
+        std::error_code ec;
+        return std::filesystem::file_size(path, ec) == entry.state_offset + entry.state_size && !ec;
+    }
+
+    void load_index() {
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+
+        for (const auto& file : std::filesystem::directory_iterator(directory, ec)) {
+            // Left behind by a write that was interrupted. Nothing else writes to the directory yet.
+            if (file.path().extension() == ".tmp") {
+                std::error_code remove_ec;
+                std::filesystem::remove(file.path(), remove_ec);
+                continue;
+            }
+
+            if (file.path().extension() != ".kv") {
+                continue;
+            }
+
+            Entry entry;
+            if (read_index_entry(file.path(), entry)) {
+                used_bytes += entry.state_size;
+                entries.push_back(std::move(entry));
+            }
+        }
+    }
+
+    // Removes least recently used snapshots until the budget is respected. Requires mutex_entries.
+    void enforce_budget() {
+        while (used_bytes > max_bytes && !entries.empty()) {
+            auto victim = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->last_used < victim->last_used) {
+                    victim = it;
+                }
+            }
+
+            std::error_code ec;
+            std::filesystem::remove(victim->path, ec);
+            used_bytes -= victim->state_size;
+            entries.erase(victim);
+        }
+    }
+
+    void write_snapshot(PendingWrite& write) {
+        const FileHeader header {
+            {magic[0], magic[1], magic[2], magic[3], magic[4], magic[5], magic[6], magic[7]},
+            fingerprint,
+            write.tokens.size(),
+            write.state.size()
+        };
+
+        // Write to a temporary file first so a crash never leaves a truncated snapshot behind
+        const std::string tmp_path = write.path + ".tmp";
+        {
+            std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(write.tokens.data()), static_cast<std::streamsize>(write.tokens.size() * sizeof(llama_token)));
+            file.write(reinterpret_cast<const char*>(write.state.data()), static_cast<std::streamsize>(write.state.size()));
+            if (!file) {
+                std::error_code ec;
+                std::filesystem::remove(tmp_path, ec);
+                return;
+            }
+        }
+
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, write.path, ec);
+        if (ec) {
+            std::filesystem::remove(tmp_path, ec);
+            return;
+        }
+
+        Entry entry;
+        entry.path = write.path;
+        entry.tokens = std::move(write.tokens);
+        entry.state_offset = sizeof(header) + entry.tokens.size() * sizeof(llama_token);
+        entry.state_size = write.state.size();
+
+        // The same prompt may have been queued twice, the rename replaced the older file
+        std::lock_guard lock(mutex_entries);
+        entry.last_used = ++tick;
+        used_bytes += entry.state_size;
+        const auto existing = std::find_if(entries.begin(), entries.end(), [&entry](const Entry& candidate) {
+            return candidate.path == entry.path;
+        });
+        if (existing != entries.end()) {
+            used_bytes -= existing->state_size;
+            *existing = std::move(entry);
+        } else {
+            entries.push_back(std::move(entry));
+        }
+        enforce_budget();
+    }
+
+    void run_writer() {
+        while (true) {
+            std::unique_lock lock(mutex_writes);
+            cv_writes.wait(lock, [this] { return !queue_writes.empty() || should_exit; });
+            if (queue_writes.empty()) {
+                return;
+            }
+
+            PendingWrite write = std::move(queue_writes.front());
+            queue_writes.pop_front();
+            lock.unlock();
+
+            write_snapshot(write);
+        }
+    }
+
+public:
+    // Prompts shorter than this are cheap enough to prefill on every start.
+    static constexpr size_t min_save_tokens = 1024;
+
+    // The snapshot's path identifies it, indices shift whenever the writer evicts one
+    struct Match {
+        std::string path;
+        size_t length{0};
+    };
+
+    DiskKVCache() = default;
+
+    DiskKVCache(const DiskKVCache&) = delete;
+    DiskKVCache& operator=(const DiskKVCache&) = delete;
+
+    ~DiskKVCache() {
+        {
+            std::lock_guard lock(mutex_writes);
+            should_exit = true;
+        }
+        cv_writes.notify_all();
+        if (writer_thread.joinable()) {
+            writer_thread.join();
+        }
+    }
+
+    void open(const std::string& cache_dir, const uint64_t model_fingerprint, const size_t max_cache_bytes) {
+        directory = cache_dir;
+        fingerprint = model_fingerprint;
+        max_bytes = max_cache_bytes;
+
+        load_index();
+        writer_thread = std::thread(&DiskKVCache::run_writer, this);
+    }
+
+    [[nodiscard]] bool enabled() const {
+        return max_bytes > 0 && writer_thread.joinable();
+    }
+
+    [[nodiscard]] Match longest_prefix(const std::vector<llama_token>& tokens) {
+        std::lock_guard lock(mutex_entries);
+
+        Match best;
+        for (size_t index = 0; index < entries.size(); index++) {
+            const auto& entry_tokens = entries[index].tokens;
+            size_t i = 0;
+            while (i < entry_tokens.size() && i < tokens.size() && entry_tokens[i] == tokens[i]) {
+                i++;
+            }
+
+            if (i > best.length) {
+                best = {entries[index].path, i};
+            }
+        }
+        return best;
+    }
+
+    // Maps the snapshot at path and loads it into seq_id, which must be empty. Copies the snapshot tokens into
+    // tokens_out. Fails if the snapshot was evicted since it was matched.
+    bool restore(llama_context* ctx, const llama_seq_id seq_id, const std::string& path, std::vector<llama_token>& tokens_out) {
+        uint64_t offset, size;
+        {
+            std::lock_guard lock(mutex_entries);
+            const auto entry = std::find_if(entries.begin(), entries.end(), [&path](const Entry& candidate) {
+                return candidate.path == path;
+            });
+            if (entry == entries.end()) {
+                return false;
+            }
+
+            entry->last_used = ++tick;
+            offset = entry->state_offset;
+            size = entry->state_size;
+            tokens_out = entry->tokens;
+        }
+
+        const MappedFile mapped(path);
+        if (!mapped.bytes() || mapped.length() < offset + size) {
+            return false;
+        }
+
+        return seq_state_restore(ctx, seq_id, mapped.bytes() + offset, size);
+    }
+
+    // Serializes seq_id, which holds the given prompt tokens, and queues it for writing.
+    // Skipped if the same prompt is already waiting to be written.
+    void save(llama_context* ctx, const llama_seq_id seq_id, const std::vector<llama_token>& tokens) {
+        PendingWrite write;
+        write.path = file_name(tokens);
+        {
+            std::lock_guard lock(mutex_writes);
+            const bool queued = std::any_of(queue_writes.begin(), queue_writes.end(), [&write](const PendingWrite& pending) {
+                return pending.path == write.path;
+            });
+            if (queued) {
+                return;
+            }
+        }
+
+        write.tokens = tokens;
+        if (!seq_state_save(ctx, seq_id, write.state) || write.state.size() > max_bytes) {
+            return;
+        }
+
+        {
+            std::lock_guard lock(mutex_writes);
+            queue_writes.push_back(std::move(write));
+        }
+        cv_writes.notify_one();
+    }
+};
+
+#endif // DISK_KV_CACHE_HPP
@@ -0,0 +1,173 @@
+#ifndef EMBEDDER_HPP
+#define EMBEDDER_HPP
+
+#include <vector>
+#include <deque>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include "llama.h"
+#include "embedding_buffer.hpp"
+
+/*
+ * Embedding jobs, run on a pooling context that shares the processor's model weights.
+ *
+ * Provides:
+ * Pooled embeddings for many inputs at once, without a second copy of the model.
+ * Packing of short inputs, every decode carries as many whole inputs as fit into one batch.
+ *
+ * Mechanism:
+ * Every input in a decode gets its own sequence id, so llama.cpp pools them separately.
+ * Inputs never span decodes, the context is cleared after each one since nothing is reused.
+ * A job is finished once all its inputs went through. Jobs are packed in submission order.
+ */
+
+struct EmbeddingJob {
+    EmbeddingBuffer* buffer;
+    std::vector<std::vector<llama_token>> inputs;
+    bool normalize;
+
+    // Inputs before this one have been decoded
+    size_t next_input{0};
+    const char* failure{nullptr};
+};
+
+class Embedder {
+    llama_context* ctx{nullptr};
+    llama_memory_t mem{nullptr};
+    llama_batch batch{};
+    int32_t batch_size{0};
+    int32_t max_seqs{0};
+    int32_t n_embd{0};
+
+    struct PackedInput {
+        EmbeddingJob* job;
+        size_t input;
+    };
+    std::vector<PackedInput> packed;
+
+    void add(const std::vector<llama_token>& tokens, const llama_seq_id seq_id) {
+        for (size_t i = 0; i < tokens.size(); i++) {
+            batch.token[batch.n_tokens] = tokens[i];
+            batch.pos[batch.n_tokens] = static_cast<llama_pos>(i);
+            batch.n_seq_id[batch.n_tokens] = 1;
+            batch.seq_id[batch.n_tokens][0] = seq_id;
+            batch.logits[batch.n_tokens] = 1;
+            batch.n_tokens++;
+        }
+    }
+
+    void store(const PackedInput& input, const float* embd) const {
+        float* row = input.job->buffer->data + input.input * n_embd;
+        std::memcpy(row, embd, sizeof(float) * n_embd);
+
+        if (!input.job->normalize) {
+            return;
+        }
+
+        double sum = 0.0;
+        for (int32_t i = 0; i < n_embd; i++) {
+            sum += static_cast<double>(row[i]) * row[i];
+        }
+
+        if (sum > 0.0) {
+            const auto scale = static_cast<float>(1.0 / std::sqrt(sum));
+            for (int32_t i = 0; i < n_embd; i++) {
+                row[i] *= scale;
+            }
+        }
+    }
+
+public:
+    Embedder() = default;
+
+    Embedder(const Embedder&) = delete;
+    Embedder& operator=(const Embedder&) = delete;
+
+    ~Embedder() {
+        if (ctx) {
+            llama_batch_free(batch);
+        }
+    }
+
+    // The context must be made with embeddings and a pooling type, see ctx_make_embedding.
+    void init(const llama_model* model, llama_context* embd_ctx) {
+        // Rank pooling outputs classifier scores, not embeddings
+        const auto pooling = embd_ctx ? llama_pooling_type(embd_ctx) : LLAMA_POOLING_TYPE_NONE;
+        if (pooling == LLAMA_POOLING_TYPE_NONE || pooling == LLAMA_POOLING_TYPE_RANK) {
+            return;
+        }
+
+        ctx = embd_ctx;
+        mem = llama_get_memory(ctx);
+        n_embd = llama_model_n_embd(model);
+
+        // Pooled inputs can't be split, a whole input has to fit into one physical batch
+        batch_size = static_cast<int32_t>(std::min(llama_n_batch(ctx), llama_n_ubatch(ctx)));
+        max_seqs = static_cast<int32_t>(llama_n_seq_max(ctx));
+        batch = llama_batch_init(batch_size, 0, 1);
+    }
+
+    [[nodiscard]] bool enabled() const {
+        return ctx != nullptr;
+    }
+
+    [[nodiscard]] int32_t embedding_size() const {
+        return n_embd;
+    }
+
+    [[nodiscard]] int32_t max_input_tokens() const {
+        return batch_size;
+    }
+
+    // Runs one decode over the inputs at the front of the queue. Returns the number of inputs embedded.
+    int step(std::deque<EmbeddingJob>& jobs) {
+        packed.clear();
+        batch.n_tokens = 0;
+
+        for (auto& job : jobs) {
+            while (job.next_input < job.inputs.size()) {
+                const auto& tokens = job.inputs[job.next_input];
+                if (static_cast<int32_t>(packed.size()) == max_seqs ||
+                    batch.n_tokens + static_cast<int32_t>(tokens.size()) > batch_size) {
+                    break;
+                }
+
+                add(tokens, static_cast<llama_seq_id>(packed.size()));
+                packed.push_back({&job, job.next_input});
+                job.next_input++;
+            }
+
+            if (job.next_input < job.inputs.size()) {
+                break;
+            }
+        }
+
+        if (packed.empty()) {
+            return 0;
+        }
+
+        if (llama_decode(ctx, batch) != 0) {
+            for (const auto& input : packed) {
+                input.job->failure = "DecodeError";
+            }
+        } else {
+            for (size_t i = 0; i < packed.size(); i++) {
+                const float* embd = llama_get_embeddings_seq(ctx, static_cast<llama_seq_id>(i));
+                if (!embd) {
+                    packed[i].job->failure = "NotSupported";
+                    continue;
+                }
+                store(packed[i], embd);
+            }
+        }
+
+        if (mem) {
+            llama_memory_clear(mem, true);
+        }
+
+        return static_cast<int>(packed.size());
+    }
+};
+
+#endif // EMBEDDER_HPP
@@ -0,0 +1,120 @@
+#ifndef EMBEDDING_BUFFER_HPP
+#define EMBEDDING_BUFFER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/*
+ * Owned output buffer for an embedding request. Read in place from the C API.
+ *
+ * Provides:
+ * One pooled vector per input, row-major, n_inputs x n_embd floats.
+ * A finish flag and a status. Callers block in embedding_buffer_wait until it's set, like the readback buffer.
+ *
+ * Mechanism:
+ * The rows are allocated when the request is submitted and never move, so the caller can view them without a copy.
+ * The buffer is reference counted, the processor holds a reference until the request is finished.
+ */
+
+struct EmbeddingBuffer {
+    float* data{nullptr};
+    int32_t n_inputs{0};
+    int32_t n_embd{0};
+    int32_t n_tokens{0};
+
+    // Static strings, never freed. Written before finished is set.
+    const char* status{nullptr};
+    std::atomic<bool> finished{false};
+
+    // Wakes embedding_buffer_wait when finished is set
+    std::mutex finish_mutex;
+    std::condition_variable finish_cv;
+
+    std::atomic<unsigned> ref_count{1};
+};
+
+// C API
+// Free with embedding_buffer_release -- this is a shared ptr.
+EmbeddingBuffer* embedding_buffer_make() {
+    return new EmbeddingBuffer{};
+}
+
+EmbeddingBuffer* embedding_buffer_ref_acquire(EmbeddingBuffer* buffer) {
+    buffer->ref_count.fetch_add(1, std::memory_order_relaxed);
+    return buffer;
+}
+
+// C API
+void embedding_buffer_release(EmbeddingBuffer* buffer) {
+    if (!buffer) {
+        return;
+    }
+
+    if (buffer->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete[] buffer->data;
+        delete buffer;
+    }
+}
+
+// C API
+bool embedding_buffer_is_finished(const EmbeddingBuffer* buffer) {
+    return !buffer || buffer->finished.load(std::memory_order_acquire);
+}
+
+// C API
+// Blocks until the buffer is finished. False after timeout_ms without it. The caller holds a reference.
+bool embedding_buffer_wait(EmbeddingBuffer* buffer, const uint32_t timeout_ms) {
+    if (!buffer) {
+        return true;
+    }
+
+    std::unique_lock lock(buffer->finish_mutex);
+    return buffer->finish_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [buffer] {
+        return buffer->finished.load(std::memory_order_acquire);
+    });
+}
+
+// C API
+// Valid once finished. "Ok" or the reason the request failed.
+const char* embedding_buffer_status(const EmbeddingBuffer* buffer) {
+    if (!buffer || !buffer->finished.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    return buffer->status;
+}
+
+// C API
+// Valid once finished, until the buffer is released.
+const float* embedding_buffer_data(const EmbeddingBuffer* buffer) {
+    return buffer->data;
+}
+
+// C API
+int32_t embedding_buffer_n_embd(const EmbeddingBuffer* buffer) {
+    return buffer->n_embd;
+}
+
+// C API
+int32_t embedding_buffer_n_inputs(const EmbeddingBuffer* buffer) {
+    return buffer->n_inputs;
+}
+
+// C API
+int32_t embedding_buffer_n_tokens(const EmbeddingBuffer* buffer) {
+    return buffer->n_tokens;
+}
+
+// Internal
+void embedding_buffer_finish(EmbeddingBuffer* buffer, const char* status) {
+    {
+        std::lock_guard lock(buffer->finish_mutex);
+        buffer->status = status;
+        buffer->finished.store(true, std::memory_order_release);
+    }
+    buffer->finish_cv.notify_all();
+}
+
+#endif // EMBEDDING_BUFFER_HPP
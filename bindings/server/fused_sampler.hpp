@@ -0,0 +1,447 @@
+#ifndef FUSED_SAMPLER_HPP
+#define FUSED_SAMPLER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <utility>
+#include <vector>
+#include "llama.h"
+#include "presampler.hpp"
+
+/*
+ * Fused execution of the common temperature, top-k, min-p, top-p and dist chains.
+ *
+ * Provides:
+ * A per slot sampler that runs a recognized chain straight off the logits row, with the slot's bans applied.
+ * Chains holding anything else return false from recognize and go through llama.cpp as before.
+ *
+ * Mechanism:
+ * The chain builders wrap the samplers that can be fused in a step that records their parameters and forwards
+ * everything to the wrapped sampler. Recognizing a chain is a walk checking every sampler is such a step.
+ * A fused sample makes a single pass over the row, gathering the candidates within a cut of the running max: the cut
+ * of any min-p that runs before top-p, or the one below which weights vanish in float (1e-7 of the mass combined).
+ * A top-k ahead of any top-p is selected during the same pass with a k-sized heap.
+ * The steps then run in order on the candidates, sorting only the head of the candidates for top-p, with the
+ * softmax for dist over the survivors only.
+ */
+
+enum class FusableKind {
+    NEUTRAL, // Does nothing with its parameters
+    LOGIT_BIAS,
+    TEMP,
+    TOP_K,
+    TOP_P,
+    MIN_P,
+    DIST,
+    GREEDY
+};
+
+struct FusableStep {
+    FusableKind kind;
+    float value{0.0f};
+    int32_t k{0};
+    size_t min_keep{1};
+    std::vector<llama_logit_bias> biases;
+
+    uint32_t seed{0};
+    std::mt19937 rng;
+
+    llama_sampler* inner{nullptr};
+
+    // Same seeding as llama.cpp's dist
+    void reseed() {
+        rng.seed(seed == LLAMA_DEFAULT_SEED ? std::random_device{}() : seed);
+    }
+};
+
+inline const char* fusable_step_name(const llama_sampler* smpl) {
+    return llama_sampler_name(static_cast<const FusableStep*>(smpl->ctx)->inner);
+}
+
+inline void fusable_step_accept(llama_sampler* smpl, const llama_token token) {
+    llama_sampler_accept(static_cast<FusableStep*>(smpl->ctx)->inner, token);
+}
+
+inline void fusable_step_apply(llama_sampler* smpl, llama_token_data_array* cur_p) {
+    llama_sampler_apply(static_cast<FusableStep*>(smpl->ctx)->inner, cur_p);
+}
+
+inline void fusable_step_reset(llama_sampler* smpl) {
+    auto* step = static_cast<FusableStep*>(smpl->ctx);
+    llama_sampler_reset(step->inner);
+    if (step->kind == FusableKind::DIST) {
+        step->reseed();
+    }
+}
+
+inline llama_sampler* fusable_step_clone(const llama_sampler* smpl);
+
+inline void fusable_step_free(llama_sampler* smpl) {
+    auto* step = static_cast<FusableStep*>(smpl->ctx);
+    llama_sampler_free(step->inner);
+    delete step;
+}
+
+inline const llama_sampler_i fusable_step_iface {
+    fusable_step_name,
+    fusable_step_accept,
+    fusable_step_apply,
+    fusable_step_reset,
+    fusable_step_clone,
+    fusable_step_free
+};
+
+// Takes ownership of inner
+inline llama_sampler* fusable_step_init(llama_sampler* inner, FusableStep step) {
+    step.inner = inner;
+    if (step.kind == FusableKind::DIST) {
+        step.reseed();
+    }
+    return llama_sampler_init(&fusable_step_iface, new FusableStep(std::move(step)));
+}
+
+inline llama_sampler* fusable_step_clone(const llama_sampler* smpl) {
+    auto step = *static_cast<const FusableStep*>(smpl->ctx);
+    step.inner = llama_sampler_clone(step.inner);
+    return llama_sampler_init(&fusable_step_iface, new FusableStep(std::move(step)));
+}
+
+class FusedSampler {
+    // Candidates below this share of the max weight can't move a float sum, scaled down by the vocab size
+    static constexpr float negligible_mass = 1e-7f;
+
+    // Top-p sorts candidates at least this share of the max weight first, the rest only if the head falls short
+    static constexpr float top_p_head_ratio = 1e-4f;
+
+    // The gather skips whole blocks of the row whose max can't make the cut
+    static constexpr int32_t block_size = 16;
+
+    std::vector<const FusableStep*> steps;
+    FusableStep* terminal{nullptr};
+
+    // Only grows, the first n_candidates entries are the candidates
+    std::vector<llama_token_data> candidates;
+    size_t n_candidates{0};
+
+    std::vector<float> patched_row;
+
+    llama_token_data* begin() {
+        return candidates.data();
+    }
+
+    llama_token_data* end() {
+        return candidates.data() + n_candidates;
+    }
+
+    static bool by_logit_desc(const llama_token_data& a, const llama_token_data& b) {
+        return a.logit > b.logit;
+    }
+
+    // Biases and bans are applied to a copy of the row, the context's logits stay as decoded
+    const float* patch_row(const float* row, const int32_t n_vocab, const TokenBans* bans) {
+        const FusableStep* bias =
+            !steps.empty() && steps.front()->kind == FusableKind::LOGIT_BIAS ? steps.front() : nullptr;
+        if (!bias && !bans) {
+            return row;
+        }
+
+        patched_row.assign(row, row + n_vocab);
+        if (bias) {
+            for (const auto& [token, value] : bias->biases) {
+                if (token >= 0 && token < n_vocab) {
+                    patched_row[token] += value;
+                }
+            }
+        }
+        if (bans) {
+            for (const auto* set : {&bans->rewind, &bans->eos}) {
+                for (const llama_token token : set->tokens) {
+                    patched_row[token] = -INFINITY;
+                }
+            }
+        }
+
+        return patched_row.data();
+    }
+
+    // Max of a full block, as independent lanes the compiler can keep in one vector register
+    static float block_max(const float* values) {
+        float lanes[block_size / 2];
+        for (int32_t j = 0; j < block_size / 2; j++) {
+            lanes[j] = std::max(values[j], values[j + block_size / 2]);
+        }
+        return *std::max_element(lanes, lanes + block_size / 2);
+    }
+
+    static float range_max(const float* row, const int32_t start, const int32_t stop) {
+        return stop - start == block_size ? block_max(row + start) : *std::max_element(row + start, row + stop);
+    }
+
+    // First token with the highest logit, like llama.cpp's greedy
+    static llama_token argmax(const float* row, const int32_t n_vocab) {
+        float best = -INFINITY;
+        int32_t best_start = 0;
+        for (int32_t start = 0; start < n_vocab; start += block_size) {
+            const float max = range_max(row, start, std::min(start + block_size, n_vocab));
+            if (max > best) {
+                best = max;
+                best_start = start;
+            }
+        }
+        return static_cast<llama_token>(std::find(row + best_start, row + n_vocab, best) - row);
+    }
+
+    // Sets every candidate's p to its softmax weight relative to the max, returns their sum
+    float weigh(const float l_max, const float temp) {
+        const float inv_temp = 1.0f / temp;
+        llama_token_data* first = begin();
+        for (size_t i = 0; i < n_candidates; i++) {
+            first[i].p = std::exp((first[i].logit - l_max) * inv_temp);
+        }
+
+        constexpr size_t lanes = 8;
+        float lane_sums[lanes] {};
+        size_t i = 0;
+        for (; i + lanes <= n_candidates; i += lanes) {
+            for (size_t j = 0; j < lanes; j++) {
+                lane_sums[j] += first[i + j].p;
+            }
+        }
+        for (; i < n_candidates; i++) {
+            lane_sums[0] += first[i].p;
+        }
+
+        float sum = 0.0f;
+        for (const float lane_sum : lane_sums) {
+            sum += lane_sum;
+        }
+        return sum;
+    }
+
+    // One pass over the row keeping what is within delta of the running max, only the k highest of it when k is set.
+    // The max only grows, so whatever is skipped is also below the final cut. Blocks whose max can't make the cut
+    // are skipped whole. Returns the max of the row.
+    float gather(const float* row, const int32_t n_vocab, const float delta, size_t k) {
+        if (candidates.size() < static_cast<size_t>(n_vocab)) {
+            candidates.resize(n_vocab);
+        }
+        if (k >= static_cast<size_t>(n_vocab)) {
+            k = 0;
+        }
+
+        llama_token_data* first = begin();
+        size_t count = 0;
+        float l_max = -INFINITY;
+
+        for (int32_t start = 0; start < n_vocab; start += block_size) {
+            const int32_t stop = std::min(start + block_size, n_vocab);
+            const float max = range_max(row, start, stop);
+
+            l_max = std::max(l_max, max);
+            const bool heap_full = k > 0 && count == k;
+            if (max < l_max + delta || (heap_full && max <= first->logit)) {
+                continue;
+            }
+
+            for (llama_token token = start; token < stop; token++) {
+                const float value = row[token];
+                if (k == 0) {
+                    first[count] = {token, value, 0.0f};
+                    count += value >= l_max + delta;
+                    continue;
+                }
+
+                // A heap of the k highest so far with the lowest on top
+                if (value < l_max + delta || (count == k && value <= first->logit)) {
+                    continue;
+                }
+                if (count < k) {
+                    first[count++] = {token, value, 0.0f};
+                    if (count == k) {
+                        std::make_heap(first, first + k, by_logit_desc);
+                    }
+                } else {
+                    std::pop_heap(first, first + k, by_logit_desc);
+                    first[k - 1] = {token, value, 0.0f};
+                    std::push_heap(first, first + k, by_logit_desc);
+                }
+            }
+        }
+
+        const float cut = l_max + delta;
+        n_candidates = std::remove_if(first, first + count, [cut](const llama_token_data& candidate) {
+            return candidate.logit < cut;
+        }) - first;
+        return l_max;
+    }
+
+    // Cuts the candidates to the smallest head holding p of the mass, as llama.cpp's top-p does
+    void top_p(const float p, const size_t min_keep, const float l_max, const float temp) {
+        const float sum = weigh(l_max, temp);
+        const float head_cut = l_max + temp * std::log(top_p_head_ratio);
+        llama_token_data* tail = std::partition(begin(), end(), [&](const llama_token_data& candidate) {
+            return candidate.logit >= head_cut;
+        });
+        std::sort(begin(), tail, by_logit_desc);
+
+        float cum_sum = 0.0f;
+        for (size_t i = 0; i < n_candidates; i++) {
+            if (begin() + i == tail) {
+                std::sort(tail, end(), by_logit_desc);
+            }
+
+            cum_sum += candidates[i].p / sum;
+            if (cum_sum >= p && i + 1 >= min_keep) {
+                n_candidates = i + 1;
+                return;
+            }
+        }
+    }
+
+    llama_token draw(const float l_max, const float temp) {
+        const float sum = weigh(l_max, temp);
+        double target = std::uniform_real_distribution<double>(0.0, 1.0)(terminal->rng) * sum;
+        for (const llama_token_data* candidate = begin(); candidate != end(); candidate++) {
+            target -= candidate->p;
+            if (target <= 0.0) {
+                return candidate->id;
+            }
+        }
+
+        return end()[-1].id;
+    }
+
+public:
+    // True when every sampler of the chain can run fused and the chain ends in dist or greedy.
+    // A logit bias is only fused ahead of every other step, where it can't depend on the temperature.
+    bool recognize(const llama_sampler* chain) {
+        steps.clear();
+        terminal = nullptr;
+
+        const int n = llama_sampler_chain_n(chain);
+        for (int i = 0; i < n; i++) {
+            llama_sampler* smpl = llama_sampler_chain_get(chain, i);
+            if (smpl->iface != &fusable_step_iface || terminal) {
+                return false;
+            }
+
+            auto* step = static_cast<FusableStep*>(smpl->ctx);
+            switch (step->kind) {
+                case FusableKind::NEUTRAL:
+                    break;
+                case FusableKind::DIST:
+                case FusableKind::GREEDY:
+                    terminal = step;
+                    break;
+                case FusableKind::LOGIT_BIAS:
+                    if (!steps.empty()) {
+                        return false;
+                    }
+                    steps.push_back(step);
+                    break;
+                default:
+                    steps.push_back(step);
+            }
+        }
+
+        return terminal != nullptr;
+    }
+
+    // Samples a logits row with the chain last recognized, then has the chain accept the token
+    llama_token sample(llama_sampler* chain, const float* logits, const int32_t n_vocab, const TokenBans* bans) {
+        const float* row = patch_row(logits, n_vocab, bans);
+
+        // Plan the gather relative to the max logit: min-p and top-k cut ahead of any top-p, and pruning at the
+        // widest temperature any softmax runs with
+        bool greedy = terminal->kind == FusableKind::GREEDY;
+        bool cut_safe = true;
+        float temp = 1.0f;
+        float softmax_temp = 0.0f;
+        float min_p_delta = -INFINITY;
+        size_t top_k = 0;
+        for (const FusableStep* step : steps) {
+            switch (step->kind) {
+                case FusableKind::TEMP:
+                    temp *= step->value;
+                    greedy |= step->value <= 0.0f;
+                    break;
+                case FusableKind::MIN_P:
+                    if (cut_safe) {
+                        min_p_delta = std::max(min_p_delta, temp * std::log(step->value));
+                    }
+                    break;
+                case FusableKind::TOP_K:
+                    if (cut_safe) {
+                        const auto k = static_cast<size_t>(step->k);
+                        top_k = top_k == 0 ? k : std::min(top_k, k);
+                    }
+                    break;
+                case FusableKind::TOP_P:
+                    cut_safe = false;
+                    softmax_temp = std::max(softmax_temp, temp);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        llama_token token;
+        if (greedy) {
+            n_candidates = 0;
+            token = argmax(row, n_vocab);
+        } else {
+            softmax_temp = std::max(softmax_temp, temp);
+            const float prune_delta = softmax_temp * std::log(negligible_mass / static_cast<float>(n_vocab));
+            const float l_max = gather(row, n_vocab, std::max(min_p_delta, prune_delta), top_k);
+
+            temp = 1.0f;
+            for (const FusableStep* step : steps) {
+                switch (step->kind) {
+                    case FusableKind::TEMP:
+                        temp *= step->value;
+                        break;
+                    case FusableKind::TOP_K:
+                        if (static_cast<size_t>(step->k) < n_candidates) {
+                            std::nth_element(begin(), begin() + step->k, end(), by_logit_desc);
+                            n_candidates = step->k;
+                        }
+                        break;
+                    case FusableKind::MIN_P: {
+                        const float cut = l_max + temp * std::log(step->value);
+                        n_candidates = std::remove_if(begin(), end(), [cut](const llama_token_data& candidate) {
+                            return candidate.logit < cut;
+                        }) - begin();
+                        break;
+                    }
+                    case FusableKind::TOP_P:
+                        top_p(step->value, step->min_keep, l_max, temp);
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            token = draw(l_max, temp);
+        }
+
+        llama_sampler_accept(chain, token);
+        return token;
+    }
+
+    // The candidates the last sample drew from with their probabilities, none after a greedy one.
+    // For checking the fused steps against the llama.cpp chain, see fused_sampler_check.cpp.
+    std::vector<llama_token_data> last_candidates() const {
+        std::vector<llama_token_data> out(candidates.begin(), candidates.begin() + n_candidates);
+        float sum = 0.0f;
+        for (const auto& candidate : out) {
+            sum += candidate.p;
+        }
+        for (auto& candidate : out) {
+            candidate.p /= sum;
+        }
+        return out;
+    }
+};
+
+#endif // FUSED_SAMPLER_HPP
@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "llama.h"
+#include "fused_sampler.hpp"
+#include "samplers.hpp"
+
+/*
+ * Checks the fused sampler against the llama.cpp chain it stands in for.
+ *
+ * Provides:
+ * For every chain shape the fused path recognizes, the candidates a fused sample draws from and their probabilities
+ * compared with those the chain leaves before its dist, including the min-p and top-p boundaries, temperature 0 and
+ * a top-k of at least the vocab. Prints every mismatch and exits with 1 if there was one.
+ *
+ * Mechanism:
+ * Synthetic logits rows, random ones with a spike and rows built so a cut falls exactly on a logit. Each row goes
+ * through llama_sampler_apply on the full vocab, then through the fused sampler with the same chain. Candidates kept
+ * by one side only may hold no more mass than float rounding accounts for, and chains that end up greedy are
+ * compared by the token picked.
+ *
+ * Usage:
+ * fused_sampler_check
+ */
+
+namespace {
+
+constexpr int32_t n_vocab = 32000;
+
+// Both sides sum the softmax in float over up to the whole vocab, in a different order, which is good to about 1e-4
+constexpr float p_tolerance = 5e-4f;
+
+// Mass of the candidates only one side keeps: what the fused gather prunes, 1e-7 of the mass, and tail tokens a
+// top-p boundary moves over with the sums differing
+constexpr float one_sided_tolerance = 5e-4f;
+
+int failures = 0;
+
+void fail(const std::string& shape, const std::string& message) {
+    std::cerr << "FAIL " << shape << ": " << message << std::endl;
+    failures++;
+}
+
+std::vector<float> random_row(std::mt19937& rng) {
+    std::normal_distribution<float> logit(0.0f, 3.0f);
+    std::vector<float> row(n_vocab);
+    for (auto& value : row) {
+        value = logit(rng);
+    }
+    row[rng() % n_vocab] += 12.0f;
+    return row;
+}
+
+// Distinct logits well below a max of 5, with one exactly on the min-p cut of p and the next float below it
+std::vector<float> min_p_boundary_row(const float p, llama_token& on_cut, llama_token& below_cut) {
+    std::vector<float> row(n_vocab);
+    for (int32_t i = 0; i < n_vocab; i++) {
+        row[i] = -10.0f - static_cast<float>(i) * 1e-4f;
+    }
+
+    constexpr float max = 5.0f;
+    const float cut = max + logf(p);
+    row[7] = max;
+    on_cut = 1234;
+    below_cut = 4321;
+    row[on_cut] = cut;
+    row[below_cut] = std::nextafter(cut, -INFINITY);
+    return row;
+}
+
+// Probability mass of the n most likely tokens at a temperature, for n up to count
+std::vector<float> head_masses(const std::vector<float>& row, const float temp, const size_t count) {
+    std::vector<double> weights(row.size());
+    const float max = *std::max_element(row.begin(), row.end());
+    for (size_t i = 0; i < row.size(); i++) {
+        weights[i] = std::exp((row[i] - max) / temp);
+    }
+    std::sort(weights.begin(), weights.end(), std::greater<>());
+
+    double sum = 0.0;
+    for (const double weight : weights) {
+        sum += weight;
+    }
+
+    std::vector<float> masses(count + 1, 0.0f);
+    double head = 0.0;
+    for (size_t n = 1; n <= count; n++) {
+        head += weights[n - 1];
+        masses[n] = static_cast<float>(head / sum);
+    }
+    return masses;
+}
+
+// Builds the chain, runs a row through both paths and compares them. Returns the fused candidates.
+std::vector<llama_token_data> check(
+    const std::string& shape, const std::function<void(llama_sampler*)>& build, const std::vector<float>& row) {
+    llama_sampler* chain = sampler_make();
+    build(chain);
+
+    FusedSampler fused;
+    if (!fused.recognize(chain)) {
+        fail(shape, "chain not recognized");
+        sampler_free(chain);
+        return {};
+    }
+
+    std::vector<llama_token_data> reference(n_vocab);
+    for (llama_token token = 0; token < n_vocab; token++) {
+        reference[token] = {token, row[token], 0.0f};
+    }
+    llama_token_data_array cur_p{reference.data(), reference.size(), -1, false};
+    llama_sampler_apply(chain, &cur_p);
+    const llama_token reference_token = cur_p.data[cur_p.selected].id;
+    reference.resize(cur_p.size);
+
+    const llama_token token = fused.sample(chain, row.data(), n_vocab, nullptr);
+    std::vector<llama_token_data> survivors = fused.last_candidates();
+    sampler_free(chain);
+
+    // Greedy has no candidates to compare, only the pick
+    if (survivors.empty()) {
+        if (token != reference_token) {
+            fail(shape, "picked " + std::to_string(token) + ", the chain " + std::to_string(reference_token));
+        }
+        return survivors;
+    }
+
+    std::unordered_map<llama_token, float> reference_p;
+    for (const auto& candidate : reference) {
+        reference_p[candidate.id] = candidate.p;
+    }
+
+    bool token_survived = false;
+    float one_sided_mass = 0.0f;
+    for (const auto& candidate : survivors) {
+        token_survived |= candidate.id == token;
+
+        const auto found = reference_p.find(candidate.id);
+        if (found == reference_p.end()) {
+            one_sided_mass += candidate.p;
+            continue;
+        }
+        if (!(std::fabs(found->second - candidate.p) <= p_tolerance * found->second)) {
+            fail(shape, "token " + std::to_string(candidate.id) + " has p " + std::to_string(candidate.p) +
+                ", the chain " + std::to_string(found->second));
+        }
+        reference_p.erase(found);
+    }
+
+    for (const auto& [id, p] : reference_p) {
+        one_sided_mass += p;
+    }
+    if (one_sided_mass > one_sided_tolerance) {
+        fail(shape, "candidates kept by only one side hold " + std::to_string(one_sided_mass) + " of the mass");
+    }
+
+    if (!token_survived) {
+        fail(shape, "picked " + std::to_string(token) + " which isn't a candidate");
+    }
+
+    return survivors;
+}
+
+bool contains(const std::vector<llama_token_data>& candidates, const llama_token token) {
+    return std::any_of(candidates.begin(), candidates.end(), [token](const llama_token_data& candidate) {
+        return candidate.id == token;
+    });
+}
+
+}
+
+int main() {
+    std::mt19937 rng(1337);
+    std::vector<std::vector<float>> rows;
+    for (int r = 0; r < 4; r++) {
+        rows.push_back(random_row(rng));
+    }
+
+    const std::vector<std::pair<std::string, std::function<void(llama_sampler*)>>> shapes {
+        {"dist", [](llama_sampler* chain) {
+            sampler_dist(chain, 1337);
+        }},
+        {"temp", [](llama_sampler* chain) {
+            sampler_temp(chain, 1.5f);
+            sampler_dist(chain, 1337);
+        }},
+        {"top_k", [](llama_sampler* chain) {
+            sampler_top_k(chain, 40);
+            sampler_dist(chain, 1337);
+        }},
+        {"top_k after temp", [](llama_sampler* chain) {
+            sampler_temp(chain, 0.7f);
+            sampler_top_k(chain, 20);
+            sampler_dist(chain, 1337);
+        }},
+        {"top_k of the vocab", [](llama_sampler* chain) {
+            sampler_top_k(chain, n_vocab);
+            sampler_dist(chain, 1337);
+        }},
+        {"top_k over the vocab", [](llama_sampler* chain) {
+            sampler_temp(chain, 0.8f);
+            sampler_top_k(chain, n_vocab + 100);
+            sampler_dist(chain, 1337);
+        }},
+        {"min_p", [](llama_sampler* chain) {
+            sampler_min_p(chain, 0.05f, 1);
+            sampler_dist(chain, 1337);
+        }},
+        {"min_p after temp", [](llama_sampler* chain) {
+            sampler_temp(chain, 0.6f);
+            sampler_min_p(chain, 0.02f, 1);
+            sampler_dist(chain, 1337);
+        }},
+        {"top_p", [](llama_sampler* chain) {
+            sampler_top_p(chain, 0.9f, 1);
+            sampler_dist(chain, 1337);
+        }},
+        {"top_p of 0", [](llama_sampler* chain) {
+            sampler_top_p(chain, 0.0f, 3);
+            sampler_dist(chain, 1337);
+        }},
+        {"min_p after top_p", [](llama_sampler* chain) {
+            sampler_temp(chain, 1.2f);
+            sampler_top_p(chain, 0.95f, 1);
+            sampler_min_p(chain, 0.1f, 1);
+            sampler_dist(chain, 1337);
+        }},
+        {"top_k after top_p", [](llama_sampler* chain) {
+            sampler_top_p(chain, 0.95f, 1);
+            sampler_top_k(chain, 10);
+            sampler_dist(chain, 1337);
+        }},
+        {"request chain", [](llama_sampler* chain) {
+            sampler_penalties(chain, 64, 1.0f, 0.0f, 0.0f);
+            sampler_temp(chain, 0.8f);
+            sampler_top_k(chain, 40);
+            sampler_top_p(chain, 0.95f, 1);
+            sampler_min_p(chain, 0.05f, 1);
+            sampler_typical(chain, 1.0f, 1);
+            sampler_dist(chain, 1337);
+        }},
+        {"temp 0", [](llama_sampler* chain) {
+            sampler_temp(chain, 0.0f);
+            sampler_top_k(chain, 40);
+            sampler_dist(chain, 1337);
+        }},
+        {"greedy", [](llama_sampler* chain) {
+            sampler_top_p(chain, 0.9f, 1);
+            sampler_greedy(chain);
+        }},
+    };
+
+    for (const auto& [shape, build] : shapes) {
+        for (const auto& row : rows) {
+            check(shape, build, row);
+        }
+    }
+
+    // A logit exactly on the min-p cut is kept, the next float below it isn't
+    {
+        llama_token on_cut;
+        llama_token below_cut;
+        const std::vector<float> row = min_p_boundary_row(0.1f, on_cut, below_cut);
+        const auto survivors = check("min_p boundary", [](llama_sampler* chain) {
+            sampler_min_p(chain, 0.1f, 1);
+            sampler_dist(chain, 1337);
+        }, row);
+        if (!contains(survivors, on_cut) || contains(survivors, below_cut)) {
+            fail("min_p boundary", "the cut isn't inclusive of the logit on it");
+        }
+    }
+
+    // Top-p keeps the smallest head reaching p. A p just under the mass of the three most likely tokens keeps three,
+    // one just over it four, the margin being a hundredth of the third or fourth token's probability.
+    for (const auto& row : rows) {
+        constexpr float temp = 1.5f;
+        const std::vector<float> mass = head_masses(row, temp, 4);
+        const std::pair<float, size_t> cases[] {
+            {mass[3] - 0.01f * (mass[3] - mass[2]), 3},
+            {mass[3] + 0.01f * (mass[4] - mass[3]), 4},
+        };
+        for (const auto& [p, expected] : cases) {
+            const auto survivors = check("top_p boundary", [p = p, temp](llama_sampler* chain) {
+                sampler_temp(chain, temp);
+                sampler_top_p(chain, p, 1);
+                sampler_dist(chain, 1337);
+            }, row);
+            if (survivors.size() != expected) {
+                fail("top_p boundary", "kept " + std::to_string(survivors.size()) + " candidates at p " +
+                    std::to_string(p) + ", expected " + std::to_string(expected));
+            }
+        }
+    }
+
+    if (failures > 0) {
+        std::cerr << failures << " mismatches" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Fused sampler matches the llama.cpp chain" << std::endl;
+    return 0;
+}
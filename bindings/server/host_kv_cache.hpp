@@ -0,0 +1,231 @@
+#ifndef HOST_KV_CACHE_HPP
+#define HOST_KV_CACHE_HPP
+
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include "llama.h"
+
+/*
+ * A bounded host memory tier for KV sequences that would otherwise be thrown away.
+ *
+ * Provides:
+ * Spilling a slot's sequence state to RAM right before the processor wipes it.
+ * Longest-prefix lookups of spilled sequences, and restoring one into any slot.
+ *
+ * Mechanism:
+ * Sequences are serialized with the llama sequence-state API. Every whole block of a sequence's prefix is indexed by
+ * its hash, so a lookup only hashes the prompt block by block and compares tokens against entries sharing them.
+ * When over budget, the entry with the least prefill saved per unit of age is evicted first.
+ */
+
+// Pass the hash of the preceding tokens to continue it
+inline uint64_t hash_tokens(const llama_token* tokens, const size_t n_tokens, uint64_t hash = 0xcbf29ce484222325ull) {
+    // FNV-1a
+    for (size_t i = 0; i < n_tokens; i++) {
+        hash ^= static_cast<uint32_t>(tokens[i]);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Serializes a sequence's KV into a host buffer. Returns false if there's nothing to save.
+inline bool seq_state_save(llama_context* ctx, const llama_seq_id seq_id, std::vector<uint8_t>& out) {
+    const size_t size = llama_state_seq_get_size(ctx, seq_id);
+    if (size == 0) {
+        return false;
+    }
+
+    out.resize(size);
+    const size_t written = llama_state_seq_get_data(ctx, out.data(), out.size(), seq_id);
+    out.resize(written);
+    return written > 0;
+}
+
+// Loads a serialized sequence into seq_id. The destination sequence must be empty.
+inline bool seq_state_restore(llama_context* ctx, const llama_seq_id seq_id, const uint8_t* data, const size_t size) {
+    return llama_state_seq_set_data(ctx, data, size, seq_id) > 0;
+}
+
+class HostKVCache {
+    struct Entry {
+        std::vector<llama_token> tokens;
+        std::vector<uint8_t> state;
+        uint64_t last_used{0};
+    };
+
+    // Entries by id, and entry ids by the hash of each whole block prefix they start with
+    std::unordered_map<uint64_t, Entry> entries;
+    std::unordered_map<uint64_t, std::vector<uint64_t>> block_index;
+    uint64_t next_id{1};
+    size_t max_bytes;
+    size_t used_bytes{0};
+    uint64_t tick{0};
+
+    // Calls f with the hash of every whole block prefix of tokens, shortest first, until f returns false
+    template<typename F>
+    static void for_each_block_hash(const std::vector<llama_token>& tokens, F&& f) {
+        uint64_t hash = hash_tokens(nullptr, 0);
+        for (size_t end = block_tokens; end <= tokens.size(); end += block_tokens) {
+            hash = hash_tokens(tokens.data() + end - block_tokens, block_tokens, hash);
+            if (!f(hash)) {
+                return;
+            }
+        }
+    }
+
+    void erase(const std::unordered_map<uint64_t, Entry>::iterator it) {
+        for_each_block_hash(it->second.tokens, [this, id = it->first](const uint64_t hash) {
+            const auto indexed = block_index.find(hash);
+            auto& ids = indexed->second;
+            ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+            if (ids.empty()) {
+                block_index.erase(indexed);
+            }
+            return true;
+        });
+
+        used_bytes -= it->second.state.size();
+        entries.erase(it);
+    }
+
+    void evict_one() {
+        auto victim = entries.end();
+        double victim_score = 0.0;
+
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            const double age = static_cast<double>(tick - it->second.last_used) + 1.0;
+            const double score = static_cast<double>(it->second.tokens.size()) / age;
+            if (victim == entries.end() || score < victim_score) {
+                victim = it;
+                victim_score = score;
+            }
+        }
+
+        if (victim != entries.end()) {
+            erase(victim);
+        }
+    }
+
+    static bool is_prefix_of(const std::vector<llama_token>& prefix, const std::vector<llama_token>& tokens) {
+        if (prefix.size() > tokens.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < prefix.size(); i++) {
+            if (prefix[i] != tokens[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    // Sequences shorter than this are cheaper to prefill again than to keep around.
+    static constexpr size_t min_spill_tokens = 256;
+
+    // Prefixes are indexed in blocks of this many tokens. A match shorter than one block isn't found.
+    static constexpr size_t block_tokens = 64;
+
+    struct Match {
+        uint64_t key{0};
+        size_t length{0};
+    };
+
+    explicit HostKVCache(const size_t max_bytes = 0) : max_bytes(max_bytes) {}
+
+    [[nodiscard]] bool enabled() const {
+        return max_bytes > 0;
+    }
+
+    // Saves the state of seq_id, which holds the given tokens.
+    void store(llama_context* ctx, const llama_seq_id seq_id, const std::vector<llama_token>& tokens) {
+        tick++;
+
+        // Already held by an entry, as a whole or as its prefix
+        if (const Match match = longest_prefix(tokens); match.length == tokens.size()) {
+            entries.at(match.key).last_used = tick;
+            return;
+        }
+
+        Entry entry;
+        if (!seq_state_save(ctx, seq_id, entry.state) || entry.state.size() > max_bytes) {
+            return;
+        }
+        entry.tokens = tokens;
+        entry.last_used = tick;
+
+        // Entries that are a prefix of the new one are fully covered by it
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (is_prefix_of(it->second.tokens, tokens)) {
+                const auto covered = it++;
+                erase(covered);
+            } else {
+                ++it;
+            }
+        }
+
+        while (!entries.empty() && used_bytes + entry.state.size() > max_bytes) {
+            evict_one();
+        }
+
+        const uint64_t id = next_id++;
+        for_each_block_hash(entry.tokens, [this, id](const uint64_t hash) {
+            block_index[hash].push_back(id);
+            return true;
+        });
+
+        used_bytes += entry.state.size();
+        entries.emplace(id, std::move(entry));
+    }
+
+    // Finds the spilled sequence sharing the longest prefix with tokens. Walks the prompt's block hashes until one
+    // isn't indexed, then compares tokens only against the entries sharing the last indexed block.
+    [[nodiscard]] Match longest_prefix(const std::vector<llama_token>& tokens) const {
+        const std::vector<uint64_t>* candidates = nullptr;
+        for_each_block_hash(tokens, [this, &candidates](const uint64_t hash) {
+            const auto it = block_index.find(hash);
+            if (it == block_index.end()) {
+                return false;
+            }
+            candidates = &it->second;
+            return true;
+        });
+
+        Match best;
+        if (!candidates) {
+            return best;
+        }
+
+        // Measured on the tokens, a hash collision only costs the comparison
+        for (const uint64_t id : *candidates) {
+            const auto& entry_tokens = entries.at(id).tokens;
+            const size_t n = std::min(entry_tokens.size(), tokens.size());
+            const size_t length = std::mismatch(entry_tokens.begin(), entry_tokens.begin() + static_cast<long>(n),
+                                                tokens.begin()).first - entry_tokens.begin();
+            if (length > best.length) {
+                best.key = id;
+                best.length = length;
+            }
+        }
+        return best;
+    }
+
+    [[nodiscard]] const std::vector<llama_token>* tokens_of(const uint64_t key) const {
+        const auto it = entries.find(key);
+        return it == entries.end() ? nullptr : &it->second.tokens;
+    }
+
+    // Loads a spilled sequence into seq_id. The entry stays cached, other requests may want it too.
+    bool restore(llama_context* ctx, const llama_seq_id seq_id, const uint64_t key) {
+        const auto it = entries.find(key);
+        if (it == entries.end()) {
+            return false;
+        }
+
+        it->second.last_used = ++tick;
+        return seq_state_restore(ctx, seq_id, it->second.state.data(), it->second.state.size());
+    }
+};
+
+#endif // HOST_KV_CACHE_HPP
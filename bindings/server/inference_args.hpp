@@ -25,10 +25,23 @@ public:
     std::vector<std::string> stopping_strings;
     std::vector<int32_t> stopping_tokens;
     bool add_special;
+    int priority;
+    int ngram_size;
+    int ngram_draft_tokens;
+    bool logprobs;
+    int top_logprobs;
+
+    // Scoring requests only prefill, reporting the logprobs of the prompt tokens from this index on. -1 generates.
+    int score_from;
+
+    // Set by the processor, in ms of ggml time. The request was submitted, then queued once tokenized.
+    double submit_time{0.0};
+    double queued_time{0.0};
 
     InferenceArgs(): gen_resources(nullptr), max_tokens_to_gen(0), min_tokens_to_gen(0),
                      max_slot_n_ctx(std::numeric_limits<uint32_t>::max()), seed(0),
-                     add_special(true) {
+                     add_special(true), priority(0), ngram_size(0), ngram_draft_tokens(0),
+                     logprobs(false), top_logprobs(0), score_from(-1) {
     };
 
     explicit InferenceArgs(
@@ -43,13 +56,25 @@ public:
         const unsigned num_stopping_strings = 0,
         const int32_t* stopping_tokens = nullptr,
         const unsigned num_stopping_tokens = 0,
-        const bool add_special = true)
+        const bool add_special = true,
+        const int priority = 0,
+        const int ngram_size = 0,
+        const int ngram_draft_tokens = 0,
+        const bool logprobs = false,
+        const int top_logprobs = 0,
+        const int score_from = -1)
 
     :   gen_resources(gen_resources),
         max_tokens_to_gen(max_tokens),
         min_tokens_to_gen(min_tokens),
         seed(seed),
-        add_special(add_special)
+        add_special(add_special),
+        priority(priority),
+        ngram_size(ngram_size),
+        ngram_draft_tokens(ngram_draft_tokens),
+        logprobs(logprobs),
+        top_logprobs(top_logprobs),
+        score_from(score_from)
     {
         if (rewind_strings != nullptr && num_rewind_strings > 0) {
             this->rewind_strings.reserve(num_rewind_strings);
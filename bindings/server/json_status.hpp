@@ -3,6 +3,9 @@
 
 #include <iomanip>
 #include <sstream>
+#include <algorithm>
+#include <vector>
+#include <cmath>
 #include "slot.hpp"
 
 inline std::string escape_string(const std::string& input) {
@@ -30,6 +33,18 @@ inline std::string escape_string(const std::string& input) {
     return ss.str();
 }
 
+// Nearest-rank percentile of the inter-token gaps, 0 without gaps. Sorts the given copy.
+inline double gap_percentile(std::vector<float>& gaps, const double q) {
+    if (gaps.empty()) {
+        return 0.0;
+    }
+
+    const auto rank = static_cast<size_t>(std::ceil(q * static_cast<double>(gaps.size())));
+    const size_t index = std::clamp<size_t>(rank, 1, gaps.size()) - 1;
+    std::nth_element(gaps.begin(), gaps.begin() + static_cast<long>(index), gaps.end());
+    return gaps[index];
+}
+
 template<typename T>
 void add_json_value(std::ostringstream& ss, const std::string& key, const T& value, bool is_last = false) {
     ss << "\"" << key << "\":";
@@ -56,6 +71,11 @@ inline std::string make_empty_json_status_string(const std::string &finish_reaso
     constexpr int slot_id = -1;
     constexpr int request_id = -1;
     constexpr int job_index = -1;
+    constexpr int draft_tokens = 0;
+    constexpr int draft_accepted = 0;
+    constexpr double draft_accept_rate = 0.0;
+    constexpr double zero_ms = 0.0;
+    constexpr int prefix_reuse_tokens = 0;
 
     std::ostringstream ss;
     ss << std::fixed << std::setprecision(6) << "{";
@@ -73,6 +93,18 @@ inline std::string make_empty_json_status_string(const std::string &finish_reaso
     add_json_value(ss, "genTokensPerSec", gen_tokens_per_sec);
     add_json_value(ss, "promptTokensPerSec", prompt_tokens_per_sec);
 
+    add_json_value(ss, "draftTokens", draft_tokens);
+    add_json_value(ss, "draftAcceptedTokens", draft_accepted);
+    add_json_value(ss, "draftAcceptRate", draft_accept_rate);
+
+    add_json_value(ss, "tokenizeMs", zero_ms);
+    add_json_value(ss, "queueMs", zero_ms);
+    add_json_value(ss, "ttftMs", zero_ms);
+    add_json_value(ss, "prefixReuseTokens", prefix_reuse_tokens);
+    add_json_value(ss, "itlP50Ms", zero_ms);
+    add_json_value(ss, "itlP99Ms", zero_ms);
+    add_json_value(ss, "itlMaxMs", zero_ms);
+
     add_json_value(ss, "finishReason", finish_reason);
     add_json_value(ss, "stopToken", stop_token, true);
 
@@ -94,6 +126,21 @@ inline std::string make_json_status_string(const Slot& slot, const std::string &
     const double gen_tokens_per_sec = gen_sec > 0 ?
         static_cast<double>(slot.tokens_generated) / gen_sec : 0.0;
 
+    const int draft_tokens = slot.draft_tokens;
+    const int draft_accepted = slot.draft_accepted;
+    const double draft_accept_rate = draft_tokens > 0 ?
+        static_cast<double>(draft_accepted) / draft_tokens : 0.0;
+
+    // Measured from submission, so queueing and tokenization count towards time to first token
+    const double tokenize_ms = slot.queued_time - slot.submit_time;
+    const double queue_ms = slot.slot_start_time - slot.queued_time;
+    const double ttft_ms = slot.first_token_time > 0.0 ? slot.first_token_time - slot.submit_time : 0.0;
+
+    std::vector<float> gaps = slot.token_gaps;
+    const double itl_p50 = gap_percentile(gaps, 0.50);
+    const double itl_p99 = gap_percentile(gaps, 0.99);
+    const double itl_max = gaps.empty() ? 0.0 : *std::max_element(gaps.begin(), gaps.end());
+
     std::ostringstream ss;
     ss << std::fixed << std::setprecision(2) << "{";
 
@@ -110,6 +157,18 @@ inline std::string make_json_status_string(const Slot& slot, const std::string &
     add_json_value(ss, "genTokensPerSec", gen_tokens_per_sec);
     add_json_value(ss, "promptTokensPerSec", prompt_tokens_per_sec);
 
+    add_json_value(ss, "draftTokens", draft_tokens);
+    add_json_value(ss, "draftAcceptedTokens", draft_accepted);
+    add_json_value(ss, "draftAcceptRate", draft_accept_rate);
+
+    add_json_value(ss, "tokenizeMs", tokenize_ms);
+    add_json_value(ss, "queueMs", queue_ms);
+    add_json_value(ss, "ttftMs", ttft_ms);
+    add_json_value(ss, "prefixReuseTokens", slot.prefix_reuse_tokens);
+    add_json_value(ss, "itlP50Ms", itl_p50);
+    add_json_value(ss, "itlP99Ms", itl_p99);
+    add_json_value(ss, "itlMaxMs", itl_max);
+
     add_json_value(ss, "finishReason", finish_reason);
     add_json_value(ss, "stopToken", stop_token, true);
 
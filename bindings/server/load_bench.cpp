@@ -0,0 +1,480 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "c_library.h"
+#include "llama.h"
+#include "generation_resources.hpp"
+#include "metrics.hpp"
+
+/*
+ * Load generator for the multi-user processor, no HTTP in between.
+ *
+ * Provides:
+ * Synthetic workloads replayed against any GGUF: Poisson arrivals, prompt and output length distributions and a
+ * ratio of requests sharing a common prefix. Throughput, TTFT, ITL and end-to-end percentiles, finish reasons and
+ * prefix-hit rates are printed as one JSON object so runs with different slot, chunk or cache settings can be diffed.
+ *
+ * Mechanism:
+ * Prompts are random non-special tokens submitted pre-tokenized, so the tokenizer and the template are not measured.
+ * Output length is pinned with min_tokens = max_tokens. A dispatcher submits on an exponential clock and every request
+ * gets a reader thread blocked in readback_wait, timestamps are taken where a client would see the tokens.
+ * Prefix hits come from the processor's own metrics.
+ *
+ * Usage:
+ * load_bench --model path.gguf [--requests 64] [--rate 4] [--slots 8] [--chunk-size 512] [--cache-k f16] ...
+ * Run with --help for every option.
+ */
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+    std::string model_path;
+    int gpu_layers = 999;
+    unsigned ctx_size = 8192;
+    unsigned chunk_size = 512;
+    int slots = 8;
+    int threads = -1;
+    bool flash_attn = true;
+    int cache_k = 1;
+    int cache_v = 1;
+    uint32_t step_budget = 0;
+    int prefill_policy = 0;
+    uint32_t host_cache_mb = 0;
+
+    int requests = 64;
+    double rate = 4.0;
+    std::string prompt_dist = "uniform";
+    int prompt_len = 256;
+    std::string output_dist = "uniform";
+    int output_len = 128;
+    double shared_prefix_ratio = 0.5;
+    int prefix_len = 128;
+    int prefix_groups = 1;
+    unsigned seed = 1337;
+    std::string out_path;
+};
+
+struct RequestPlan {
+    double arrival_sec;
+    std::vector<llama_token> prompt;
+    int output_len;
+    bool shares_prefix;
+};
+
+struct RequestResult {
+    double ttft_ms = 0.0;
+    double e2e_ms = 0.0;
+    std::vector<double> gaps_ms;
+    int tokens = 0;
+    std::string finish_reason;
+};
+
+const char* usage =
+    "load_bench --model PATH [options]\n"
+    "  model:    --gpu-layers N (999) --ctx N (8192) --chunk-size N (512) --slots N (8) --threads N (-1)\n"
+    "            --flash-attn 0|1 (1) --cache-k TYPE (f16) --cache-v TYPE (f16)\n"
+    "            --step-budget N (0) --prefill-policy 0|1 (0) --host-cache-mb N (0)\n"
+    "  workload: --requests N (64) --rate REQ_PER_SEC (4, 0 = all at once)\n"
+    "            --prompt-len N (256) --prompt-dist fixed|uniform|exp (uniform)\n"
+    "            --output-len N (128) --output-dist fixed|uniform|exp (uniform)\n"
+    "            --shared-prefix-ratio F (0.5) --prefix-len N (128) --prefix-groups N (1)\n"
+    "            --seed N (1337) --out PATH (stdout)\n"
+    "  cache types: f32 f16 bf16 q8_0 q4_0 q4_1 q5_0 q5_1 iq4_nl, or a ggml_type number\n";
+
+// Same names as GGMLType in the bindings
+int parse_cache_type(const std::string& name) {
+    static const std::map<std::string, int> types = {
+        {"f32", 0}, {"f16", 1}, {"q4_0", 2}, {"q4_1", 3}, {"q5_0", 6}, {"q5_1", 7},
+        {"q8_0", 8}, {"iq4_nl", 20}, {"bf16", 30},
+    };
+
+    const auto it = types.find(name);
+    return it != types.end() ? it->second : std::stoi(name);
+}
+
+bool parse_options(const int argc, char** argv, BenchOptions& opts) {
+    for (int i = 1; i < argc; i++) {
+        const std::string key = argv[i];
+        if (key == "--help" || key == "-h") {
+            return false;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << key << std::endl;
+            return false;
+        }
+
+        const std::string value = argv[++i];
+        if (key == "--model") opts.model_path = value;
+        else if (key == "--gpu-layers") opts.gpu_layers = std::stoi(value);
+        else if (key == "--ctx") opts.ctx_size = std::stoul(value);
+        else if (key == "--chunk-size") opts.chunk_size = std::stoul(value);
+        else if (key == "--slots") opts.slots = std::stoi(value);
+        else if (key == "--threads") opts.threads = std::stoi(value);
+        else if (key == "--flash-attn") opts.flash_attn = value != "0";
+        else if (key == "--cache-k") opts.cache_k = parse_cache_type(value);
+        else if (key == "--cache-v") opts.cache_v = parse_cache_type(value);
+        else if (key == "--step-budget") opts.step_budget = std::stoul(value);
+        else if (key == "--prefill-policy") opts.prefill_policy = std::stoi(value);
+        else if (key == "--host-cache-mb") opts.host_cache_mb = std::stoul(value);
+        else if (key == "--requests") opts.requests = std::stoi(value);
+        else if (key == "--rate") opts.rate = std::stod(value);
+        else if (key == "--prompt-len") opts.prompt_len = std::stoi(value);
+        else if (key == "--prompt-dist") opts.prompt_dist = value;
+        else if (key == "--output-len") opts.output_len = std::stoi(value);
+        else if (key == "--output-dist") opts.output_dist = value;
+        else if (key == "--shared-prefix-ratio") opts.shared_prefix_ratio = std::stod(value);
+        else if (key == "--prefix-len") opts.prefix_len = std::stoi(value);
+        else if (key == "--prefix-groups") opts.prefix_groups = std::max(1, std::stoi(value));
+        else if (key == "--seed") opts.seed = std::stoul(value);
+        else if (key == "--out") opts.out_path = value;
+        else {
+            std::cerr << "Unknown option " << key << std::endl;
+            return false;
+        }
+    }
+
+    return !opts.model_path.empty();
+}
+
+// Mean-preserving lengths, never below 1
+int sample_length(std::mt19937& rng, const std::string& dist, const int mean) {
+    double length = mean;
+    if (dist == "uniform") {
+        length = std::uniform_real_distribution(0.5 * mean, 1.5 * mean)(rng);
+    } else if (dist == "exp") {
+        length = std::exponential_distribution(1.0 / mean)(rng);
+    }
+
+    return std::max(1, static_cast<int>(length));
+}
+
+class TokenSource {
+    std::vector<llama_token> usable;
+
+public:
+    explicit TokenSource(const llama_vocab* vocab) {
+        const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+        for (llama_token token = 0; token < n_vocab; token++) {
+            if (!llama_vocab_is_control(vocab, token) && !llama_vocab_is_eog(vocab, token)) {
+                usable.push_back(token);
+            }
+        }
+    }
+
+    void append(std::mt19937& rng, const int count, std::vector<llama_token>& out) const {
+        std::uniform_int_distribution<size_t> pick(0, usable.size() - 1);
+        for (int i = 0; i < count; i++) {
+            out.push_back(usable[pick(rng)]);
+        }
+    }
+};
+
+std::vector<RequestPlan> make_workload(const BenchOptions& opts, const llama_vocab* vocab) {
+    std::mt19937 rng(opts.seed);
+    const TokenSource source(vocab);
+
+    const bool add_bos = llama_vocab_get_add_bos(vocab);
+    std::vector<std::vector<llama_token>> prefixes(opts.prefix_groups);
+    for (auto& prefix : prefixes) {
+        if (add_bos) {
+            prefix.push_back(llama_vocab_bos(vocab));
+        }
+        source.append(rng, opts.prefix_len, prefix);
+    }
+
+    std::exponential_distribution<double> inter_arrival(opts.rate > 0.0 ? opts.rate : 1.0);
+    std::bernoulli_distribution shares(std::clamp(opts.shared_prefix_ratio, 0.0, 1.0));
+    std::uniform_int_distribution<int> group(0, opts.prefix_groups - 1);
+
+    std::vector<RequestPlan> plans(opts.requests);
+    double clock = 0.0;
+    for (auto& plan : plans) {
+        plan.arrival_sec = clock;
+        if (opts.rate > 0.0) {
+            clock += inter_arrival(rng);
+        }
+
+        int prompt_len = sample_length(rng, opts.prompt_dist, opts.prompt_len);
+        plan.shares_prefix = shares(rng);
+        if (plan.shares_prefix) {
+            plan.prompt = prefixes[group(rng)];
+            prompt_len = std::max(1, prompt_len - opts.prefix_len);
+        } else if (add_bos) {
+            plan.prompt.push_back(llama_vocab_bos(vocab));
+        }
+
+        source.append(rng, prompt_len, plan.prompt);
+        plan.output_len = sample_length(rng, opts.output_dist, opts.output_len);
+    }
+
+    return plans;
+}
+
+std::string read_finish_reason(const char* status) {
+    static const std::string key = "\"finishReason\":\"";
+    const std::string json = status ? status : "";
+
+    const size_t begin = json.find(key);
+    if (begin == std::string::npos) {
+        return "Unknown";
+    }
+
+    const size_t value = begin + key.size();
+    return json.substr(value, json.find('"', value) - value);
+}
+
+void read_request(GenerationResources* resources, ReadbackBuffer* buffer, const Clock::time_point submitted,
+                  RequestResult& result) {
+    constexpr unsigned max_entries = 256;
+    std::vector<char> text(16 * 1024);
+    std::vector<uint32_t> lengths(max_entries);
+    std::vector<llama_token> tokens(max_entries);
+
+    auto last = submitted;
+    while (true) {
+        readback_wait(buffer, 100);
+
+        // Check before draining so nothing written between the drain and the check is missed
+        const bool finished = readback_is_buffer_finished(buffer);
+
+        while (true) {
+            uint32_t bytes = 0;
+            const unsigned count = readback_read_batch(
+                buffer, text.data(), static_cast<uint32_t>(text.size()),
+                lengths.data(), tokens.data(), max_entries, &bytes);
+            if (count == 0 && bytes > 0) {
+                text.resize(bytes);
+                continue;
+            }
+            if (count == 0) {
+                break;
+            }
+
+            const auto now = Clock::now();
+            for (unsigned i = 0; i < count; i++) {
+                const double since_last = std::chrono::duration<double, std::milli>(now - last).count();
+                if (result.tokens == 0) {
+                    result.ttft_ms = since_last;
+                } else {
+                    result.gaps_ms.push_back(since_last);
+                }
+
+                last = now;
+                result.tokens++;
+            }
+        }
+
+        if (finished) {
+            break;
+        }
+    }
+
+    result.e2e_ms = std::chrono::duration<double, std::milli>(Clock::now() - submitted).count();
+    result.finish_reason = read_finish_reason(readback_read_status(buffer));
+    generation_resources_release(resources);
+}
+
+void write_percentiles(std::ostringstream& ss, const char* name, std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+
+    const auto at = [&](const double q) {
+        if (values.empty()) {
+            return 0.0;
+        }
+        const auto index = static_cast<size_t>(q * static_cast<double>(values.size() - 1) + 0.5);
+        return values[index];
+    };
+
+    double mean = 0.0;
+    for (const double value : values) {
+        mean += value;
+    }
+    mean = values.empty() ? 0.0 : mean / static_cast<double>(values.size());
+
+    ss << "\"" << name << "\":{"
+       << "\"mean\":" << mean
+       << ",\"p50\":" << at(0.50)
+       << ",\"p90\":" << at(0.90)
+       << ",\"p99\":" << at(0.99)
+       << ",\"max\":" << (values.empty() ? 0.0 : values.back())
+       << "}";
+}
+
+double histogram_mean(const MetricsHistogram& histogram) {
+    return histogram.count > 0 ? histogram.sum / histogram.count : 0.0;
+}
+
+}
+
+int main(const int argc, char** argv) {
+    BenchOptions opts;
+    if (!parse_options(argc, argv, opts)) {
+        std::cerr << usage;
+        return 1;
+    }
+
+    const auto model = model_load(
+        opts.model_path.c_str(), opts.gpu_layers, 1, nullptr, nullptr, nullptr, true, false);
+    if (!model) {
+        std::cerr << "Failed to load model " << opts.model_path << std::endl;
+        return 1;
+    }
+
+    const auto ctx = ctx_make(
+        model, opts.ctx_size, opts.chunk_size, opts.chunk_size, opts.slots, opts.threads, opts.flash_attn,
+        0.0f, false, opts.cache_k, opts.cache_v, -1.0f, true);
+    if (!ctx) {
+        std::cerr << "Failed to create the context" << std::endl;
+        model_free(model);
+        return 1;
+    }
+
+    Processor* processor = processor_make(
+        model, ctx, memory_make(ctx), opts.slots, opts.step_budget, opts.prefill_policy, opts.host_cache_mb,
+        nullptr, 0, opts.cache_k, opts.cache_v, opts.flash_attn, nullptr, nullptr, 0, nullptr);
+
+    const auto plans = make_workload(opts, llama_model_get_vocab(model));
+    const uint32_t max_slot_n_ctx = ctx_max_seq_len(ctx);
+
+    std::vector<RequestResult> results(plans.size());
+    std::vector<std::thread> readers;
+    readers.reserve(plans.size());
+
+    const auto start = Clock::now();
+    for (size_t i = 0; i < plans.size(); i++) {
+        const auto& plan = plans[i];
+        std::this_thread::sleep_until(start + std::chrono::duration<double>(plan.arrival_sec));
+
+        GenerationResources* resources = generation_resources_make();
+        sampler_dist(resources->sampler, opts.seed + static_cast<unsigned>(i));
+
+        const auto submitted = Clock::now();
+        processor_submit_tokens(
+            processor, plan.prompt.data(), static_cast<unsigned>(plan.prompt.size()), resources,
+            plan.output_len, plan.output_len, max_slot_n_ctx, opts.seed + static_cast<unsigned>(i),
+            nullptr, 0, nullptr, 0, nullptr, 0, 0, 0, 0, false, 0, nullptr, 0);
+
+        readers.emplace_back(read_request, resources, resources->readback_buffer, submitted, std::ref(results[i]));
+    }
+
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    const double duration_sec = std::chrono::duration<double>(Clock::now() - start).count();
+
+    ProcessorMetrics metrics{};
+    processor_get_metrics(processor, &metrics);
+
+    std::vector<double> ttft, itl, e2e;
+    std::map<std::string, int> finish_reasons;
+    long output_tokens = 0;
+    long prompt_tokens = 0;
+    int shared = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& result = results[i];
+        finish_reasons[result.finish_reason]++;
+        output_tokens += result.tokens;
+        prompt_tokens += static_cast<long>(plans[i].prompt.size());
+        shared += plans[i].shares_prefix;
+
+        if (result.tokens > 0) {
+            ttft.push_back(result.ttft_ms);
+        }
+        e2e.push_back(result.e2e_ms);
+        itl.insert(itl.end(), result.gaps_ms.begin(), result.gaps_ms.end());
+    }
+
+    const double reuse = metrics.prefix_reuse_tokens_total;
+    const double prefilled = metrics.prefill_tokens_total;
+    const double requests_with_reuse =
+        metrics.prefix_reuse_tokens.count - metrics.prefix_reuse_tokens.counts[0];
+
+    std::ostringstream ss;
+    ss << "{\"config\":{"
+       << "\"model\":\"" << opts.model_path << "\""
+       << ",\"slots\":" << opts.slots
+       << ",\"ctx\":" << opts.ctx_size
+       << ",\"chunkSize\":" << opts.chunk_size
+       << ",\"cacheK\":" << opts.cache_k
+       << ",\"cacheV\":" << opts.cache_v
+       << ",\"flashAttn\":" << (opts.flash_attn ? "true" : "false")
+       << ",\"stepBudget\":" << opts.step_budget
+       << ",\"prefillPolicy\":" << opts.prefill_policy
+       << ",\"requests\":" << opts.requests
+       << ",\"rate\":" << opts.rate
+       << ",\"promptLen\":" << opts.prompt_len
+       << ",\"promptDist\":\"" << opts.prompt_dist << "\""
+       << ",\"outputLen\":" << opts.output_len
+       << ",\"outputDist\":\"" << opts.output_dist << "\""
+       << ",\"sharedPrefixRatio\":" << opts.shared_prefix_ratio
+       << ",\"prefixLen\":" << opts.prefix_len
+       << ",\"prefixGroups\":" << opts.prefix_groups
+       << ",\"seed\":" << opts.seed
+       << "},";
+
+    ss << "\"durationSec\":" << duration_sec
+       << ",\"promptTokens\":" << prompt_tokens
+       << ",\"outputTokens\":" << output_tokens
+       << ",\"requestsPerSec\":" << static_cast<double>(results.size()) / duration_sec
+       << ",\"outputTokensPerSec\":" << static_cast<double>(output_tokens) / duration_sec
+       << ",\"totalTokensPerSec\":" << static_cast<double>(output_tokens + prompt_tokens) / duration_sec
+       << ",";
+
+    write_percentiles(ss, "ttftMs", ttft);
+    ss << ",";
+    write_percentiles(ss, "itlMs", itl);
+    ss << ",";
+    write_percentiles(ss, "e2eMs", e2e);
+
+    ss << ",\"prefix\":{"
+       << "\"sharedRequests\":" << shared
+       << ",\"requestsWithReuse\":" << requests_with_reuse
+       << ",\"reuseTokens\":" << reuse
+       << ",\"prefillTokens\":" << prefilled
+       << ",\"tokenHitRate\":" << (reuse + prefilled > 0 ? reuse / (reuse + prefilled) : 0.0)
+       << "}";
+
+    ss << ",\"engine\":{"
+       << "\"decodeSteps\":" << metrics.decode_steps_total
+       << ",\"decodeErrors\":" << metrics.decode_errors_total
+       << ",\"preemptions\":" << metrics.preemptions_total
+       << ",\"meanBatchFill\":" << histogram_mean(metrics.batch_fill_ratio)
+       << ",\"meanDecodeMs\":" << histogram_mean(metrics.decode_seconds) * 1000.0
+       << "}";
+
+    ss << ",\"finishReasons\":{";
+    bool first = true;
+    for (const auto& [reason, count] : finish_reasons) {
+        ss << (first ? "" : ",") << "\"" << reason << "\":" << count;
+        first = false;
+    }
+    ss << "}}";
+
+    if (opts.out_path.empty()) {
+        std::cout << ss.str() << std::endl;
+    } else if (FILE* file = std::fopen(opts.out_path.c_str(), "w")) {
+        std::fputs(ss.str().c_str(), file);
+        std::fputc('\n', file);
+        std::fclose(file);
+    } else {
+        std::cerr << "Could not write " << opts.out_path << std::endl;
+    }
+
+    processor_free(processor);
+    ctx_free(ctx);
+    model_free(model);
+
+    return 0;
+}
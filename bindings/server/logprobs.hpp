@@ -0,0 +1,69 @@
+#ifndef LOGPROBS_HPP
+#define LOGPROBS_HPP
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "llama.h"
+
+/*
+ * Log-probabilities of sampled tokens and their most likely alternatives.
+ *
+ * Provides:
+ * The sampled token's logprob and the top-k of the model's distribution, from one logits row.
+ *
+ * Mechanism:
+ * Two passes over the raw logits. The first finds the max and keeps the k best tokens in a small min-heap,
+ * the second sums the exponentials for the normalizer. Only the k survivors are ever sorted.
+ */
+
+struct TokenLogprob {
+    llama_token token;
+    float logprob;
+};
+
+class LogprobCollector {
+    std::vector<TokenLogprob> heap;
+
+    static bool worse(const TokenLogprob& a, const TokenLogprob& b) {
+        return a.logprob > b.logprob;
+    }
+
+public:
+    // Appends 1 + top_k records: the chosen token first, then the top_k most likely tokens in descending order.
+    void collect(const float* logits, const int32_t n_vocab, const llama_token chosen, const int top_k,
+                 std::vector<TokenLogprob>& out) {
+        const size_t k = static_cast<size_t>(std::clamp(top_k, 0, n_vocab));
+        heap.clear();
+
+        float max_logit = -INFINITY;
+        for (int32_t i = 0; i < n_vocab; i++) {
+            const float logit = logits[i];
+            max_logit = std::max(max_logit, logit);
+
+            if (heap.size() < k) {
+                heap.push_back({i, logit});
+                std::push_heap(heap.begin(), heap.end(), worse);
+            } else if (k > 0 && logit > heap.front().logprob) {
+                std::pop_heap(heap.begin(), heap.end(), worse);
+                heap.back() = {i, logit};
+                std::push_heap(heap.begin(), heap.end(), worse);
+            }
+        }
+
+        double sum = 0.0;
+        for (int32_t i = 0; i < n_vocab; i++) {
+            sum += std::exp(static_cast<double>(logits[i] - max_logit));
+        }
+        const auto log_norm = static_cast<float>(max_logit + std::log(sum));
+
+        out.push_back({chosen, logits[chosen] - log_norm});
+
+        std::sort_heap(heap.begin(), heap.end(), worse);
+        for (const auto& entry : heap) {
+            out.push_back({entry.token, entry.logprob - log_norm});
+        }
+    }
+};
+
+#endif // LOGPROBS_HPP
@@ -0,0 +1,202 @@
+#ifndef MATCH_AUTOMATON_HPP
+#define MATCH_AUTOMATON_HPP
+
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Streaming matcher for stop and rewind strings.
+ *
+ * Provides:
+ * Case-insensitive detection of any of the bound strings in text fed piece by piece, reporting the earliest match
+ * or whether the text seen so far could still become one.
+ *
+ * Mechanism:
+ * An Aho-Corasick automaton compiled once per request into a flat table of next states, indexed by state and byte
+ * class. Bytes that appear in no string share one class, and upper case bytes share their lower case class.
+ * The state carries across pieces, so every byte costs one lookup no matter how long the pending text is.
+ */
+
+enum class MatchType {
+    REWIND,
+    STOP
+};
+
+enum class MatchResult {
+    NO,
+    MAYBE,
+    MATCHED_REWIND,
+    MATCHED_STOP
+};
+
+class MatchAutomaton {
+    std::array<uint16_t, 256> byte_class{};
+    uint32_t num_classes{1};
+
+    // Indexed by state * num_classes + class
+    std::vector<int32_t> next_state;
+
+    // Per state: length of the text it stands for, and the longest bound string ending there (0 for none)
+    std::vector<int32_t> depth;
+    std::vector<int32_t> match_length;
+    std::vector<MatchType> match_type;
+
+    int32_t state{0};
+    bool has_words{false};
+
+    static unsigned char to_lower(const unsigned char c) {
+        return static_cast<unsigned char>(std::tolower(c));
+    }
+
+public:
+    struct FeedResult {
+        MatchResult result;
+
+        // Offset of the match in the text fed since the last reset, valid when matched
+        size_t match_start;
+    };
+
+    // Later strings win over identical earlier ones, so rewinds win over stops
+    void build(const std::vector<std::string>& stop_words, const std::vector<std::string>& rewind_words) {
+        byte_class.fill(0);
+        num_classes = 1;
+        has_words = false;
+
+        for (const auto* words : {&stop_words, &rewind_words}) {
+            for (const auto& word : *words) {
+                for (const char c : word) {
+                    const unsigned char lower = to_lower(static_cast<unsigned char>(c));
+                    if (byte_class[lower] == 0) {
+                        byte_class[lower] = static_cast<uint16_t>(num_classes++);
+                    }
+                }
+            }
+        }
+
+        for (unsigned c = 0; c < 256; c++) {
+            byte_class[c] = byte_class[to_lower(static_cast<unsigned char>(c))];
+        }
+
+        // Trie first, -1 marks a missing edge
+        next_state.assign(num_classes, -1);
+        depth.assign(1, 0);
+        match_length.assign(1, 0);
+        match_type.assign(1, MatchType::STOP);
+
+        const auto add_words = [&](const std::vector<std::string>& words, const MatchType type) {
+            for (const auto& word : words) {
+                if (word.empty()) {
+                    continue;
+                }
+
+                int32_t node = 0;
+                for (const char c : word) {
+                    const size_t edge = node * num_classes + byte_class[static_cast<unsigned char>(c)];
+                    if (next_state[edge] < 0) {
+                        const auto child = static_cast<int32_t>(depth.size());
+                        next_state[edge] = child;
+                        next_state.resize(next_state.size() + num_classes, -1);
+                        depth.push_back(depth[node] + 1);
+                        match_length.push_back(0);
+                        match_type.push_back(MatchType::STOP);
+                    }
+                    node = next_state[node * num_classes + byte_class[static_cast<unsigned char>(c)]];
+                }
+
+                match_length[node] = depth[node];
+                match_type[node] = type;
+                has_words = true;
+            }
+        };
+
+        add_words(stop_words, MatchType::STOP);
+        add_words(rewind_words, MatchType::REWIND);
+
+        // Breadth first, fill missing edges from the failure state and inherit its longest match
+        std::vector<int32_t> failure(depth.size(), 0);
+        std::deque<int32_t> queue;
+        for (uint32_t c = 0; c < num_classes; c++) {
+            int32_t& child = next_state[c];
+            if (child < 0) {
+                child = 0;
+            } else {
+                queue.push_back(child);
+            }
+        }
+
+        while (!queue.empty()) {
+            const int32_t node = queue.front();
+            queue.pop_front();
+
+            if (match_length[node] == 0 && match_length[failure[node]] > 0) {
+                match_length[node] = match_length[failure[node]];
+                match_type[node] = match_type[failure[node]];
+            }
+
+            for (uint32_t c = 0; c < num_classes; c++) {
+                const size_t edge = node * num_classes + c;
+                const int32_t fallback = next_state[failure[node] * num_classes + c];
+                if (next_state[edge] < 0) {
+                    next_state[edge] = fallback;
+                } else {
+                    failure[next_state[edge]] = fallback;
+                    queue.push_back(next_state[edge]);
+                }
+            }
+        }
+
+        state = 0;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return !has_words;
+    }
+
+    void reset() {
+        state = 0;
+    }
+
+    // Feeds the next piece, offset is how much text was fed since the last reset.
+    // A match reports the one starting first, the shortest on ties. MAYBE means a suffix could still grow into one.
+    FeedResult feed(const std::string_view& piece, const size_t offset) {
+        if (!has_words) {
+            return {MatchResult::NO, 0};
+        }
+
+        auto result = MatchResult::NO;
+        size_t best_start = SIZE_MAX;
+
+        for (size_t i = 0; i < piece.size(); i++) {
+            state = next_state[state * num_classes + byte_class[static_cast<unsigned char>(piece[i])]];
+            const size_t end = offset + i + 1;
+
+            if (match_length[state] > 0) {
+                const size_t start = end - match_length[state];
+                if (start < best_start) {
+                    best_start = start;
+                    result = match_type[state] == MatchType::REWIND ?
+                        MatchResult::MATCHED_REWIND :
+                        MatchResult::MATCHED_STOP;
+                }
+            }
+
+            // Nothing tracked from here on can start before the match we have
+            if (result != MatchResult::NO && end - depth[state] >= best_start) {
+                break;
+            }
+        }
+
+        if (result != MatchResult::NO) {
+            return {result, best_start};
+        }
+
+        return {state != 0 ? MatchResult::MAYBE : MatchResult::NO, 0};
+    }
+};
+
+#endif // MATCH_AUTOMATON_HPP
@@ -0,0 +1,139 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/*
+ * Engine metrics, maintained by the processor's worker thread and read from any thread.
+ *
+ * Provides:
+ * Gauges, counters and fixed-bucket histograms of what the processor is doing, as one plain struct.
+ * A lock-free snapshot of it for the C API, readers never block the worker.
+ *
+ * Mechanism:
+ * The worker updates its own copy while it runs and publishes it once per step through a seqlock.
+ * Every field is a double so the struct can be read as one array from the bindings.
+ * Histograms carry their bucket bounds, the last bound is +Inf. Bucket counts are not cumulative.
+ */
+
+constexpr size_t METRICS_HISTOGRAM_BUCKETS = 12;
+
+struct MetricsHistogram {
+    double bounds[METRICS_HISTOGRAM_BUCKETS];
+    double counts[METRICS_HISTOGRAM_BUCKETS];
+    double sum;
+    double count;
+
+    void init(const std::array<double, METRICS_HISTOGRAM_BUCKETS - 1>& upper_bounds) {
+        std::copy(upper_bounds.begin(), upper_bounds.end(), bounds);
+        bounds[METRICS_HISTOGRAM_BUCKETS - 1] = INFINITY;
+    }
+
+    void observe(const double value) {
+        size_t bucket = 0;
+        while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 && value > bounds[bucket]) {
+            bucket++;
+        }
+
+        counts[bucket]++;
+        sum += value;
+        count++;
+    }
+};
+
+struct ProcessorMetrics {
+    // Gauges, sampled at the end of every step
+    double queue_depth;
+    double parked_requests;
+    double slots_idle;
+    double slots_prompt;
+    double slots_generating;
+    double kv_tokens_used; // distinct cells, shared prefixes count once
+    double kv_tokens_total;
+
+    // Counters
+    double decode_steps_total;
+    double decode_errors_total;
+    double prefill_tokens_total;
+    double decode_tokens_total;
+    double requests_started_total;
+    double requests_finished_total;
+    double prefix_reuse_tokens_total;
+    double rewinds_total;
+    double cancellations_total;
+    double preemptions_total;
+
+    // Per llama_decode
+    MetricsHistogram batch_fill_ratio;
+    MetricsHistogram prefill_tokens_per_step;
+    MetricsHistogram decode_tokens_per_step;
+    MetricsHistogram decode_seconds;
+
+    // Per request, tokens restored from a slot or a cache instead of prefilled
+    MetricsHistogram prefix_reuse_tokens;
+
+    void init() {
+        *this = {};
+        batch_fill_ratio.init({0.05, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1.0});
+        prefill_tokens_per_step.init({0, 1, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096});
+        decode_tokens_per_step.init({0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512});
+        decode_seconds.init({0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5});
+        prefix_reuse_tokens.init({0, 16, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384});
+    }
+};
+
+static_assert(std::is_trivially_copyable_v<ProcessorMetrics>);
+static_assert(sizeof(ProcessorMetrics) % sizeof(uint64_t) == 0);
+
+// Single writer seqlock. The words are atomics so a torn read is only ever discarded, never undefined.
+class MetricsPublisher {
+    static constexpr size_t num_words = sizeof(ProcessorMetrics) / sizeof(uint64_t);
+
+    std::atomic<uint64_t> sequence{0};
+    std::array<std::atomic<uint64_t>, num_words> words{};
+
+public:
+    void publish(const ProcessorMetrics& metrics) {
+        uint64_t raw[num_words];
+        std::memcpy(raw, &metrics, sizeof(raw));
+
+        const uint64_t seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t i = 0; i < num_words; i++) {
+            words[i].store(raw[i], std::memory_order_relaxed);
+        }
+
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    void read(ProcessorMetrics& out) const {
+        uint64_t raw[num_words];
+        while (true) {
+            const uint64_t before = sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                continue;
+            }
+
+            for (size_t i = 0; i < num_words; i++) {
+                raw[i] = words[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before) {
+                break;
+            }
+        }
+
+        std::memcpy(&out, raw, sizeof(raw));
+    }
+};
+
+#endif // METRICS_HPP
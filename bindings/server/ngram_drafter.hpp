@@ -0,0 +1,91 @@
+#ifndef NGRAM_DRAFTER_HPP
+#define NGRAM_DRAFTER_HPP
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include "llama.h"
+#include "host_kv_cache.hpp"
+
+/*
+ * Prompt lookup drafting. Proposes tokens by finding the current suffix earlier in the sequence.
+ *
+ * Provides:
+ * Speculative drafts without a draft model, for outputs that copy spans of the prompt (code edits, RAG, rewrites).
+ *
+ * Mechanism:
+ * Every n-gram of the sequence that has a following token is indexed by its hash, pointing at that token for its
+ * latest such occurrence. The index grows with the sequence, the newest n-gram is indexed once a token follows it.
+ * A cut sequence (rewinds) is indexed again, entries past the cut may have replaced earlier occurrences.
+ */
+
+class NgramDrafter {
+    int ngram_size{0};
+    int max_draft{0};
+
+    // Hash of an n-gram -> position following its latest occurrence. N-grams ending before indexed_len are indexed.
+    std::unordered_map<uint64_t, size_t> index;
+    size_t indexed_len{0};
+
+    std::vector<llama_token> ngram_buffer;
+
+    [[nodiscard]] bool matches_at(const std::vector<llama_token>& tokens, const size_t end,
+                                  const llama_token* ngram) const {
+        if (end < static_cast<size_t>(ngram_size) || end > tokens.size()) {
+            return false;
+        }
+        return std::equal(ngram, ngram + ngram_size, tokens.begin() + static_cast<long>(end - ngram_size));
+    }
+
+public:
+    void configure(const int n, const int n_draft) {
+        ngram_size = n;
+        max_draft = n_draft;
+        reset();
+    }
+
+    [[nodiscard]] bool enabled() const {
+        return ngram_size > 0 && max_draft > 0;
+    }
+
+    void reset() {
+        index.clear();
+        indexed_len = 0;
+    }
+
+    // Drafts up to n_draft tokens following tokens + last_token. Returns false if the suffix was never seen.
+    bool draft(const std::vector<llama_token>& tokens, const llama_token last_token, const int n_draft,
+               std::vector<llama_token>& out) {
+        out.clear();
+        const size_t n = static_cast<size_t>(ngram_size);
+        if (!enabled() || tokens.size() < n) {
+            return false;
+        }
+
+        if (tokens.size() < indexed_len) {
+            reset();
+        }
+
+        // Only n-grams with a following token can be drafted from
+        for (size_t end = std::max(indexed_len, n); end < tokens.size(); end++) {
+            index[hash_tokens(tokens.data() + end - n, n)] = end;
+        }
+        indexed_len = tokens.size();
+
+        // The suffix ends with the token that isn't in the sequence yet
+        ngram_buffer.assign(tokens.end() - static_cast<long>(n - 1), tokens.end());
+        ngram_buffer.push_back(last_token);
+
+        const auto it = index.find(hash_tokens(ngram_buffer.data(), n));
+        if (it == index.end() || it->second >= tokens.size() || !matches_at(tokens, it->second, ngram_buffer.data())) {
+            return false;
+        }
+
+        const size_t start = it->second;
+        const size_t count = std::min(static_cast<size_t>(std::min(n_draft, max_draft)), tokens.size() - start);
+        out.assign(tokens.begin() + static_cast<long>(start), tokens.begin() + static_cast<long>(start + count));
+        return !out.empty();
+    }
+};
+
+#endif // NGRAM_DRAFTER_HPP
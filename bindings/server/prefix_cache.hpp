@@ -0,0 +1,214 @@
+#ifndef PREFIX_CACHE_HPP
+#define PREFIX_CACHE_HPP
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include "llama.h"
+
+/*
+ * A radix tree over the token sequences that are resident in the KV cache, shared by every slot.
+ *
+ * Provides:
+ * Longest-prefix lookups against the KV of every sequence, busy or idle.
+ * The per-sequence match length, so the processor can pick between reusing a slot's own KV or sharing another's.
+ * The number of distinct tokens indexed, a prefix shared by several sequences counts once.
+ *
+ * Mechanism:
+ * Edges hold runs of tokens. Every node keeps the sequence ids whose KV covers the path up to the end of its edge.
+ * Each sequence remembers the node its path ends on, so growing or cutting a sequence only touches the changed tail.
+ */
+
+class PrefixCache {
+    struct Node {
+        Node* parent{nullptr};
+        std::vector<llama_token> edge;
+        size_t depth{0};
+        std::unordered_map<llama_token, std::unique_ptr<Node>> children;
+        std::vector<llama_seq_id> holders;
+
+        [[nodiscard]] bool is_held_by(const llama_seq_id seq_id) const {
+            return std::find(holders.begin(), holders.end(), seq_id) != holders.end();
+        }
+
+        void hold(const llama_seq_id seq_id) {
+            if (!is_held_by(seq_id)) {
+                holders.push_back(seq_id);
+            }
+        }
+
+        void release(const llama_seq_id seq_id) {
+            holders.erase(std::remove(holders.begin(), holders.end(), seq_id), holders.end());
+        }
+    };
+
+    struct SeqEntry {
+        Node* tail;
+        size_t length;
+    };
+
+    std::unique_ptr<Node> root;
+    std::unordered_map<llama_seq_id, SeqEntry> sequences;
+    size_t resident{0};
+
+    // Splits the edge of a node at offset, returning the new node that ends at the split point.
+    static Node* split(Node* node, const size_t offset) {
+        Node* parent = node->parent;
+        auto owned = std::move(parent->children[node->edge[0]]);
+
+        auto mid = std::make_unique<Node>();
+        mid->parent = parent;
+        mid->edge.assign(node->edge.begin(), node->edge.begin() + static_cast<long>(offset));
+        mid->depth = node->depth - node->edge.size() + offset;
+        mid->holders = node->holders;
+
+        node->edge.erase(node->edge.begin(), node->edge.begin() + static_cast<long>(offset));
+        node->parent = mid.get();
+
+        Node* mid_ptr = mid.get();
+        mid->children[node->edge[0]] = std::move(owned);
+        parent->children[mid_ptr->edge[0]] = std::move(mid);
+        return mid_ptr;
+    }
+
+    // Removes a node with no holders left. Nodes without holders never have children with holders.
+    void prune(Node* node) {
+        while (node != root.get() && node->holders.empty()) {
+            Node* parent = node->parent;
+            resident -= node->edge.size();
+            parent->children.erase(node->edge[0]);
+            node = parent;
+        }
+    }
+
+public:
+    PrefixCache() : root(std::make_unique<Node>()) {}
+
+    [[nodiscard]] size_t length(const llama_seq_id seq_id) const {
+        const auto it = sequences.find(seq_id);
+        return it == sequences.end() ? 0 : it->second.length;
+    }
+
+    // Tokens on all paths of the tree, each shared prefix counted once
+    [[nodiscard]] size_t resident_tokens() const {
+        return resident;
+    }
+
+    // Registers the tokens a sequence holds. Tokens before the already indexed length are assumed unchanged.
+    void extend(const llama_seq_id seq_id, const std::vector<llama_token>& tokens) {
+        auto& [tail, length] = sequences.try_emplace(seq_id, SeqEntry{root.get(), 0}).first->second;
+        size_t pos = length;
+        Node* node = tail;
+
+        while (pos < tokens.size()) {
+            const auto it = node->children.find(tokens[pos]);
+            if (it == node->children.end()) {
+                auto leaf = std::make_unique<Node>();
+                leaf->parent = node;
+                leaf->edge.assign(tokens.begin() + static_cast<long>(pos), tokens.end());
+                leaf->depth = tokens.size();
+                leaf->hold(seq_id);
+                resident += leaf->edge.size();
+
+                Node* leaf_ptr = leaf.get();
+                node->children[tokens[pos]] = std::move(leaf);
+                node = leaf_ptr;
+                pos = tokens.size();
+                break;
+            }
+
+            Node* child = it->second.get();
+            size_t matched = 0;
+            while (matched < child->edge.size() && pos + matched < tokens.size() &&
+                   child->edge[matched] == tokens[pos + matched]) {
+                matched++;
+            }
+
+            if (matched < child->edge.size()) {
+                child = split(child, matched);
+            }
+
+            child->hold(seq_id);
+            node = child;
+            pos += matched;
+        }
+
+        tail = node;
+        length = pos;
+    }
+
+    // Cuts a sequence down to new_length tokens, mirroring a llama_memory_seq_rm from new_length onwards.
+    void truncate(const llama_seq_id seq_id, const size_t new_length) {
+        const auto it = sequences.find(seq_id);
+        if (it == sequences.end() || it->second.length <= new_length) {
+            return;
+        }
+
+        Node* node = it->second.tail;
+        while (node != root.get() && node->depth - node->edge.size() >= new_length) {
+            Node* parent = node->parent;
+            node->release(seq_id);
+            prune(node);
+            node = parent;
+        }
+
+        // The new end falls inside this node's edge
+        if (node != root.get() && node->depth > new_length) {
+            node = split(node, new_length - (node->depth - node->edge.size()));
+            Node* rest = node->children.begin()->second.get();
+            rest->release(seq_id);
+            prune(rest);
+        }
+
+        if (new_length == 0) {
+            sequences.erase(it);
+            return;
+        }
+
+        it->second.tail = node;
+        it->second.length = new_length;
+    }
+
+    void erase(const llama_seq_id seq_id) {
+        truncate(seq_id, 0);
+    }
+
+    // Walks the tree with the given tokens. match_lens[seq] receives how many leading tokens that sequence holds.
+    // Returns the longest match over all sequences.
+    size_t match(const std::vector<llama_token>& tokens, std::vector<size_t>& match_lens) const {
+        std::fill(match_lens.begin(), match_lens.end(), 0);
+
+        const Node* node = root.get();
+        size_t pos = 0;
+        while (pos < tokens.size()) {
+            const auto it = node->children.find(tokens[pos]);
+            if (it == node->children.end()) {
+                break;
+            }
+
+            const Node* child = it->second.get();
+            size_t matched = 0;
+            while (matched < child->edge.size() && pos + matched < tokens.size() &&
+                   child->edge[matched] == tokens[pos + matched]) {
+                matched++;
+            }
+
+            pos += matched;
+            for (const llama_seq_id holder : child->holders) {
+                if (static_cast<size_t>(holder) < match_lens.size()) {
+                    match_lens[holder] = pos;
+                }
+            }
+
+            if (matched < child->edge.size()) {
+                break;
+            }
+            node = child;
+        }
+
+        return pos;
+    }
+};
+
+#endif // PREFIX_CACHE_HPP
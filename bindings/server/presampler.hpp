@@ -1,8 +1,11 @@
 #ifndef PRESAMPLER_HPP
 #define PRESAMPLER_HPP
 
-#include <unordered_set>
-#include "samplers.hpp"
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "llama.h"
 
 /*
  * The presampler is responsible for rewind biasing and stopping biasing.
@@ -12,94 +15,221 @@
  *  Rewind bans: Keeps track of the rewinding ban buffer.
  *
  *  Mechanism:
- *  This is overall simply an extra sampler that is used first in the sampling chain to pre-filter banned logits.
+ *  A custom sampler that lives as long as the slot and holds a vocab-sized ban bitmask per ban source, plus the list
+ *  of banned ids. Adding or clearing bans only touches the changed tokens.
+ *  Sampling builds the candidates from a logits row fetched by the caller, bans them in place, then runs the request's
+ *  chain over them as is. The chain is never spliced into or modified.
  */
 
-inline llama_sampler* build_presampler_chain(
-    const llama_model* model,
-    const uint32_t seed,
-    const int32_t n_bias,
-    const llama_logit_bias* logit_bias) {
-    llama_sampler* sampler = sampler_make();
-    sampler = sampler_logit_bias(sampler, model, n_bias, logit_bias);
-    sampler = sampler_dist(sampler, seed);
+class TokenBans {
+    struct BanSet {
+        std::vector<uint64_t> mask;
+        std::vector<llama_token> tokens;
 
-    return sampler;
+        [[nodiscard]] bool contains(const llama_token token) const {
+            return mask[token >> 6] >> (token & 63) & 1;
+        }
+
+        void add(const llama_token token) {
+            if (!contains(token)) {
+                mask[token >> 6] |= uint64_t{1} << (token & 63);
+                tokens.push_back(token);
+            }
+        }
+
+        void clear() {
+            for (const llama_token token : tokens) {
+                mask[token >> 6] &= ~(uint64_t{1} << (token & 63));
+            }
+            tokens.clear();
+        }
+    };
+
+    int32_t n_vocab{0};
+
+public:
+    BanSet rewind;
+    BanSet eos;
+
+    explicit TokenBans(const int32_t n_vocab) : n_vocab(n_vocab) {
+        const size_t words = (static_cast<size_t>(n_vocab) + 63) / 64;
+        rewind.mask.assign(words, 0);
+        eos.mask.assign(words, 0);
+    }
+
+    [[nodiscard]] bool in_vocab(const llama_token token) const {
+        return token >= 0 && token < n_vocab;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return rewind.tokens.empty() && eos.tokens.empty();
+    }
+
+    void apply(llama_token_data_array* cur_p) const {
+        // Candidates straight from a logits row are indexed by token, so only the banned entries need touching
+        bool by_index = !cur_p->sorted && cur_p->size == static_cast<size_t>(n_vocab);
+        for (const auto* set : {&rewind, &eos}) {
+            for (const llama_token token : set->tokens) {
+                if (!by_index || cur_p->data[token].id != token) {
+                    by_index = false;
+                    break;
+                }
+                cur_p->data[token].logit = -INFINITY;
+            }
+        }
+
+        if (by_index) {
+            return;
+        }
+
+        // Any other layout takes one pass over the candidates against the masks
+        for (size_t i = 0; i < cur_p->size; i++) {
+            const llama_token token = cur_p->data[i].id;
+            if (in_vocab(token) && (rewind.contains(token) || eos.contains(token))) {
+                cur_p->data[i].logit = -INFINITY;
+            }
+        }
+    }
+};
+
+// Same as llama_sampler_sample on a logits row the caller already fetched, with any bans applied ahead of the chain.
+// Never touches the context, candidates is the caller's scratch.
+inline llama_token sample_logits_row(const llama_sampler* bans, llama_sampler* chain, const float* logits,
+                                     const int32_t n_vocab, std::vector<llama_token_data>& candidates) {
+    candidates.resize(n_vocab);
+    for (llama_token token = 0; token < n_vocab; token++) {
+        candidates[token] = {token, logits[token], 0.0f};
+    }
+
+    llama_token_data_array cur_p {candidates.data(), candidates.size(), -1, false};
+    if (bans) {
+        llama_sampler_apply(const_cast<llama_sampler*>(bans), &cur_p);
+    }
+    llama_sampler_apply(chain, &cur_p);
+
+    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < static_cast<int64_t>(cur_p.size));
+
+    const llama_token token = cur_p.data[cur_p.selected].id;
+    llama_sampler_accept(chain, token);
+    return token;
+}
+
+inline const char* token_bans_name(const llama_sampler*) {
+    return "yals-token-bans";
+}
+
+inline void token_bans_apply(llama_sampler* smpl, llama_token_data_array* cur_p) {
+    static_cast<const TokenBans*>(smpl->ctx)->apply(cur_p);
+}
+
+inline llama_sampler* token_bans_clone(const llama_sampler* smpl);
+
+inline void token_bans_free(llama_sampler* smpl) {
+    delete static_cast<TokenBans*>(smpl->ctx);
+}
+
+// Bans are managed by their owner, so accepting tokens or resetting the chain leaves them alone
+inline const llama_sampler_i token_bans_iface {
+    token_bans_name,
+    nullptr,
+    token_bans_apply,
+    nullptr,
+    token_bans_clone,
+    token_bans_free
+};
+
+inline llama_sampler* token_bans_clone(const llama_sampler* smpl) {
+    return llama_sampler_init(&token_bans_iface, new TokenBans(*static_cast<const TokenBans*>(smpl->ctx)));
 }
 
 struct Presampler {
 private:
-    //Biases imposed by the rewind mechanism.
-    std::unordered_set<llama_token> rewind_biases;
+    // Made with the first ban and kept for the slot's lifetime, so later requests reuse the masks
+    llama_sampler* sampler {nullptr};
 
-    //Biases imposed by stopping criterion.
-    std::unordered_set<llama_token> eos_biases;
+    [[nodiscard]] TokenBans* bans() const {
+        return sampler ? static_cast<TokenBans*>(sampler->ctx) : nullptr;
+    }
 
-    void rebuild_presampler(const llama_model* model) {
-        std::vector<llama_logit_bias> biases;
-        for (const llama_token token : rewind_biases) {
-            biases.push_back({token, -50000.0f});
+    TokenBans& bans_for(const llama_model* model) {
+        if (!sampler) {
+            const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+            sampler = llama_sampler_init(&token_bans_iface, new TokenBans(n_vocab));
         }
-        for (const llama_token token : eos_biases) {
-            biases.push_back({token, -50000.0f});
+        return *bans();
+    }
+
+    void add_tokens(const llama_model* model, const bool is_rewind, const std::vector<llama_token>& tokens) {
+        TokenBans& token_bans = bans_for(model);
+        auto& set = is_rewind ? token_bans.rewind : token_bans.eos;
+        for (const llama_token token : tokens) {
+            if (token_bans.in_vocab(token)) {
+                set.add(token);
+            }
         }
+    }
+
+public:
+    Presampler() = default;
+
+    Presampler(const Presampler& other) : sampler(other.sampler ? llama_sampler_clone(other.sampler) : nullptr) {
+    }
 
-        should_presample = !biases.empty();
+    Presampler(Presampler&& other) noexcept : sampler(std::exchange(other.sampler, nullptr)) {
+    }
 
-        llama_sampler_free(sampler);
-        sampler = build_presampler_chain(model, seed, static_cast<int32_t>(biases.size()), biases.data());
+    Presampler& operator=(Presampler other) noexcept {
+        std::swap(sampler, other.sampler);
+        return *this;
     }
 
-    void add_tokens_to_bias(std::unordered_set<llama_token>& bias_set,
-                            const llama_model* model,
-                            const std::vector<llama_token>& tokens) {
-        for (auto& token : tokens) {
-            bias_set.insert(token);
+    ~Presampler() {
+        if (sampler) {
+            llama_sampler_free(sampler);
         }
-        rebuild_presampler(model);
     }
 
-public:
-    llama_sampler* sampler {nullptr};
-    uint32_t seed = 1337;
-    bool should_presample = false;
+    // Whether sampling has to go through the bans
+    [[nodiscard]] bool should_presample() const {
+        return active_bans() != nullptr;
+    }
+
+    // The bans to apply, null when there are none
+    [[nodiscard]] const TokenBans* active_bans() const {
+        const TokenBans* token_bans = bans();
+        return token_bans && !token_bans->empty() ? token_bans : nullptr;
+    }
+
+    // Samples a logits row with the bans applied first, if any, then the chain
+    llama_token sample(llama_sampler* chain, const float* logits, const int32_t n_vocab,
+                       std::vector<llama_token_data>& candidates) const {
+        return sample_logits_row(should_presample() ? sampler : nullptr, chain, logits, n_vocab, candidates);
+    }
 
     void add_rewind_bans(const llama_model* model, const std::vector<llama_token> &tokens) {
-        add_tokens_to_bias(rewind_biases, model, tokens);
+        add_tokens(model, true, tokens);
     }
 
     void add_eos_ban(const llama_model* model, const std::vector<llama_token> &tokens) {
-        add_tokens_to_bias(eos_biases, model, tokens);
+        add_tokens(model, false, tokens);
     }
 
-    void clear_rewind_bans(const llama_model* model) {
-        if (rewind_biases.empty()) {
-            return;
+    void clear_rewind_bans(const llama_model*) {
+        if (TokenBans* token_bans = bans()) {
+            token_bans->rewind.clear();
         }
-        rewind_biases.clear();
-        rebuild_presampler(model);
     }
 
-    void clear_eos_bans(const llama_model* model) {
-        if (eos_biases.empty()) {
-            return;
+    void clear_eos_bans(const llama_model*) {
+        if (TokenBans* token_bans = bans()) {
+            token_bans->eos.clear();
         }
-        eos_biases.clear();
-        rebuild_presampler(model);
     }
 
-    // Fully resets the presampler state
+    // Drops every ban, the sampler stays for the next request
     void reset() {
-        rewind_biases.clear();
-        eos_biases.clear();
-
-        // Might not be needed, but just in case
-        should_presample = false;
-
-        if (sampler) {
-            llama_sampler_free(sampler);
-            sampler = nullptr;
-        }
+        clear_rewind_bans(nullptr);
+        clear_eos_bans(nullptr);
     }
 };
 
@@ -2,14 +2,17 @@
 #define PROCESSOR_HPP
 
 #include <utility>
+#include <algorithm>
 #include <vector>
 #include <string>
-#include <queue>
+#include <deque>
+#include <list>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <cmath>
 #include <thread>
+#include <unordered_set>
 
 #include "inference_args.hpp"
 #include "llama.h"
@@ -19,16 +22,39 @@
 #include "sequence_stream.hpp"
 #include "json_status.hpp"
 #include "rule_stream.hpp"
+#include "batch_scheduler.hpp"
+#include "prefix_cache.hpp"
+#include "host_kv_cache.hpp"
+#include "disk_kv_cache.hpp"
+#include "speculative.hpp"
+#include "embedder.hpp"
+#include "logprobs.hpp"
+#include "thread_pool.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 
 /*
  * Primary server processor. Controls the overall flow. This processes in slot-order and does not
  * guarantee fairness in processing, to avoid overly shuffling the kv-cache.
  *
  * Provides:
- * The primary job-submit interface
+ * The primary job-submit interface, for prompts as text or as tokens
+ * Tokenization off the caller's thread, text prompts are tokenized on a small pool before they're queued
  * Continuous batching aka High-efficiency Multi-user inference
- * Slot state management (Idle, Processing Prompt, Generating)
+ * Decode-first chunked prefill, so long prompts don't stall generating slots
+ * Prefix sharing across slots, a cached prompt prefix in any slot is copied instead of prefilled
+ * Host memory spilling of evicted sequences, restored when a returning prompt matches
+ * Persistent on-disk prompt snapshots, so long shared prompts survive restarts
+ * Speculative decoding with a draft model or prompt lookup, drafts of every generating slot are verified in one target batch
+ * Slot state management (Idle, Processing Prompt, Generating, Suspended)
+ * Request priorities, a higher priority request preempts the lowest priority slot when all are busy
+ * Parallel sampling, a prompt is prefilled once and forked into a sequence per completion
+ * Per-token logprobs with top-k alternatives, streamed next to the text
+ * Prompt scoring, a shared context is prefilled once and forked into every candidate continuation
+ * Embedding jobs on a pooling context of the same model, interleaved with generation steps
  * Slot Rewinding
+ * Engine metrics, published once per step as a lock-free snapshot
+ * An opt-in span timeline of the worker and tokenizer threads, dumped as Chrome trace JSON
  * Runs the actual llama model forward
  * Job cancellation
  *
@@ -36,28 +62,99 @@
  * It's a server.
  */
 
-template<class... Ts> struct rule_action_type : Ts... { using Ts::operator()...; };
-template<class... Ts> rule_action_type(Ts...) -> rule_action_type<Ts...>;
-
 class Processor {
     llama_model* model;
     llama_context* ctx;
     llama_memory_t mem;
     llama_batch batch{};
-    bool abort_inference = false;
+    std::atomic<bool> abort_inference{false};
 
     std::vector<Slot> slots;
     uint32_t batch_size;
 
-    std::queue<Request> queue_tasks;
+    BatchScheduler scheduler;
+    std::vector<Slot*> prefill_slots;
+    std::vector<uint32_t> prefill_remaining;
+    std::vector<uint32_t> prefill_chunks;
+    std::vector<size_t> prefill_starts;
+
+    // Slots sampling from the current batch, and whether each is still running after its token
+    std::vector<Slot*> post_decode_slots;
+    std::vector<uint8_t> post_decode_running;
+
+    // Slots whose prompt ended this step, snapshotted to disk once every slot has sampled
+    std::vector<Slot*> disk_save_slots;
+
+    PrefixCache prefix_cache;
+    std::vector<size_t> prefix_match_lens;
+    std::vector<size_t> spill_match_lens;
+    HostKVCache host_cache;
+    DiskKVCache disk_cache;
+
+    DraftModel draft_model;
+    std::vector<DraftModel::Job> draft_jobs;
+
+    // A preempted request waiting for a free slot. Owns the request state and a host copy of its KV sequence.
+    struct ParkedSlot {
+        Slot slot;
+        std::vector<llama_token> cache_tokens;
+        std::vector<uint8_t> kv_state;
+
+        ParkedSlot(const llama_model* model, llama_context* ctx) : slot(model, ctx) {
+            slot.rule_stream = new RuleStream();
+        }
+
+        ~ParkedSlot() {
+            delete slot.rule_stream;
+        }
+    };
+
+    // Ordered by priority, FIFO among equal priorities. Parked slots share the lock with the queue.
+    std::deque<Request> queue_tasks;
+    std::list<ParkedSlot> parked_slots;
+
+    // Forks waiting for their parent slot to finish the prompt, by parent slot id
+    std::vector<std::vector<Request>> pending_forks;
+
+    // Request ids of submissions still being tokenized, and those of them cancelled in the meantime
+    std::unordered_set<int> tokenizing_ids;
+    std::unordered_set<int> cancelled_tokenizing_ids;
+
+    // Cancels of requests that may be running, applied by the worker. Slots are only ever touched by the worker,
+    // it publishes the requests in its slots for cancels to check against.
+    std::vector<int> slot_cancels;
+    std::vector<int> running_request_ids;
+
+    // Submitted embedding jobs, moved to the worker's queue every step
+    std::deque<EmbeddingJob> queue_embeddings;
     std::mutex mutex_tasks;
     std::condition_variable cv_tasks;
 
+    Embedder embedder;
+    std::deque<EmbeddingJob> active_embeddings;
+
     std::thread worker_thread;
     std::atomic<bool> should_exit{false};
 
     std::atomic<int> current_job_index = 0;
+    std::atomic<int> next_request_id = 1;
     Tokenizer tokenizer;
+    int32_t n_vocab;
+
+    // Worker-owned, published at the end of every step. Cancels come from other threads.
+    ProcessorMetrics metrics{};
+    MetricsPublisher metrics_publisher;
+    std::atomic<uint64_t> cancellations{0};
+
+    // Instrumentation only, recorded from const paths as well
+    mutable Tracer tracer;
+
+    // Samples and processes the slots of a batch in parallel. Slots only share the KV memory and the metrics there.
+    ThreadPool post_decode_pool;
+    std::mutex mutex_post_decode;
+
+    // Last member, its tasks use everything above
+    ThreadPool tokenize_pool{2};
 
     // nearly eq to common_add_to_batch from lcpp server
     void add_to_batch(Slot& slot, const llama_token token, const bool compute_logits) {
@@ -71,31 +168,287 @@ class Processor {
 
         batch.n_tokens++;
         slot.n_past++;
+        slot.cache_tokens.push_back(token);
     }
 
     static double readable_ggml_time() {
         return static_cast<double>(ggml_time_us()) * 1e-3;
     }
 
-    // Derived from lcpp server originally
-    static llama_pos common_longest_prefix(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
-        llama_pos i;
-        for (i = 0; i < a.size() && i < b.size() && a[i] == b[i]; i++) {}
-        return i;
+    // The worker samples too, so one helper less than the slots or cores that can run at once
+    static unsigned post_decode_threads(const int num_slots) {
+        const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        return std::min(cores, static_cast<unsigned>(std::max(num_slots, 1))) - 1;
+    }
+
+    // Saves a slot's sequence to host memory before everything past keep_tokens is cut from the KV.
+    // Takes mutex_tasks to check the parked requests.
+    void spill_to_host(const Slot& slot, const size_t keep_tokens) {
+        if (!host_cache.enabled() || slot.cache_tokens.size() < keep_tokens + HostKVCache::min_spill_tokens) {
+            return;
+        }
+
+        // Nothing is lost if another slot still holds the whole sequence
+        prefix_cache.match(slot.cache_tokens, spill_match_lens);
+        for (const auto& other : slots) {
+            if (other.slot_id != slot.slot_id && spill_match_lens[other.slot_id] == slot.cache_tokens.size()) {
+                return;
+            }
+        }
+
+        // A preempted sequence left in its slot already has a host copy in the parked request
+        {
+            std::lock_guard lock(mutex_tasks);
+            for (const auto& parked : parked_slots) {
+                if (parked.cache_tokens == slot.cache_tokens) {
+                    return;
+                }
+            }
+        }
+
+        host_cache.store(ctx, slot.slot_id, slot.cache_tokens);
+    }
+
+    // Drops the sequence of the least recently used idle slot, spilling it to host memory first.
+    // Returns false if no idle slot holds any KV.
+    bool evict_idle_sequence() {
+        Slot* victim = nullptr;
+        for (auto& slot : slots) {
+            if (slot.state == Slot::State::IDLE && !slot.cache_tokens.empty() &&
+                (!victim || slot.job_index < victim->job_index)) {
+                victim = &slot;
+            }
+        }
+
+        if (!victim) {
+            return false;
+        }
+
+        spill_to_host(*victim, 0);
+        llama_memory_seq_rm(mem, victim->slot_id, 0, -1);
+        prefix_cache.erase(victim->slot_id);
+        victim->cache_tokens.clear();
+        return true;
+    }
+
+    // Replaces a slot's sequence with the best spilled match for the prompt. Returns the number of reused tokens.
+    size_t restore_from_host(Slot& slot, const std::vector<llama_token>& prompt_tokens, const size_t max_reuse) {
+        spill_to_host(slot, 0);
+        llama_memory_seq_rm(mem, slot.slot_id, 0, -1);
+        prefix_cache.erase(slot.slot_id);
+        slot.cache_tokens.clear();
+
+        // Look up again, the spill above may have replaced or evicted entries
+        const auto [key, length] = host_cache.longest_prefix(prompt_tokens);
+        const size_t reuse = std::min(length, max_reuse);
+        if (reuse == 0 || !host_cache.restore(ctx, slot.slot_id, key)) {
+            llama_memory_seq_rm(mem, slot.slot_id, 0, -1);
+            return 0;
+        }
+
+        llama_memory_seq_rm(mem, slot.slot_id, static_cast<llama_pos>(reuse), -1);
+        const auto* tokens = host_cache.tokens_of(key);
+        slot.cache_tokens.assign(tokens->begin(), tokens->begin() + static_cast<long>(reuse));
+        return reuse;
+    }
+
+    // Replaces a slot's sequence with the best on-disk snapshot for the prompt. Returns the number of reused tokens.
+    size_t restore_from_disk(Slot& slot, const std::vector<llama_token>& prompt_tokens, const size_t max_reuse) {
+        spill_to_host(slot, 0);
+        llama_memory_seq_rm(mem, slot.slot_id, 0, -1);
+        prefix_cache.erase(slot.slot_id);
+        slot.cache_tokens.clear();
+
+        const auto match = disk_cache.longest_prefix(prompt_tokens);
+        std::vector<llama_token> tokens;
+        if (std::min(match.length, max_reuse) == 0 || !disk_cache.restore(ctx, slot.slot_id, match.path, tokens)) {
+            llama_memory_seq_rm(mem, slot.slot_id, 0, -1);
+            return 0;
+        }
+
+        // Measured again on the restored tokens, the match is only a hint
+        const size_t common = std::mismatch(
+            tokens.begin(), tokens.begin() + static_cast<long>(std::min(tokens.size(), prompt_tokens.size())),
+            prompt_tokens.begin()).first - tokens.begin();
+        const size_t reuse = std::min(common, max_reuse);
+        if (reuse == 0) {
+            llama_memory_seq_rm(mem, slot.slot_id, 0, -1);
+            return 0;
+        }
+
+        llama_memory_seq_rm(mem, slot.slot_id, static_cast<llama_pos>(reuse), -1);
+        slot.cache_tokens.assign(tokens.begin(), tokens.begin() + static_cast<long>(reuse));
+        return reuse;
+    }
+
+    // Snapshots a freshly prefilled prompt to disk, unless a snapshot already covers most of it.
+    void save_to_disk(const Slot& slot) {
+        if (!disk_cache.enabled() || slot.cache_tokens.size() < DiskKVCache::min_save_tokens) {
+            return;
+        }
+
+        if (disk_cache.longest_prefix(slot.cache_tokens).length * 2 >= slot.cache_tokens.size()) {
+            return;
+        }
+
+        disk_cache.save(ctx, slot.slot_id, slot.cache_tokens);
+    }
+
+    // The lowest priority busy slot below the given priority. Among equals, the most recent request is preempted.
+    Slot* preemption_victim(const int priority) {
+        Slot* victim = nullptr;
+        for (auto& slot : slots) {
+            if (!slot.is_processing() || slot.priority >= priority) {
+                continue;
+            }
+
+            if (!victim || slot.priority < victim->priority ||
+                (slot.priority == victim->priority && slot.request_id > victim->request_id)) {
+                victim = &slot;
+            }
+        }
+        return victim;
+    }
+
+    // Suspends the request in a slot and parks it with a host copy of its KV, leaving the slot idle.
+    // The copy is taken without mutex_tasks, submits and cancels only wait for the parked slot to be listed.
+    bool preempt_slot(Slot& slot) {
+        std::list<ParkedSlot> parking;
+        ParkedSlot& parked = parking.emplace_back(model, ctx);
+        if (!slot.cache_tokens.empty() && !seq_state_save(ctx, slot.slot_id, parked.kv_state)) {
+            return false;
+        }
+
+        // The slot keeps its KV until the next request decides what to reuse
+        parked.cache_tokens = slot.cache_tokens;
+
+        std::lock_guard lock(mutex_tasks);
+        requeue_forks(slot);
+        slot.suspend();
+        slot.swap_request_state(parked.slot);
+        parked_slots.splice(parked_slots.end(), parking);
+        metrics.preemptions_total++;
+        return true;
+    }
+
+    // Moves a parked request, already taken off the parked list, back into an idle slot and restores its KV.
+    // Runs without mutex_tasks.
+    void resume_parked_slot(ParkedSlot& parked) {
+        // An idle slot may still hold the whole sequence, then no restore is needed
+        prefix_cache.match(parked.cache_tokens, spill_match_lens);
+        Slot* target = nullptr;
+        for (auto& slot : slots) {
+            if (slot.state != Slot::State::IDLE) {
+                continue;
+            }
+
+            if (spill_match_lens[slot.slot_id] == parked.cache_tokens.size()) {
+                target = &slot;
+                break;
+            }
+
+            if (!target || slot.job_index < target->job_index) {
+                target = &slot;
+            }
+        }
+
+        if (spill_match_lens[target->slot_id] == parked.cache_tokens.size()) {
+            spill_to_host(*target, parked.cache_tokens.size());
+            llama_memory_seq_rm(mem, target->slot_id, static_cast<llama_pos>(parked.cache_tokens.size()), -1);
+            prefix_cache.truncate(target->slot_id, parked.cache_tokens.size());
+            target->cache_tokens.resize(parked.cache_tokens.size());
+        } else {
+            spill_to_host(*target, 0);
+            llama_memory_seq_rm(mem, target->slot_id, 0, -1);
+            prefix_cache.erase(target->slot_id);
+            target->cache_tokens.clear();
+
+            if (!parked.cache_tokens.empty() &&
+                !seq_state_restore(ctx, target->slot_id, parked.kv_state.data(), parked.kv_state.size())) {
+                llama_memory_seq_rm(mem, target->slot_id, 0, -1);
+                readback_finish(parked.slot.gen_resources->readback_buffer, make_json_status_string(parked.slot, "Aborted", "None"));
+                return;
+            }
+
+            target->cache_tokens = std::move(parked.cache_tokens);
+            prefix_cache.extend(target->slot_id, target->cache_tokens);
+        }
+
+        target->swap_request_state(parked.slot);
+        target->resume();
+    }
+
+    // Drops a parked request, finishing it as aborted. Requires mutex_tasks.
+    bool drop_parked(const int request_id) {
+        bool found = false;
+        for (auto it = parked_slots.begin(); it != parked_slots.end();) {
+            if (it->slot.request_id != request_id) {
+                ++it;
+                continue;
+            }
+
+            it->slot.generating_end_time = readable_ggml_time();
+            readback_finish(
+                it->slot.gen_resources->readback_buffer,
+                make_json_status_string(it->slot, "Aborted", common_token_to_piece(ctx, it->slot.last_token, true))
+            );
+            it = parked_slots.erase(it);
+            found = true;
+        }
+        return found;
+    }
+
+    // Ends the running requests cancelled since the last step. A request may have been parked in the meantime.
+    void apply_slot_cancels() {
+        std::vector<int> ids;
+        size_t applied = 0;
+        {
+            std::lock_guard lock(mutex_tasks);
+            if (slot_cancels.empty()) {
+                return;
+            }
+
+            ids.swap(slot_cancels);
+            for (const int id : ids) {
+                applied += drop_parked(id);
+            }
+        }
+
+        for (auto& slot : slots) {
+            if (!slot.is_processing() || std::find(ids.begin(), ids.end(), slot.request_id) == ids.end()) {
+                continue;
+            }
+
+            slot.generating_end_time = readable_ggml_time();
+            readback_finish(
+                slot.gen_resources->readback_buffer,
+                make_json_status_string(slot, "Aborted", common_token_to_piece(ctx, slot.last_token, true))
+            );
+            cleanup_slot(slot);
+            applied++;
+        }
+
+        cancellations.fetch_add(applied, std::memory_order_relaxed);
+    }
+
+    // Publishes the requests in the slots, for cancels to tell whether the decode is still worth finishing
+    void publish_running_requests() {
+        std::lock_guard lock(mutex_tasks);
+        running_request_ids.clear();
+        for (const auto& slot : slots) {
+            if (slot.is_processing()) {
+                running_request_ids.push_back(slot.request_id);
+            }
+        }
     }
 
     //Tasks are not processed in fairness.
     //A task assigned to a slot sticks to it until finished to avoid shuffling the cache.
     //This is not a fair processing scheme, however it is more optimal
     void process_tasks() {
+        TraceSpan span(tracer, "process_tasks");
 
-        // Cleanup cancelled slots
-        // TODO: This is not optimal due to the extra for loop
-        for (auto& slot : slots) {
-            if (slot.cancelled) {
-                cleanup_slot(slot);
-            }
-        }
+        apply_slot_cancels();
 
         // Check if an idle slot is present
         bool has_idle_slot = false;
@@ -106,40 +459,112 @@ class Processor {
             }
         }
 
-        if (!has_idle_slot) {
-            return;
+        std::unique_lock lock(mutex_tasks);
+
+        // Parked requests go back in first, unless a more important request is waiting
+        if (has_idle_slot && !parked_slots.empty()) {
+            auto parked = parked_slots.begin();
+            for (auto it = parked_slots.begin(); it != parked_slots.end(); ++it) {
+                if (it->slot.priority > parked->slot.priority) {
+                    parked = it;
+                }
+            }
+
+            if (queue_tasks.empty() || parked->slot.priority >= queue_tasks.front().inference_args.priority) {
+                // Off the list, the request counts as running. A cancel during the restore is applied next step.
+                std::list<ParkedSlot> resuming;
+                resuming.splice(resuming.end(), parked_slots, parked);
+                running_request_ids.push_back(resuming.front().slot.request_id);
+                lock.unlock();
+
+                resume_parked_slot(resuming.front());
+                return;
+            }
         }
 
-        std::unique_lock lock(mutex_tasks);
         if (queue_tasks.empty()) {
             return;
         }
 
+        // All slots are busy, make room if the next request outranks one of them
+        if (!has_idle_slot) {
+            Slot* victim = preemption_victim(queue_tasks.front().inference_args.priority);
+            if (!victim) {
+                return;
+            }
+
+            lock.unlock();
+            if (!preempt_slot(*victim)) {
+                return;
+            }
+
+            // The queue may have been cancelled while the victim was saved
+            lock.lock();
+            if (queue_tasks.empty()) {
+                return;
+            }
+        }
+
         const auto [id,
             prompt_tokens,
-            inference_args] = queue_tasks.front();
+            inference_args,
+            fork_resources,
+            fork_prompt_tokens] = queue_tasks.front();
 
-        queue_tasks.pop();
+        queue_tasks.pop_front();
         lock.unlock();
 
         // Prompt + max tokens to gen is longer than the entire ctx length.
         const auto total_tokens = prompt_tokens.size() + inference_args.max_tokens_to_gen;
         if (total_tokens > llama_n_ctx(ctx) || total_tokens > inference_args.max_slot_n_ctx) {
             readback_finish(inference_args.gen_resources->readback_buffer, make_empty_json_status_string("CtxExceeded", "None"));
+            for (GenerationResources* fork : fork_resources) {
+                readback_finish(fork->readback_buffer, make_empty_json_status_string("CtxExceeded", "None"));
+            }
             return;
         }
 
-        //Check for the best slot. The best slot is the one with the longest prefix.
+        // A prompt without tokens has nothing to decode. Caller token ids outside the vocab would fail the whole batch.
+        const auto out_of_vocab = [this](const llama_token token) { return token < 0 || token >= n_vocab; };
+        if (prompt_tokens.empty() || std::any_of(prompt_tokens.begin(), prompt_tokens.end(), out_of_vocab)) {
+            readback_finish(inference_args.gen_resources->readback_buffer, make_empty_json_status_string("TokenEncode", "None"));
+            for (GenerationResources* fork : fork_resources) {
+                readback_finish(fork->readback_buffer, make_empty_json_status_string("TokenEncode", "None"));
+            }
+            return;
+        }
+
+        // Look up the prompt against the KV of every slot. The last prompt token is never reused,
+        // it has to be decoded to get the logits for the first generated token.
+        // Scoring needs the logits of every token before a scored one.
+        prefix_cache.match(prompt_tokens, prefix_match_lens);
+        size_t max_reuse = prompt_tokens.size() - 1;
+        if (inference_args.score_from > 0) {
+            max_reuse = std::min(max_reuse, static_cast<size_t>(inference_args.score_from - 1));
+        }
+
+        //Check for the best slot. The best slot is the idle slot with the longest prefix of its own.
         Slot* best_slot = nullptr;
-        llama_pos longest_prefix = 0;
+        size_t longest_prefix = 0;
         Slot* oldest_idle_slot = nullptr;
+
+        //The best source is any slot, busy or idle, holding the longest prefix.
+        const Slot* source_slot = nullptr;
+        size_t longest_shared_prefix = 0;
+
         for (auto& slot : slots) {
+            const size_t prefix_len = std::min(prefix_match_lens[slot.slot_id], max_reuse);
+
+            if (prefix_len > longest_shared_prefix) {
+                longest_shared_prefix = prefix_len;
+                source_slot = &slot;
+            }
+
             if (slot.state == Slot::State::IDLE) {
                 if (!oldest_idle_slot || slot.job_index < oldest_idle_slot->job_index) {
                     oldest_idle_slot = &slot;
                 }
 
-                const llama_pos prefix_len = common_longest_prefix(prompt_tokens, slot.prompt_tokens);
                 const bool is_better = prefix_len > longest_prefix ||
                                       (prefix_len == longest_prefix &&
                                        (!best_slot || slot.job_index < best_slot->job_index));
@@ -159,58 +584,303 @@ class Processor {
         if (!best_slot)
             return;
 
-        if (longest_prefix > 0) {
-            // Reuse prefix, cut the KV to the prefix size and adjust to gen or prompt appropriately.
-            llama_memory_seq_rm(mem, best_slot->slot_id, longest_prefix, -1);
+        // Spilled sequences in host memory and snapshots on disk are the last tiers, only worth a restore if they beat every slot.
+        size_t host_prefix = 0;
+        if (host_cache.enabled()) {
+            host_prefix = std::min(host_cache.longest_prefix(prompt_tokens).length, max_reuse);
+        }
 
-            best_slot->prompt_tokens_processed = longest_prefix;
-            best_slot->n_past = longest_prefix;
-            best_slot->last_token = prompt_tokens[longest_prefix - 1];
+        size_t disk_prefix = 0;
+        if (disk_cache.enabled()) {
+            disk_prefix = std::min(disk_cache.longest_prefix(prompt_tokens).length, max_reuse);
+        }
 
-            best_slot->state =
-                longest_prefix == prompt_tokens.size() ?
-                Slot::State::GENERATING :
-                Slot::State::PROMPT;
-        } else {
+        if (disk_prefix > std::max({longest_prefix, longest_shared_prefix, host_prefix})) {
+            best_slot = oldest_idle_slot;
+            longest_prefix = restore_from_disk(*best_slot, prompt_tokens, max_reuse);
+        } else if (host_prefix > std::max(longest_prefix, longest_shared_prefix)) {
+            best_slot = oldest_idle_slot;
+            longest_prefix = restore_from_host(*best_slot, prompt_tokens, max_reuse);
+        } else if (longest_shared_prefix > longest_prefix) {
+            // Another slot holds a longer prefix. Share its KV cells with the oldest idle slot instead of prefilling.
+            best_slot = oldest_idle_slot;
+            longest_prefix = longest_shared_prefix;
+
+            spill_to_host(*best_slot, 0);
             llama_memory_seq_rm(mem, best_slot->slot_id, 0, -1);
-            best_slot->prompt_tokens_processed = 0;
-            best_slot->state = Slot::State::PROMPT;
-            best_slot->prompt_tokens.clear();
+            llama_memory_seq_cp(mem, source_slot->slot_id, best_slot->slot_id, 0, static_cast<llama_pos>(longest_prefix));
+
+            prefix_cache.erase(best_slot->slot_id);
+            best_slot->cache_tokens.assign(
+                source_slot->cache_tokens.begin(),
+                source_slot->cache_tokens.begin() + static_cast<long>(longest_prefix));
+        } else {
+            // Reuse own prefix, cut the KV to the prefix size.
+            spill_to_host(*best_slot, longest_prefix);
+            llama_memory_seq_rm(mem, best_slot->slot_id, static_cast<llama_pos>(longest_prefix), -1);
+
+            prefix_cache.truncate(best_slot->slot_id, longest_prefix);
+            best_slot->cache_tokens.resize(longest_prefix);
         }
+        prefix_cache.extend(best_slot->slot_id, best_slot->cache_tokens);
 
-        best_slot->request_id = id;
-        best_slot->prompt_tokens = prompt_tokens;
+        best_slot->prompt_tokens_processed = longest_prefix;
+        best_slot->n_past = static_cast<int>(longest_prefix);
+        best_slot->state = Slot::State::PROMPT;
+        if (longest_prefix > 0) {
+            best_slot->last_token = prompt_tokens[longest_prefix - 1];
+        }
 
-        if (best_slot->gen_resources) {
-            generation_resources_release(best_slot->gen_resources);
+        bind_request(*best_slot, id, prompt_tokens, inference_args);
+        best_slot->prefix_reuse_tokens = longest_prefix;
+
+        metrics.requests_started_total++;
+        metrics.prefix_reuse_tokens_total += static_cast<double>(longest_prefix);
+        metrics.prefix_reuse_tokens.observe(static_cast<double>(longest_prefix));
+
+        // Forks wait for this slot's prompt and take over its KV once it's decoded
+        if (!fork_resources.empty()) {
+            std::vector<Request> forks;
+            forks.reserve(fork_resources.size());
+            for (size_t i = 0; i < fork_resources.size(); i++) {
+                InferenceArgs fork_args = inference_args;
+                fork_args.gen_resources = fork_resources[i];
+                forks.push_back({
+                    id + 1 + static_cast<int>(i),
+                    fork_prompt_tokens.empty() ? prompt_tokens : fork_prompt_tokens[i],
+                    std::move(fork_args),
+                    {},
+                    {}
+                });
+            }
+
+            lock.lock();
+            pending_forks[best_slot->slot_id] = std::move(forks);
         }
-        best_slot->gen_resources = generation_resources_ref_acquire(inference_args.gen_resources);
+    }
 
-        best_slot->slot_start_time = readable_ggml_time();
+    // Attaches a request to a slot. The slot's KV position and state are set up by the caller.
+    void bind_request(Slot& slot, const int id, const std::vector<llama_token>& prompt_tokens, const InferenceArgs& inference_args) {
+        slot.request_id = id;
+        slot.priority = inference_args.priority;
+        slot.prompt_tokens = prompt_tokens;
 
-        best_slot->sequence_stream->bind_sequences(inference_args.stopping_strings, inference_args.rewind_strings);
-        best_slot->rewind_snapshot = Slot::SlotSnapshot::snapshot_slot(*best_slot, mem, false);
+        if (slot.gen_resources) {
+            generation_resources_release(slot.gen_resources);
+        }
+        slot.gen_resources = generation_resources_ref_acquire(inference_args.gen_resources);
 
-        best_slot->sampler = best_slot->gen_resources->sampler;
-        best_slot->n_ctx_max = inference_args.max_slot_n_ctx;
+        slot.slot_start_time = readable_ggml_time();
+        slot.submit_time = inference_args.submit_time;
+        slot.queued_time = inference_args.queued_time;
+
+        slot.sequence_stream->bind_sequences(inference_args.stopping_strings, inference_args.rewind_strings);
+        slot.rewind_snapshot = Slot::SlotSnapshot::snapshot_slot(slot);
+
+        slot.sampler = slot.gen_resources->sampler;
+        slot.n_ctx_max = inference_args.max_slot_n_ctx;
+        slot.ngram_drafter.configure(inference_args.ngram_size, inference_args.ngram_draft_tokens);
+
+        slot.score_from = inference_args.score_from;
+        if (inference_args.logprobs) {
+            slot.logprobs_top_k = std::clamp(inference_args.top_logprobs, 0, n_vocab);
+            readback_enable_logprobs(slot.gen_resources->readback_buffer, slot.logprobs_top_k);
+        }
 
         if (inference_args.min_tokens_to_gen > 0) {
-            RuleEngine::rule_min_tokens(*best_slot->rule_stream, inference_args.min_tokens_to_gen, model, ctx, *best_slot);
+            RuleEngine::rule_min_tokens(*slot.rule_stream, inference_args.min_tokens_to_gen, model, ctx, slot);
         }
-        
+
         if (inference_args.max_tokens_to_gen > 0 && inference_args.max_tokens_to_gen >= inference_args.min_tokens_to_gen) {
-            RuleEngine::rule_max_tokens(*best_slot->rule_stream, inference_args.max_tokens_to_gen, model, ctx, *best_slot);
+            RuleEngine::rule_max_tokens(*slot.rule_stream, inference_args.max_tokens_to_gen, model, ctx, slot);
+        }
+    }
+
+    // Inserts a request behind every queued request of higher priority, and behind equals unless ahead_of_equals.
+    // Requires mutex_tasks.
+    void enqueue(Request request, const bool ahead_of_equals) {
+        auto it = queue_tasks.begin();
+        while (it != queue_tasks.end() &&
+               (it->inference_args.priority > request.inference_args.priority ||
+                (!ahead_of_equals && it->inference_args.priority == request.inference_args.priority))) {
+            ++it;
+        }
+        queue_tasks.insert(it, std::move(request));
+    }
+
+    // Queues a request tokenized on the pool. Cancels that came in while it was tokenized are applied once it's queued.
+    void enqueue_tokenized(Request request) {
+        request.inference_args.queued_time = readable_ggml_time();
+        std::vector<int> cancelled;
+        {
+            std::lock_guard lock(mutex_tasks);
+            for (int id = request.id; id <= request.id + static_cast<int>(request.fork_resources.size()); id++) {
+                tokenizing_ids.erase(id);
+                if (cancelled_tokenizing_ids.erase(id) > 0) {
+                    cancelled.push_back(id);
+                }
+            }
+
+            enqueue(std::move(request), false);
+        }
+
+        cv_tasks.notify_one();
+        for (const int id : cancelled) {
+            cancel_work(id);
+        }
+    }
+
+    // Marks the ids of a submission as tokenizing. Requires mutex_tasks.
+    void begin_tokenizing(const int request_id, const size_t num_forks) {
+        for (int id = request_id; id <= request_id + static_cast<int>(num_forks); id++) {
+            tokenizing_ids.insert(id);
+        }
+    }
+
+    // Copies a freshly prefilled prompt into idle slots for its forks. They sample from the parent's logits in this batch.
+    void fork_slot(const Slot& parent) {
+        std::vector<Request> forks;
+        {
+            std::lock_guard lock(mutex_tasks);
+            forks.swap(pending_forks[parent.slot_id]);
+        }
+
+        size_t n_forked = 0;
+        for (; n_forked < forks.size(); n_forked++) {
+            Slot* child = nullptr;
+            for (auto& slot : slots) {
+                if (slot.state == Slot::State::IDLE && (!child || slot.job_index < child->job_index)) {
+                    child = &slot;
+                }
+            }
+
+            if (!child) {
+                break;
+            }
+
+            spill_to_host(*child, 0);
+            llama_memory_seq_rm(mem, child->slot_id, 0, -1);
+            llama_memory_seq_cp(mem, parent.slot_id, child->slot_id, 0, -1);
+            prefix_cache.erase(child->slot_id);
+            child->cache_tokens = parent.cache_tokens;
+            prefix_cache.extend(child->slot_id, child->cache_tokens);
+
+            child->prompt_tokens_processed = parent.prompt_tokens_processed;
+            child->n_past = parent.n_past;
+            child->last_token = parent.last_token;
+            bind_request(*child, forks[n_forked].id, forks[n_forked].prompt_tokens, forks[n_forked].inference_args);
+
+            child->slot_start_time = parent.slot_start_time;
+            child->prefix_reuse_tokens = parent.prompt_tokens_processed;
+
+            // Scoring forks go on with their own tokens, the first of them is predicted by the parent's last row
+            if (child->score_from >= 0) {
+                child->i_batch = parent.i_batch;
+                score_prompt_rows(*child, child->prompt_tokens_processed - 1);
+                child->i_batch = -1;
+
+                child->state = child->prompt_tokens_processed < child->prompt_tokens.size() ?
+                               Slot::State::PROMPT : Slot::State::GENERATING;
+                continue;
+            }
+
+            child->state = Slot::State::GENERATING;
+            child->i_batch = parent.i_batch;
+            child->prompt_end_time = readable_ggml_time();
+        }
+
+        // Forks without a free slot queue up again, prefix sharing still spares them the prefill
+        if (n_forked < forks.size()) {
+            std::lock_guard lock(mutex_tasks);
+            for (size_t i = forks.size(); i > n_forked; i--) {
+                enqueue(std::move(forks[i - 1]), true);
+            }
+        }
+    }
+
+    // Puts the forks of a slot that ended before its prompt was decoded back in the queue. Requires mutex_tasks.
+    void requeue_forks(const Slot& parent) {
+        auto& forks = pending_forks[parent.slot_id];
+        for (auto it = forks.rbegin(); it != forks.rend(); ++it) {
+            enqueue(std::move(*it), true);
+        }
+        forks.clear();
+    }
+
+    // Records the logprobs of a token sampled from one of the slot's logits rows. Must run before the next decode.
+    void collect_logprobs(Slot& slot, const llama_token token, const float* logits) {
+        if (slot.logprobs_top_k < 0) {
+            return;
         }
+
+        slot.logprob_collector.collect(logits, n_vocab, token, slot.logprobs_top_k, slot.pending_logprobs);
+    }
+
+    // Scores the prompt tokens decoded since prompt index begin. Each row holds the logits for the token after it.
+    void score_prompt_rows(Slot& slot, const size_t begin) {
+        if (slot.score_from < 0) {
+            return;
+        }
+
+        const size_t end = slot.prompt_tokens_processed;
+        for (size_t i = begin; i < end; i++) {
+            const size_t target = i + 1;
+            if (target < static_cast<size_t>(slot.score_from) || target >= slot.prompt_tokens.size()) {
+                continue;
+            }
+
+            const int32_t row = slot.i_batch - static_cast<int32_t>(end - 1 - i);
+            const float* logits = llama_get_logits_ith(ctx, row);
+            slot.logprob_collector.collect(
+                logits, n_vocab, slot.prompt_tokens[target], slot.logprobs_top_k, slot.pending_logprobs);
+        }
+    }
+
+    [[nodiscard]] static bool needs_score_logits(const Slot& slot, const size_t prompt_index) {
+        const size_t target = prompt_index + 1;
+        return slot.score_from >= 0 && target >= static_cast<size_t>(slot.score_from) && target < slot.prompt_tokens.size();
+    }
+
+    // A scoring request ends with its prompt. Its result is the logprobs it collected.
+    void finish_scoring(Slot& slot) {
+        flush_logprobs(slot);
+
+        slot.prompt_end_time = readable_ggml_time();
+        slot.generating_end_time = slot.prompt_end_time;
+        readback_finish(slot.gen_resources->readback_buffer, make_json_status_string(slot, "Scored", "None"));
+        cleanup_slot(slot);
+    }
+
+    static void flush_logprobs(Slot& slot) {
+        if (slot.pending_logprobs.empty()) {
+            return;
+        }
+
+        readback_write_logprobs(slot.gen_resources->readback_buffer, slot.pending_logprobs);
+        slot.pending_logprobs.clear();
+    }
+
+    // Appends a piece of generated text and its token to the slot's readback buffer.
+    void write_readback(const Slot& slot, const std::string_view& text, const llama_token token) const {
+        TraceSpan span(tracer, "readback_write", slot.slot_id, slot.request_id);
+        readback_write_to_buffer(slot.gen_resources->readback_buffer, text, token);
     }
 
     // Processes the next sequence token. Finalizes the request if gen is finished.
-    bool process_token(Slot& slot, const llama_token token) const {
+    bool process_token(Slot& slot, const llama_token token) {
+        TraceSpan span(tracer, "process_token", slot.slot_id, slot.request_id);
+        const double now = readable_ggml_time();
+        if (slot.first_token_time == 0.0) {
+            slot.first_token_time = now;
+        } else {
+            slot.token_gaps.push_back(static_cast<float>(now - slot.last_token_time));
+        }
+        slot.last_token_time = now;
 
         // Decode special sets parse_special for decoding ONLY
         auto piece = slot.detokenizer->process_token(token, true);
         const bool is_eos = tokenizer.is_end_of_generation_token(token);
         bool is_complete = is_eos;
-        bool yield_final = false;
 
         slot.tokens_generated++;
 
@@ -222,14 +892,15 @@ class Processor {
             stop_token = common_token_to_piece(ctx, token, true);
         }
 
-        if (llama_memory_seq_pos_max(mem, slot.slot_id) >= slot.n_ctx_max || llama_memory_seq_pos_max(mem, slot.slot_id) >= llama_n_ctx(ctx)) {
+        // Same as the KV max position reaching the limit, minus any unverified draft tokens
+        if (static_cast<uint32_t>(slot.n_past) > slot.n_ctx_max || static_cast<uint32_t>(slot.n_past) > llama_n_ctx(ctx)) {
             is_complete = true;
             finish_reason = "CtxExceeded";
             stop_token = common_token_to_piece(ctx, token, true);
         }
 
         const auto seq_res = slot.sequence_stream->append(piece);
-        const auto triggered_actions = slot.rule_stream->apply_engine(token, seq_res, model, ctx, slot);
+        const auto& triggered_actions = slot.rule_stream->apply_engine(token, seq_res, model, ctx, slot);
         for (const auto& actionWrapper : triggered_actions) {
             std::visit(rule_action_type {
 
@@ -247,23 +918,32 @@ class Processor {
 
         switch (seq_res.sequence_status) {
             case SequenceStream::SequenceStatus::ACCEPT:
+                // Tokens can't be rewound past an accept, their logprobs are final
+                flush_logprobs(slot);
                 if (!seq_res.current_sequence.empty() && !is_eos) {
                     slot.generated_text += seq_res.current_sequence;
-                    readback_write_to_buffer(slot.gen_resources->readback_buffer, seq_res.current_sequence, token);
+                    write_readback(slot, seq_res.current_sequence, token);
                 }
 
                 slot.presampler.clear_rewind_bans(model);
-                slot.rewind_snapshot = Slot::SlotSnapshot::snapshot_slot(slot, mem, false);
+                slot.rewind_snapshot = Slot::SlotSnapshot::snapshot_slot(slot);
                 break;
             case SequenceStream::SequenceStatus::REWIND: {
+                //Ban every token in the buffer. Before the rewind, which invalidates seq_res.
+                const auto tokens = tokenizer.tokenize(seq_res.current_sequence, false, false);
+                slot.presampler.add_rewind_bans(model, tokens);
+
                 //Restore the slot to whatever the last accepted snapshot was.
                 //Then delete the part of the KV we're rewinding
                 const int32_t prev_kv_pos = slot.rewind_snapshot.rewind_slot(slot);
-                llama_memory_seq_rm(mem, slot.slot_id, prev_kv_pos, -1);
-
-                //Ban every token in the buffer.
-                const auto tokens = tokenizer.tokenize(seq_res.current_sequence, false, false);
-                slot.presampler.add_rewind_bans(model, tokens);
+                {
+                    std::lock_guard lock(mutex_post_decode);
+                    llama_memory_seq_rm(mem, slot.slot_id, prev_kv_pos, -1);
+                    metrics.rewinds_total++;
+                }
+                slot.cache_tokens.resize(prev_kv_pos);
+                slot.rewinds++;
+                slot.pending_logprobs.clear();
 
                 return true;
             }
@@ -274,9 +954,10 @@ class Processor {
                 piece = seq_res.unmatched_sequence;
 
                 // Write the unmatched sequence to buffer
+                flush_logprobs(slot);
                 if (!seq_res.unmatched_sequence.empty()) {
                     slot.generated_text += seq_res.unmatched_sequence;
-                    readback_write_to_buffer(slot.gen_resources->readback_buffer, seq_res.unmatched_sequence, token);
+                    write_readback(slot, seq_res.unmatched_sequence, token);
                 }
 
                 break;
@@ -294,56 +975,205 @@ class Processor {
 
             if (!remaining.empty() && !is_eos) {
                 slot.generated_text += remaining;
-                readback_write_to_buffer(slot.gen_resources->readback_buffer, remaining, token);
+                write_readback(slot, remaining, token);
             }
         }
 
+        // Tokens without text of their own (EOS, held back pieces) are attached past the last entry
+        flush_logprobs(slot);
+
         slot.generating_end_time = readable_ggml_time();
         const auto status = make_json_status_string(slot, finish_reason, stop_token);
         readback_finish(slot.gen_resources->readback_buffer, status);
         return false;
     }
 
+    // Drafts tokens for every generating slot, sized so all drafts fit the step budget and each slot's context.
+    void plan_drafts() {
+        draft_jobs.clear();
+
+        int n_generating = 0;
+        bool has_prompts = false;
+        for (const auto& slot : slots) {
+            n_generating += slot.is_generating();
+            has_prompts |= slot.is_processing_prompt();
+        }
+
+        if (n_generating == 0) {
+            return;
+        }
+
+        // Drafts never take the prefill floor from waiting prompts
+        uint32_t budget = scheduler.step_budget(batch_size);
+        if (has_prompts) {
+            budget -= std::min(budget, BatchScheduler::prefill_floor(budget));
+        }
+
+        const int n_draft = static_cast<int>(budget) / n_generating - 1;
+        if (n_draft <= 0) {
+            return;
+        }
+
+        const int64_t n_ctx = llama_n_ctx(ctx);
+        for (auto& slot : slots) {
+            if (!slot.is_generating()) {
+                continue;
+            }
+
+            // The real token goes first, drafts may only use what is left of the context
+            const int64_t limit = std::min<int64_t>(slot.n_ctx_max, n_ctx);
+            const int room = static_cast<int>(std::min<int64_t>(n_draft, limit - slot.n_past - 1));
+            if (room <= 0) {
+                continue;
+            }
+
+            // Prompt lookup is nearly free, the draft model covers the steps it has nothing for
+            if (slot.ngram_drafter.enabled() &&
+                slot.ngram_drafter.draft(slot.cache_tokens, slot.last_token, room, slot.draft)) {
+                continue;
+            }
+
+            if (draft_model.enabled()) {
+                draft_jobs.push_back({
+                    slot.slot_id, &slot.cache_tokens, slot.last_token,
+                    std::min(room, draft_model.max_draft()), &slot.draft
+                });
+            }
+        }
+
+        if (!draft_jobs.empty()) {
+            draft_model.draft(draft_jobs);
+        }
+    }
+
+    // Samples the target at each drafted position in order, committing tokens until a sample disagrees with the draft.
+    // Sampling is unchanged from regular decoding, so the output distribution is the same.
+    // Returns false when the request finished, the caller cleans the slot up.
+    bool verify_draft(Slot& slot) {
+        const int n_draft = static_cast<int>(slot.draft.size());
+        const int first_pos = slot.n_past - n_draft - 1;
+        const int first_i_batch = slot.i_batch;
+        const int rewinds = slot.rewinds;
+        slot.draft_tokens += n_draft;
+
+        for (int i = 0; i <= n_draft; i++) {
+            // Commit the KV up to the token whose logits are sampled
+            slot.i_batch = first_i_batch + i;
+            slot.n_past = first_pos + i + 1;
+            slot.cache_tokens.resize(slot.n_past);
+
+            const float* logits = slot.logits_rows[i];
+            const llama_token token = sample(slot, logits);
+            slot.last_token = token;
+            collect_logprobs(slot, token, logits);
+
+            if (!process_token(slot, token)) {
+                std::lock_guard lock(mutex_post_decode);
+                llama_memory_seq_rm(mem, slot.slot_id, slot.n_past, -1);
+                return false;
+            }
+
+            // A rewind already cut the KV back to its snapshot
+            if (slot.rewinds != rewinds || i == n_draft || token != slot.draft[i]) {
+                break;
+            }
+            slot.draft_accepted++;
+        }
+
+        // Drop the KV of rejected drafts
+        {
+            std::lock_guard lock(mutex_post_decode);
+            llama_memory_seq_rm(mem, slot.slot_id, slot.n_past, -1);
+        }
+        slot.draft.clear();
+        slot.i_batch = -1;
+        return true;
+    }
+
+    // Samples the slot's token from the batch and processes it. Runs concurrently with the other slots of the batch,
+    // anything shared goes through mutex_post_decode. Returns false when the request finished.
+    bool post_decode(Slot& slot) {
+        if (!slot.draft.empty()) {
+            return verify_draft(slot);
+        }
+
+        const float* logits = slot.logits_rows.front();
+        const llama_token token = sample(slot, logits);
+        slot.last_token = token;
+        collect_logprobs(slot, token, logits);
+        slot.i_batch = -1;
+
+        //Status reported by process_token
+        return process_token(slot, token);
+    }
+
     void update_batch() {
+        TraceSpan span(tracer, "update_batch");
         batch.n_tokens = 0;
+
+        plan_drafts();
+
+        // Decode tokens are reserved first so a long prompt can never starve the generating slots.
         for (auto& slot : slots) {
-            if (slot.is_processing_prompt() && slot.prompt_tokens_processed < slot.prompt_tokens.size()) {
-                while (batch.n_tokens < batch_size) {
-
-                    const llama_token token = slot.prompt_tokens[slot.prompt_tokens_processed];
-                    const bool is_last_prompt_token = (slot.prompt_tokens_processed == slot.prompt_tokens.size() - 1);
-                    slot.i_batch = batch.n_tokens;
-                    slot.prompt_tokens_processed++;
-                    slot.last_token = token;
-                    add_to_batch(slot, token, is_last_prompt_token);
-
-                    if (slot.prompt_tokens_processed >= slot.prompt_tokens.size()) {
-                        slot.state = Slot::State::GENERATING;
-                        slot.rewind_snapshot = Slot::SlotSnapshot::snapshot_slot(slot, mem, true);
-                        break;
-                    }
-                }
-            } else {
-                if (slot.is_generating() && batch.n_tokens < batch_size) {
-                    add_to_batch(slot, slot.last_token, true);
+            if (slot.is_generating() && batch.n_tokens < batch_size) {
+                add_to_batch(slot, slot.last_token, true);
+
+                // Drafted tokens follow the real one. Every position gets logits for verification.
+                const int32_t i_batch = slot.i_batch;
+                for (const llama_token token : slot.draft) {
+                    add_to_batch(slot, token, true);
                 }
+                slot.i_batch = i_batch;
             }
         }
-    }
 
-    [[nodiscard]] llama_token sample(const Slot& slot) const {
-        if (slot.presampler.sampler) {
-            const auto pre_n = llama_sampler_chain_n(slot.presampler.sampler);
-            llama_sampler_chain_add(slot.presampler.sampler, slot.sampler);
-            const auto token = llama_sampler_sample(slot.presampler.sampler, ctx, slot.i_batch);
+        prefill_slots.clear();
+        prefill_remaining.clear();
+        prefill_starts.clear();
+        for (auto& slot : slots) {
+            if (slot.is_processing_prompt() && slot.prompt_tokens_processed < slot.prompt_tokens.size()) {
+                prefill_slots.push_back(&slot);
+                prefill_remaining.push_back(static_cast<uint32_t>(slot.prompt_tokens.size() - slot.prompt_tokens_processed));
+            }
+        }
+
+        if (prefill_slots.empty()) {
+            return;
+        }
+
+        const uint32_t step_budget = scheduler.step_budget(batch_size);
+        const uint32_t budget = BatchScheduler::prefill_budget(step_budget, batch_size, batch.n_tokens);
+        scheduler.plan_prefill(prefill_remaining, budget, prefill_chunks);
 
-            while (llama_sampler_chain_n(slot.presampler.sampler) > pre_n) {
-                llama_sampler_chain_remove(slot.presampler.sampler, pre_n);
+        for (size_t i = 0; i < prefill_slots.size(); i++) {
+            Slot& slot = *prefill_slots[i];
+            prefill_starts.push_back(slot.prompt_tokens_processed);
+
+            for (uint32_t n = 0; n < prefill_chunks[i]; n++) {
+                const llama_token token = slot.prompt_tokens[slot.prompt_tokens_processed];
+                const bool is_last_prompt_token = (slot.prompt_tokens_processed == slot.prompt_tokens.size() - 1);
+                const bool needs_logits = is_last_prompt_token || needs_score_logits(slot, slot.prompt_tokens_processed);
+                slot.prompt_tokens_processed++;
+                slot.last_token = token;
+                add_to_batch(slot, token, needs_logits);
+
+                if (slot.prompt_tokens_processed >= slot.prompt_tokens.size()) {
+                    slot.state = Slot::State::GENERATING;
+                    slot.rewind_snapshot = Slot::SlotSnapshot::snapshot_slot(slot);
+                    break;
+                }
             }
-            return token;
+        }
+    }
+
+    // Samples from a logits row fetched before the fan-out, the context is never touched here
+    [[nodiscard]] llama_token sample(Slot& slot, const float* logits) {
+        TraceSpan span(tracer, "sample", slot.slot_id, slot.request_id);
+        if (slot.fused_sampler.recognize(slot.sampler)) {
+            return slot.fused_sampler.sample(slot.sampler, logits, n_vocab, slot.presampler.active_bans());
         }
 
-        return llama_sampler_sample(slot.sampler, ctx, slot.i_batch);
+        return slot.presampler.sample(slot.sampler, logits, n_vocab, slot.candidates);
     }
 
     void update_gen_slots() {
@@ -351,7 +1181,11 @@ class Processor {
             return;
         }
 
+        publish_running_requests();
+
+        const int64_t decode_start = ggml_time_us();
         while (true) {
+            TraceSpan decode_span(tracer, "llama_decode");
             const int32_t decode_result = llama_decode(ctx, batch);
 
             //Decode aborted, this is not a failure, we can redo the decode.
@@ -360,12 +1194,23 @@ class Processor {
                 continue;
             }
 
+            // No room in the KV for the batch. Idle slots keep their sequences only for reuse, free one and retry.
+            if (decode_result == 1 && evict_idle_sequence()) {
+                continue;
+            }
+
             //TODO:: @Z We can potentially avoid a hard abort depending on the status code. Investigate if possibel.
             if (decode_result != 0) {
+                metrics.decode_errors_total++;
                 for (auto& slot : slots) {
                     if (slot.i_batch >= 0 && slot.i_batch < batch.n_tokens) {
                         slot.generating_end_time = readable_ggml_time();
                         readback_finish(slot.gen_resources->readback_buffer, make_json_status_string(slot, "BatchDecode", ""));
+
+                        // The KV of a failed batch can't be trusted for reuse
+                        llama_memory_seq_rm(mem, slot.slot_id, 0, -1);
+                        prefix_cache.erase(slot.slot_id);
+                        slot.cache_tokens.clear();
                         cleanup_slot(slot);
                     }
                 }
@@ -374,28 +1219,72 @@ class Processor {
             break;
         }
 
+        record_decode_step(static_cast<double>(ggml_time_us() - decode_start) * 1e-6);
+
+        // Newly ingested prompt chunks are now in the KV and can be shared with other slots
+        for (const Slot* slot : prefill_slots) {
+            prefix_cache.extend(slot->slot_id, slot->cache_tokens);
+        }
+
+        // Scoring requests read the logits of every prompt token, before the next batch overwrites them
+        for (size_t i = 0; i < prefill_slots.size(); i++) {
+            if (prefill_slots[i]->prompt_tokens_processed > prefill_starts[i]) {
+                score_prompt_rows(*prefill_slots[i], prefill_starts[i]);
+            }
+        }
+
+        // Prompts decoded in this batch hand their KV and logits to their forks before anything is sampled
+        for (const Slot* slot : prefill_slots) {
+            if (slot->is_generating()) {
+                fork_slot(*slot);
+            }
+        }
+
+        for (auto& slot : slots) {
+            if (slot.score_from >= 0 && slot.is_generating()) {
+                finish_scoring(slot);
+            }
+        }
+
+        post_decode_slots.clear();
+        disk_save_slots.clear();
         for (auto& slot : slots) {
             // Do nothing if slot isn't part of the current batch
-            if (slot.i_batch < 0 || slot.i_batch >= batch.n_tokens) {
+            if (slot.i_batch < 0 || slot.i_batch >= batch.n_tokens || !slot.is_generating()) {
                 continue;
             }
 
-            if (slot.is_generating()) {
-                // Triggered right when generation starts = prompt process ended
-                if (slot.prompt_end_time == 0.0) {
-                    slot.prompt_end_time = readable_ggml_time();
-                }
+            // Triggered right when generation starts = prompt process ended
+            if (slot.prompt_end_time == 0.0) {
+                slot.prompt_end_time = readable_ggml_time();
+                disk_save_slots.push_back(&slot);
+            }
 
-                const llama_token token = sample(slot);
-                slot.last_token = token;
-                slot.i_batch = -1;
+            // Fetching a row can reorder the context's outputs, so only the worker does it
+            slot.logits_rows.clear();
+            for (size_t i = 0; i <= slot.draft.size(); i++) {
+                slot.logits_rows.push_back(llama_get_logits_ith(ctx, slot.i_batch + static_cast<int32_t>(i)));
+            }
 
-                if (const bool continue_gen = process_token(slot, token); !continue_gen) {
-                    cleanup_slot(slot);
-                    //Status reported by process_token
-                }
+            post_decode_slots.push_back(&slot);
+        }
+
+        post_decode_running.assign(post_decode_slots.size(), 1);
+        post_decode_pool.parallel_for(post_decode_slots.size(), [this](const size_t i) {
+            post_decode_running[i] = post_decode(*post_decode_slots[i]);
+        });
+
+        // Finished jobs touch the queue and the prefix cache, so they end in slot order afterwards
+        for (size_t i = 0; i < post_decode_slots.size(); i++) {
+            if (!post_decode_running[i]) {
+                cleanup_slot(*post_decode_slots[i]);
             }
         }
+
+        // Serializing a sequence takes a while, it must not hold up sampling. A finished job keeps its KV.
+        for (const Slot* slot : disk_save_slots) {
+            save_to_disk(*slot);
+        }
     }
 
     void update_slots() {
@@ -405,18 +1294,107 @@ class Processor {
         update_gen_slots();
     }
 
+    void record_decode_step(const double seconds) {
+        size_t prefill_tokens = 0;
+        for (size_t i = 0; i < prefill_slots.size(); i++) {
+            prefill_tokens += prefill_slots[i]->prompt_tokens_processed - prefill_starts[i];
+        }
+        const auto decode_tokens = static_cast<double>(batch.n_tokens - prefill_tokens);
+
+        metrics.decode_steps_total++;
+        metrics.prefill_tokens_total += static_cast<double>(prefill_tokens);
+        metrics.decode_tokens_total += decode_tokens;
+
+        metrics.batch_fill_ratio.observe(static_cast<double>(batch.n_tokens) / batch_size);
+        metrics.prefill_tokens_per_step.observe(static_cast<double>(prefill_tokens));
+        metrics.decode_tokens_per_step.observe(decode_tokens);
+        metrics.decode_seconds.observe(seconds);
+    }
+
+    // Samples the gauges and publishes the metrics snapshot
+    void publish_metrics() {
+        {
+            std::lock_guard lock(mutex_tasks);
+            metrics.queue_depth = static_cast<double>(queue_tasks.size());
+            metrics.parked_requests = static_cast<double>(parked_slots.size());
+        }
+
+        metrics.slots_idle = 0;
+        metrics.slots_prompt = 0;
+        metrics.slots_generating = 0;
+        // Distinct cells, a prefix shared between sequences through seq_cp is indexed once
+        metrics.kv_tokens_used = static_cast<double>(prefix_cache.resident_tokens());
+        for (const auto& slot : slots) {
+            switch (slot.state) {
+                case Slot::State::IDLE: metrics.slots_idle++; break;
+                case Slot::State::PROMPT: metrics.slots_prompt++; break;
+                case Slot::State::GENERATING: metrics.slots_generating++; break;
+                case Slot::State::SUSPENDED: break;
+            }
+            // Generated tokens are only indexed once a job ends, until then they're the slot's own
+            metrics.kv_tokens_used += static_cast<double>(
+                slot.cache_tokens.size() - std::min(slot.cache_tokens.size(), prefix_cache.length(slot.slot_id)));
+        }
+
+        metrics.cancellations_total = static_cast<double>(cancellations.load(std::memory_order_relaxed));
+        metrics_publisher.publish(metrics);
+    }
+
     // Required due to rule_stream circular dependency
     void cleanup_slot(Slot& slot) {
+        {
+            std::lock_guard lock(mutex_tasks);
+            requeue_forks(slot);
+        }
+
+        // Index everything the finished job left in the KV, generated tokens included
+        prefix_cache.extend(slot.slot_id, slot.cache_tokens);
+
         slot.rule_stream->reset();
         slot.end(++current_job_index, ctx);
+        metrics.requests_finished_total++;
+    }
+
+    // One packed embedding decode per step, so embeddings and generation take turns
+    void update_embeddings() {
+        {
+            std::lock_guard lock(mutex_tasks);
+            while (!queue_embeddings.empty()) {
+                active_embeddings.push_back(std::move(queue_embeddings.front()));
+                queue_embeddings.pop_front();
+            }
+        }
+
+        if (active_embeddings.empty()) {
+            return;
+        }
+
+        {
+            TraceSpan span(tracer, "embed");
+            embedder.step(active_embeddings);
+        }
+
+        // Packing is in order, every job in front of a partly packed one is done
+        while (!active_embeddings.empty()) {
+            const auto& job = active_embeddings.front();
+            if (job.next_input < job.inputs.size() && !job.failure) {
+                break;
+            }
+
+            embedding_buffer_finish(job.buffer, job.failure ? job.failure : "Ok");
+            embedding_buffer_release(job.buffer);
+            active_embeddings.pop_front();
+        }
     }
 
     void run() {
         while (!should_exit) {
             process_tasks();
             update_slots();
+            update_embeddings();
+            publish_metrics();
 
-            bool all_idle = true;
+            bool all_idle = active_embeddings.empty();
             for (const auto& slot : slots) {
                 if (slot.is_processing()) {
                     all_idle = false;
@@ -426,9 +1404,9 @@ class Processor {
 
             if (all_idle) {
                 std::unique_lock lock(mutex_tasks);
-                if (queue_tasks.empty()) {
+                if (queue_tasks.empty() && queue_embeddings.empty()) {
                     cv_tasks.wait(lock, [this]() {
-                        return !queue_tasks.empty() || should_exit;
+                        return !queue_tasks.empty() || !queue_embeddings.empty() || should_exit;
                     });
                 }
             }
@@ -436,12 +1414,53 @@ class Processor {
     }
 
 public:
-    Processor(llama_model* model, llama_context* ctx, llama_memory_t mem, const int num_slots = 4)
-        : model(model), ctx(ctx), mem(mem), tokenizer(model, ctx) {
+    Processor(
+        llama_model* model,
+        llama_context* ctx,
+        llama_memory_t mem,
+        const int num_slots = 4,
+        const uint32_t step_token_budget = 0,
+        const PrefillPolicy prefill_policy = PrefillPolicy::FAIR_SHARE,
+        const size_t host_cache_bytes = 0,
+        const char* disk_cache_dir = nullptr,
+        const size_t disk_cache_bytes = 0,
+        const int cache_type_k = 1,
+        const int cache_type_v = 1,
+        const bool flash_attn = false,
+        llama_model* draft_model_ptr = nullptr,
+        llama_context* draft_ctx = nullptr,
+        const int n_draft = 0,
+        llama_context* embedding_ctx = nullptr)
+        : model(model), ctx(ctx), mem(mem),
+          scheduler(step_token_budget, prefill_policy),
+          host_cache(host_cache_bytes),
+          tokenizer(model, ctx),
+          post_decode_pool(post_decode_threads(num_slots)) {
 
         batch_size = llama_n_batch(ctx);
+        n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
         batch = llama_batch_init(static_cast<int32_t>(batch_size), 0, num_slots);
 
+        prefix_match_lens.resize(num_slots);
+        pending_forks.resize(num_slots);
+        spill_match_lens.resize(num_slots);
+
+        if (disk_cache_dir && disk_cache_dir[0] != '\0' && disk_cache_bytes > 0) {
+            disk_cache.open(disk_cache_dir, kv_cache_fingerprint(model, ctx, cache_type_k, cache_type_v, flash_attn), disk_cache_bytes);
+        }
+
+        // Drafts are token ids, the draft model has to share the target's vocabulary
+        if (draft_model_ptr && llama_vocab_n_tokens(llama_model_get_vocab(draft_model_ptr)) ==
+                               llama_vocab_n_tokens(llama_model_get_vocab(model))) {
+            draft_model.init(draft_model_ptr, draft_ctx, num_slots, n_draft);
+        }
+
+        embedder.init(model, embedding_ctx);
+
+        metrics.init();
+        metrics.kv_tokens_total = llama_n_ctx(ctx);
+        metrics_publisher.publish(metrics);
+
         slots.reserve(num_slots);
         for (int i = 0; i < num_slots; i++) {
             slots.emplace_back(model, ctx);
@@ -453,17 +1472,16 @@ public:
         worker_thread = std::thread(&Processor::run, this);
         auto inference_abort_callback = [](void* data) -> bool {
             // Abort inference and reset the abort toggle.
-            const auto abort_flag = static_cast<bool*>(data);
-            if (*abort_flag) {
-                *abort_flag = false;
-                return true;
-            }
-            return false;
+            auto* abort_flag = static_cast<std::atomic<bool>*>(data);
+            return abort_flag->load(std::memory_order_relaxed) && abort_flag->exchange(false);
         };
         llama_set_abort_callback(ctx, inference_abort_callback, &abort_inference);
     }
 
     ~Processor() {
+        // Submissions still being tokenized are queued before the worker stops
+        tokenize_pool.shutdown();
+
         should_exit = true;
         cv_tasks.notify_all();
         for (const auto& slot : slots) {
@@ -473,94 +1491,284 @@ public:
             worker_thread.join();
         }
         llama_batch_free(batch);
+
+        for (auto* jobs : {&active_embeddings, &queue_embeddings}) {
+            for (const auto& job : *jobs) {
+                embedding_buffer_finish(job.buffer, "Aborted");
+                embedding_buffer_release(job.buffer);
+            }
+        }
     }
 
     bool cancel_work(const int request_id_to_cancel) {
         bool found = false;
+        bool deferred = false;
 
         // Is our job pending in the request queue? If so, remove it.
         // TODO:: @Z Does a different data structure make more sense with this operation?
         {
             std::lock_guard lock(mutex_tasks);
-            if (!queue_tasks.empty()) {
-                std::queue<Request> new_queue;
-
-                while (!queue_tasks.empty()) {
-                    Request req = queue_tasks.front();
-                    queue_tasks.pop();
-
-                    if (req.id != request_id_to_cancel) {
-                        new_queue.push(req);
-                    } else {
-                        readback_finish(
-                            req.inference_args.gen_resources->readback_buffer,
-                            make_empty_json_status_string("Aborted", "None")
-                        );
-                        found = true;
-                    }
+            for (auto it = queue_tasks.begin(); it != queue_tasks.end();) {
+                if (it->id != request_id_to_cancel) {
+                    ++it;
+                    continue;
+                }
+
+                readback_finish(
+                    it->inference_args.gen_resources->readback_buffer,
+                    make_empty_json_status_string("Aborted", "None")
+                );
+
+                // Queued forks have no prompt of their own without the parent
+                for (GenerationResources* fork : it->fork_resources) {
+                    readback_finish(fork->readback_buffer, make_empty_json_status_string("Aborted", "None"));
                 }
+                it = queue_tasks.erase(it);
+                found = true;
+            }
 
-                queue_tasks = std::move(new_queue);
+            // Still being tokenized, cancelled once it's queued
+            if (tokenizing_ids.count(request_id_to_cancel) > 0) {
+                cancelled_tokenizing_ids.insert(request_id_to_cancel);
+                found = true;
+                deferred = true;
             }
-        }
 
-        bool were_any_cancelled = false;
+            // Forks of a prompt in progress, the rest of the group carries on
+            for (auto& forks : pending_forks) {
+                for (auto it = forks.begin(); it != forks.end();) {
+                    if (it->id != request_id_to_cancel) {
+                        ++it;
+                        continue;
+                    }
 
-        for (auto& slot : slots) {
-            if (slot.request_id == request_id_to_cancel) {
-                if (slot.gen_resources->readback_buffer) {
-                    std::string last_token_piece = common_token_to_piece(ctx, slot.last_token, true);
-                    slot.generating_end_time = readable_ggml_time();
-                    readback_finish(slot.gen_resources->readback_buffer, make_json_status_string(slot, "Aborted", last_token_piece));
+                    readback_finish(
+                        it->inference_args.gen_resources->readback_buffer,
+                        make_empty_json_status_string("Aborted", "None")
+                    );
+                    it = forks.erase(it);
+                    found = true;
                 }
-                
-                // Mark for cancellation rather than direct cleanup
-                slot.cancelled = true;
+            }
 
-                found = true;
-                were_any_cancelled = true;
+            // Parked requests hold no sequence, dropping them is enough
+            found |= drop_parked(request_id_to_cancel);
+
+            // A deferred cancel is counted when it's applied
+            if (found) {
+                if (!deferred) {
+                    cancellations.fetch_add(1, std::memory_order_relaxed);
+                }
+                return true;
             }
-        }
 
-        //We do not want to throw an abort request cancellation if nothing was cancelled in the processor
-        if (!were_any_cancelled) {
-          return false;
-        }
+            if (request_id_to_cancel <= 0 || request_id_to_cancel >= next_request_id) {
+                return false;
+            }
 
-        // A cancelled slot is "idle"
-        bool all_idle = true;
-        for (auto& slot : slots) {
-            if (slot.is_processing() && !slot.cancelled) {
-                all_idle = false;
+            // Anything else is running, or about to be, or already done. The worker ends it at its next step
+            // if it's in a slot by then. Requests taken off the queue aren't published as running until then.
+            slot_cancels.push_back(request_id_to_cancel);
+            const auto is_cancelled = [this](const int id) {
+                return std::find(slot_cancels.begin(), slot_cancels.end(), id) != slot_cancels.end();
+            };
+            if (std::find(running_request_ids.begin(), running_request_ids.end(), request_id_to_cancel) ==
+                running_request_ids.end()) {
+                return true;
             }
-        }
 
-        if (queue_tasks.empty() && all_idle) {
-            // Abort inference is reset via the mechanism in the lambda abort fn
-            abort_inference = true;
+            // A cancelled slot is "idle"
+            if (queue_tasks.empty() && std::all_of(running_request_ids.begin(), running_request_ids.end(), is_cancelled)) {
+                // Abort inference is reset via the mechanism in the lambda abort fn
+                abort_inference = true;
+            }
         }
 
-        return found;
+        return true;
+    }
+
+    void get_metrics(ProcessorMetrics& out) const {
+        metrics_publisher.read(out);
+    }
+
+    void set_tracing(const bool enable) {
+        tracer.set_enabled(enable);
     }
 
+    std::string dump_trace() {
+        return tracer.dump();
+    }
+
+    // Forks are extra completions of the same prompt. Their request ids follow the returned one.
+    // The prompt is tokenized on the pool, the request id is valid for cancellation right away.
     int submit_work(
-        const std::string& prompt,
-        const InferenceArgs& args) {
+        std::string prompt,
+        const InferenceArgs& args,
+        const std::vector<GenerationResources*>& fork_resources = {}) {
+
+        const int request_id = next_request_id.fetch_add(1 + static_cast<int>(fork_resources.size()));
+        {
+            std::lock_guard lock(mutex_tasks);
+            begin_tokenizing(request_id, fork_resources.size());
+        }
+
+        InferenceArgs timed_args = args;
+        timed_args.submit_time = readable_ggml_time();
 
-        // Always encode special tokens
-        const std::vector<llama_token>& prompt_tokens = tokenizer.tokenize(prompt, args.add_special, true);
-        static int next_id = 1;
-        const int request_id = next_id++;
+        tokenize_pool.submit([this, request_id, prompt = std::move(prompt), args = std::move(timed_args), fork_resources] {
+            std::vector<llama_token> prompt_tokens;
+            {
+                TraceSpan span(tracer, "tokenize", -1, request_id);
+
+                // Always encode special tokens
+                prompt_tokens = tokenizer.tokenize(prompt, args.add_special, true);
+            }
+            enqueue_tokenized({request_id, std::move(prompt_tokens), args, fork_resources, {}});
+        });
+
+        return request_id;
+    }
+
+    // Same as submit_work for a prompt the caller already tokenized
+    int submit_tokens(
+        std::vector<llama_token> prompt_tokens,
+        const InferenceArgs& args,
+        const std::vector<GenerationResources*>& fork_resources = {}) {
+
+        const int request_id = next_request_id.fetch_add(1 + static_cast<int>(fork_resources.size()));
 
         {
-            const Request request{request_id, prompt_tokens, args};
+            Request request{request_id, std::move(prompt_tokens), args, fork_resources, {}};
+            request.inference_args.submit_time = readable_ggml_time();
+            request.inference_args.queued_time = request.inference_args.submit_time;
             std::lock_guard lock(mutex_tasks);
-            queue_tasks.push(request);
+            enqueue(std::move(request), false);
         }
 
         cv_tasks.notify_one();
         return request_id;
     }
+
+    // Scores every candidate as a continuation of the context. The context is prefilled once in the first
+    // request, every candidate forks its KV. Without candidates the context scores itself.
+    // Returns the context's id, candidate i has id + 1 + i.
+    int submit_scoring(
+        std::string context,
+        std::vector<std::string> candidates,
+        InferenceArgs args,
+        const std::vector<GenerationResources*>& candidate_resources) {
+
+        const int request_id = next_request_id.fetch_add(1 + static_cast<int>(candidates.size()));
+        {
+            std::lock_guard lock(mutex_tasks);
+            begin_tokenizing(request_id, candidates.size());
+        }
+        args.submit_time = readable_ggml_time();
+
+        tokenize_pool.submit([this, request_id, context = std::move(context), candidates = std::move(candidates),
+                              args, candidate_resources]() mutable {
+            const std::vector<llama_token> context_tokens = tokenizer.tokenize(context, args.add_special, true);
+
+            std::vector<std::vector<llama_token>> candidate_tokens;
+            candidate_tokens.reserve(candidates.size());
+            for (const auto& candidate : candidates) {
+                std::vector<llama_token> tokens = context_tokens;
+                const auto& continuation = tokenizer.tokenize(candidate, false, true);
+                tokens.insert(tokens.end(), continuation.begin(), continuation.end());
+                candidate_tokens.push_back(std::move(tokens));
+            }
+
+            // Scores are read while prefilling, a prompt that doesn't fit can't be scored
+            const size_t max_tokens = std::min(static_cast<size_t>(llama_n_ctx(ctx)), static_cast<size_t>(args.max_slot_n_ctx));
+            bool exceeds_ctx = context_tokens.empty() || context_tokens.size() > max_tokens;
+            for (const auto& tokens : candidate_tokens) {
+                exceeds_ctx = exceeds_ctx || tokens.size() > max_tokens;
+            }
+
+            if (exceeds_ctx) {
+                {
+                    std::lock_guard lock(mutex_tasks);
+                    for (int id = request_id; id <= request_id + static_cast<int>(candidates.size()); id++) {
+                        tokenizing_ids.erase(id);
+                        cancelled_tokenizing_ids.erase(id);
+                    }
+                }
+
+                readback_finish(args.gen_resources->readback_buffer, make_empty_json_status_string("CtxExceeded", "None"));
+                for (const auto* resources : candidate_resources) {
+                    readback_finish(resources->readback_buffer, make_empty_json_status_string("CtxExceeded", "None"));
+                }
+                return;
+            }
+
+            args.score_from = candidates.empty() ? 1 : static_cast<int>(context_tokens.size());
+            enqueue_tokenized({request_id, context_tokens, args, candidate_resources, std::move(candidate_tokens)});
+        });
+
+        return request_id;
+    }
+
+    // Embeds every input into the buffer's rows. Returns false if the job was rejected, the buffer holds the reason.
+    bool submit_embeddings(
+        EmbeddingBuffer* buffer,
+        const std::vector<std::string>& inputs,
+        const bool add_special,
+        const bool normalize) {
+
+        if (!embedder.enabled()) {
+            embedding_buffer_finish(buffer, "NotSupported");
+            return false;
+        }
+
+        // Tokenized on the pool like prompts. The task holds a reference, handed to the job once it's queued.
+        embedding_buffer_ref_acquire(buffer);
+        tokenize_pool.submit([this, buffer, inputs, add_special, normalize] {
+            EmbeddingJob job{buffer, {}, normalize};
+            job.inputs.reserve(inputs.size());
+
+            int32_t n_tokens = 0;
+            for (const auto& input : inputs) {
+                {
+                    TraceSpan span(tracer, "tokenize");
+                    job.inputs.push_back(tokenizer.tokenize(input, add_special, true));
+                }
+
+                const auto& tokens = job.inputs.back();
+                const char* failure = nullptr;
+                if (tokens.empty()) {
+                    failure = "EmptyInput";
+                } else if (static_cast<int32_t>(tokens.size()) > embedder.max_input_tokens()) {
+                    failure = "InputTooLong";
+                }
+
+                if (failure) {
+                    embedding_buffer_finish(buffer, failure);
+                    embedding_buffer_release(buffer);
+                    return;
+                }
+                n_tokens += static_cast<int32_t>(tokens.size());
+            }
+
+            buffer->n_inputs = static_cast<int32_t>(inputs.size());
+            buffer->n_embd = embedder.embedding_size();
+            buffer->n_tokens = n_tokens;
+            buffer->data = new float[inputs.size() * buffer->n_embd]();
+
+            if (inputs.empty()) {
+                embedding_buffer_finish(buffer, "Ok");
+                embedding_buffer_release(buffer);
+                return;
+            }
+
+            {
+                std::lock_guard lock(mutex_tasks);
+                queue_embeddings.push_back(std::move(job));
+            }
+            cv_tasks.notify_one();
+        });
+
+        return true;
+    }
 };
 
-#endif // PROCESSOR_HPP
\ No newline at end of file
+#endif // PROCESSOR_HPP
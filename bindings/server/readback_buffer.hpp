@@ -2,25 +2,48 @@
 #define READBACK_BUFFER_HPP
 
 #include <vector>
+#include <algorithm>
 #include <llama.h>
 #include <cstring>
+#include <string>
+#include <string_view>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "logprobs.hpp"
 
 /**
  * Owned buffer for live token and character streaming.
+ * Readers block in readback_wait until the processor writes, instead of polling.
+ * The text of all entries lives in one byte arena, readback_read_batch copies every pending entry in one call.
  */
 struct ReadbackBuffer {
     unsigned last_readback_index {0};
     bool buffer_finished_write {false};
     char* status_buffer = nullptr;
 
-    // Owner internal char*'s. Must free all of them. (strdup)
-    std::vector<char*>* data = new std::vector<char*>();
+    // Entry i's text is text[text_ends[i - 1], text_ends[i]), its token is ids[i]
+    std::vector<char>* text = new std::vector<char>();
+    std::vector<uint32_t>* text_ends = new std::vector<uint32_t>();
     std::vector<llama_token>* ids = new std::vector<llama_token>();
 
+    // NUL terminated copy of the entry last returned by readback_read_next
+    std::string last_read;
+
+    // Logprobs of every sampled token, 1 + logprobs_top_k records each: the token, then its top-k alternatives.
+    // logprob_entries holds the index of the data entry each token's text went to. -1 top_k means disabled.
+    int logprobs_top_k {-1};
+    unsigned last_logprob_index {0};
+    std::vector<TokenLogprob> logprobs;
+    std::vector<uint32_t> logprob_entries;
+
     // Two phase destruction
     std::mutex readback_mutex;
     std::atomic<bool> being_destroyed {false};
+
+    // Signalled on every write and on finish. Destruction waits for blocked readers to leave.
+    std::condition_variable readback_cv;
+    unsigned waiters {0};
 };
 
 template<typename Callback>
@@ -50,14 +73,22 @@ ReadbackBuffer* readback_create_buffer() {
     return new ReadbackBuffer{};
 }
 
+inline uint32_t readback_text_begin(const ReadbackBuffer* buffer, const size_t entry) {
+    return entry == 0 ? 0 : (*buffer->text_ends)[entry - 1];
+}
+
 // C API
+// The text stays valid until the next call.
 bool readback_read_next(ReadbackBuffer* buffer, char** outChar, llama_token* outToken) {
     bool success = false;
     using_readback_buffer(buffer, [&] {
-        if (buffer->last_readback_index < buffer->ids->size() &&
-            buffer->last_readback_index < buffer->data->size()) {
-            *outChar = buffer->data->at(buffer->last_readback_index);
-            *outToken = buffer->ids->at(buffer->last_readback_index);
+        if (buffer->last_readback_index < buffer->ids->size()) {
+            const size_t entry = buffer->last_readback_index;
+            const char* text = buffer->text->data();
+            buffer->last_read.assign(text + readback_text_begin(buffer, entry), text + (*buffer->text_ends)[entry]);
+
+            *outChar = buffer->last_read.data();
+            *outToken = buffer->ids->at(entry);
             buffer->last_readback_index++;
             success = true;
         }
@@ -66,6 +97,71 @@ bool readback_read_next(ReadbackBuffer* buffer, char** outChar, llama_token* out
     return success;
 }
 
+// C API
+// Copies pending entries while their text fits into text_capacity bytes, at most max_entries.
+// Entry i gets out_lengths[i] bytes of out_text, not NUL terminated. *out_bytes is the total copied.
+// Returns the number of entries. When the first pending entry alone doesn't fit, returns 0 with its size in *out_bytes.
+unsigned readback_read_batch(ReadbackBuffer* buffer, char* out_text, const uint32_t text_capacity,
+                             uint32_t* out_lengths, llama_token* out_tokens, const unsigned max_entries,
+                             uint32_t* out_bytes) {
+    unsigned count = 0;
+    *out_bytes = 0;
+    using_readback_buffer(buffer, [&] {
+        const size_t first = buffer->last_readback_index;
+        const uint32_t base = readback_text_begin(buffer, first);
+
+        size_t entry = first;
+        while (entry < buffer->ids->size() && count < max_entries) {
+            const uint32_t end = (*buffer->text_ends)[entry];
+            if (end - base > text_capacity) {
+                break;
+            }
+
+            out_lengths[count] = end - readback_text_begin(buffer, entry);
+            out_tokens[count] = (*buffer->ids)[entry];
+            count++;
+            entry++;
+        }
+
+        if (count == 0) {
+            if (first < buffer->ids->size()) {
+                *out_bytes = (*buffer->text_ends)[first] - base;
+            }
+            return;
+        }
+
+        const uint32_t end = (*buffer->text_ends)[entry - 1];
+        std::memcpy(out_text, buffer->text->data() + base, end - base);
+        *out_bytes = end - base;
+        buffer->last_readback_index = static_cast<unsigned>(entry);
+    });
+
+    return count;
+}
+
+// C API
+// Blocks until there's an unread entry or the buffer is finished, at most timeout_ms.
+// Returns false on timeout.
+bool readback_wait(ReadbackBuffer* buffer, const uint32_t timeout_ms) {
+    if (!buffer || buffer->being_destroyed)
+        return true;
+
+    std::unique_lock lock(buffer->readback_mutex);
+    const auto ready = [buffer] {
+        return buffer->being_destroyed || buffer->buffer_finished_write ||
+               buffer->last_readback_index < buffer->ids->size();
+    };
+
+    buffer->waiters++;
+    const bool result = buffer->readback_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+    buffer->waiters--;
+
+    if (buffer->being_destroyed) {
+        buffer->readback_cv.notify_all();
+    }
+    return result;
+}
+
 // C API
 char* readback_read_status(ReadbackBuffer* buffer) {
     char* status = nullptr;
@@ -76,25 +172,51 @@ char* readback_read_status(ReadbackBuffer* buffer) {
     return status;
 }
 
+// C API
+int readback_logprobs_top_k(ReadbackBuffer* buffer) {
+    int top_k = -1;
+    using_readback_buffer(buffer, [&] {
+        top_k = buffer->logprobs_top_k;
+    });
+    return top_k;
+}
+
+// C API
+// Drains up to max_tokens tokens. out_logprobs needs room for max_tokens * (1 + top_k) records.
+unsigned readback_read_logprobs(ReadbackBuffer* buffer, TokenLogprob* out_logprobs, uint32_t* out_entries, const unsigned max_tokens) {
+    unsigned count = 0;
+    using_readback_buffer(buffer, [&] {
+        if (buffer->logprobs_top_k < 0) {
+            return;
+        }
+
+        const size_t stride = 1 + buffer->logprobs_top_k;
+        const size_t available = buffer->logprob_entries.size() - buffer->last_logprob_index;
+        count = static_cast<unsigned>(std::min<size_t>(available, max_tokens));
+
+        std::copy_n(buffer->logprobs.begin() + buffer->last_logprob_index * stride, count * stride, out_logprobs);
+        std::copy_n(buffer->logprob_entries.begin() + buffer->last_logprob_index, count, out_entries);
+        buffer->last_logprob_index += count;
+    });
+
+    return count;
+}
+
 // C API
 void readback_annihilate(ReadbackBuffer* buffer) {
     if (!buffer)
         return;
 
     {
-        std::lock_guard lock(buffer->readback_mutex);
+        std::unique_lock lock(buffer->readback_mutex);
         buffer->being_destroyed = true;
 
-        if (buffer->data) {
-            for (char* str : *(buffer->data)) {
-                free(str);
-            }
-            delete buffer->data;
-        }
+        buffer->readback_cv.notify_all();
+        buffer->readback_cv.wait(lock, [buffer] { return buffer->waiters == 0; });
 
-        if (buffer->ids) {
-            delete buffer->ids;
-        }
+        delete buffer->text;
+        delete buffer->text_ends;
+        delete buffer->ids;
 
         if (buffer->status_buffer) {
             free(buffer->status_buffer);
@@ -103,12 +225,34 @@ void readback_annihilate(ReadbackBuffer* buffer) {
     delete buffer;
 }
 
-// Internal -- MALLOC copy -- Free all data buffers via free()
-void readback_write_to_buffer(ReadbackBuffer* buffer, const std::string& data, const llama_token token) {
+// Internal
+void readback_write_to_buffer(ReadbackBuffer* buffer, const std::string_view& data, const llama_token token) {
     using_readback_buffer(buffer, [&]() {
-        char* copy = strdup(data.c_str());
-        buffer->data->push_back(copy);
+        buffer->text->insert(buffer->text->end(), data.begin(), data.end());
+        buffer->text_ends->push_back(static_cast<uint32_t>(buffer->text->size()));
         buffer->ids->push_back(token);
+        buffer->readback_cv.notify_all();
+    });
+}
+
+// Internal
+void readback_enable_logprobs(ReadbackBuffer* buffer, const int top_k) {
+    using_readback_buffer(buffer, [&]() {
+        buffer->logprobs_top_k = top_k;
+    });
+}
+
+// Internal -- Records belong to the next data entry written
+void readback_write_logprobs(ReadbackBuffer* buffer, const std::vector<TokenLogprob>& records) {
+    using_readback_buffer(buffer, [&]() {
+        if (buffer->logprobs_top_k < 0 || records.empty()) {
+            return;
+        }
+
+        const size_t stride = 1 + buffer->logprobs_top_k;
+        buffer->logprobs.insert(buffer->logprobs.end(), records.begin(), records.end());
+        buffer->logprob_entries.insert(buffer->logprob_entries.end(), records.size() / stride,
+                                       static_cast<uint32_t>(buffer->ids->size()));
     });
 }
 
@@ -121,6 +265,7 @@ void readback_finish(ReadbackBuffer* buffer, const std::string& status) {
         }
         buffer->buffer_finished_write = true;
         buffer->status_buffer = copy;
+        buffer->readback_cv.notify_all();
     });
 }
 
@@ -10,6 +10,12 @@ struct Request {
     int id;
     std::vector<llama_token> prompt_tokens;
     InferenceArgs inference_args;
+
+    // Extra completions sharing the prompt, prefilled once and forked from this request's sequence
+    std::vector<GenerationResources*> fork_resources;
+
+    // Prompts of the forks when they differ from this one, scoring candidates continue the shared context
+    std::vector<std::vector<llama_token>> fork_prompt_tokens;
 };
 
 #endif // REQUEST_HPP
\ No newline at end of file
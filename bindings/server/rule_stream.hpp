@@ -6,13 +6,16 @@
 
 #include "llama.h"
 #include "sampling.h"
-#include <unordered_map>
+#include <algorithm>
 #include <utility>
 #include <vector>
 #include <string>
 #include <functional>
 #include <variant>
 
+template<class... Ts> struct rule_action_type : Ts... { using Ts::operator()...; };
+template<class... Ts> rule_action_type(Ts...) -> rule_action_type<Ts...>;
+
 enum class TriggerState {
     INACTIVE,
     ACTIVE,
@@ -195,9 +198,10 @@ struct Rule {
     Rule(Trigger start, Trigger end, Action a, const bool can_reuse = false)
         : start_trigger(std::move(start)), end_trigger(std::move(end)), actions{std::move(a)}, reusable(can_reuse) {}
 
-    std::vector<std::reference_wrapper<const Action>> process(const llama_model* model, llama_context* ctx, Slot& slot, const RuleContext* const context) {
+    // Appends the actions of the rule if it completed
+    void process(const llama_model* model, llama_context* ctx, Slot& slot, const RuleContext* const context,
+                 std::vector<std::reference_wrapper<const Action>>& completed_actions) {
         const TriggerState prev_state = state;
-        std::vector<std::reference_wrapper<const Action>> completed_actions;
 
         if (state == TriggerState::INACTIVE) {
             const bool should_activate = std::visit([&](auto& t) -> bool {
@@ -243,81 +247,158 @@ struct Rule {
                 state = TriggerState::INACTIVE;
             }
         }
-
-        return completed_actions;
     }
 };
 
+/*
+ * Rules of one slot, compiled into a flat table.
+ *
+ * Only rules that can do something on a token are processed: every active rule (its actions run each token), and
+ * inactive rules whose start trigger can fire. Start triggers are indexed by kind: token ids in a sorted table,
+ * token count thresholds in a sorted list walked by a cursor, and the few that must see every token (always,
+ * sequences) in a list. A passed threshold is processed once. Its rule activates right away, and a reusable one
+ * moves to the every-token list, since its start trigger stays true.
+ * Candidates are processed in the order the rules were added. Triggered actions go to a buffer reused every token.
+ */
 class RuleStream {
-    std::unordered_map<unsigned, std::vector<Rule>> rules_by_id;
+    std::vector<Rule> rules;
+    std::vector<unsigned> rule_ids;
+
+    std::vector<std::pair<llama_token, unsigned>> token_starts;
+    std::vector<std::pair<int, unsigned>> count_starts;
+    size_t count_cursor = 0;
+    std::vector<unsigned> polled_starts;
+    std::vector<unsigned> active_rules;
+
+    std::vector<unsigned> candidates;
+    std::vector<std::reference_wrapper<const Action>> triggered_actions;
     unsigned current_id = 0;
 
-    std::vector<std::reference_wrapper<const Action>> process_rules(
-        const RuleContext* const context,
-        const llama_model* model,
-        llama_context* ctx,
-        Slot& slot,
-        std::vector<Rule>& rules
-    ) {
-        std::vector<std::reference_wrapper<const Action>> triggered_actions;
+    void index_rule(const unsigned index) {
+        std::visit(rule_action_type {
+            [&](const TriggerOnToken& t) { token_starts.emplace_back(t.token, index); },
+            [&](const TriggerOnTokenCount& t) { count_starts.emplace_back(t.threshold, index); },
+            [&](const TriggerNever&) { },
+            [&](const auto&) { polled_starts.push_back(index); },
+        }, rules[index].start_trigger);
+    }
 
-        for (auto& rule : rules) {
-            auto actions = rule.process(model, ctx, slot, context);
-            triggered_actions.insert(triggered_actions.end(), actions.begin(), actions.end());
+    void rebuild_indexes() {
+        token_starts.clear();
+        count_starts.clear();
+        count_cursor = 0;
+        polled_starts.clear();
+        active_rules.clear();
+
+        for (unsigned i = 0; i < rules.size(); i++) {
+            index_rule(i);
+            if (rules[i].state == TriggerState::ACTIVE) {
+                active_rules.push_back(i);
+            }
         }
 
-        return triggered_actions;
+        std::sort(token_starts.begin(), token_starts.end());
+        std::sort(count_starts.begin(), count_starts.end());
+    }
+
+    void process_rule(const unsigned index, const RuleContext* const context,
+                      const llama_model* model, llama_context* ctx, Slot& slot) {
+        Rule& rule = rules[index];
+        const bool was_active = rule.state == TriggerState::ACTIVE;
+        rule.process(model, ctx, slot, context, triggered_actions);
+
+        const bool is_active = rule.state == TriggerState::ACTIVE;
+        if (is_active && !was_active) {
+            active_rules.insert(std::lower_bound(active_rules.begin(), active_rules.end(), index), index);
+        } else if (was_active && !is_active) {
+            active_rules.erase(std::lower_bound(active_rules.begin(), active_rules.end(), index));
+        }
     }
 
 public:
-    unsigned add_rules(std::vector<Rule> rules,
+    unsigned add_rules(std::vector<Rule> new_rules,
                       const llama_model* model,
                       llama_context* ctx,
                       Slot& slot) {
 
         const unsigned rule_id = current_id++;
-        rules_by_id[rule_id] = std::move(rules);
+        const auto first = static_cast<unsigned>(rules.size());
+        for (auto& rule : new_rules) {
+            rules.push_back(std::move(rule));
+            rule_ids.push_back(rule_id);
+        }
+        rebuild_indexes();
 
-        process_rules(nullptr, model, ctx, slot, rules_by_id[rule_id]);
+        triggered_actions.clear();
+        for (auto i = first; i < rules.size(); i++) {
+            process_rule(i, nullptr, model, ctx, slot);
+        }
         return rule_id;
     }
 
     void remove_id(const unsigned id) {
-        rules_by_id.erase(id);
-    }
-
-    const std::vector<Rule>* get_rules(const unsigned id) const {
-        if (const auto it = rules_by_id.find(id); it != rules_by_id.end()) {
-            return &it->second;
+        for (size_t i = rules.size(); i-- > 0;) {
+            if (rule_ids[i] == id) {
+                rules.erase(rules.begin() + static_cast<long>(i));
+                rule_ids.erase(rule_ids.begin() + static_cast<long>(i));
+            }
         }
-        return nullptr;
+        rebuild_indexes();
     }
 
-    std::vector<std::reference_wrapper<const Action>> apply_engine(
+    // The actions of the rules that completed on this token, valid until the next call
+    const std::vector<std::reference_wrapper<const Action>>& apply_engine(
         const llama_token token,
         const SequenceStream::SequenceContext& seq_ctx,
         const llama_model* model,
         llama_context* ctx,
         Slot& slot
     ) {
-        std::vector<std::reference_wrapper<const Action>> all_triggered_actions;
+        triggered_actions.clear();
+        if (rules.empty()) {
+            return triggered_actions;
+        }
+
+        candidates.assign(active_rules.begin(), active_rules.end());
+
+        auto token_it = std::lower_bound(token_starts.begin(), token_starts.end(), std::make_pair(token, 0u));
+        for (; token_it != token_starts.end() && token_it->first == token; ++token_it) {
+            candidates.push_back(token_it->second);
+        }
+
+        for (; count_cursor < count_starts.size() && count_starts[count_cursor].first <= slot.tokens_generated;
+             count_cursor++) {
+            const unsigned index = count_starts[count_cursor].second;
+            candidates.push_back(index);
+            if (rules[index].reusable) {
+                polled_starts.push_back(index);
+            }
+        }
+
+        candidates.insert(candidates.end(), polled_starts.begin(), polled_starts.end());
+
+        if (candidates.size() > 1) {
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+        }
+
         const RuleContext context_obj{token, seq_ctx};
-        const RuleContext* const context = &context_obj;
-
-        for (auto& [id, rule_list] : rules_by_id) {
-            auto triggered_actions = process_rules(context, model, ctx, slot, rule_list);
-            all_triggered_actions.insert(
-                all_triggered_actions.end(),
-                triggered_actions.begin(),
-                triggered_actions.end()
-            );
+        for (const unsigned index : candidates) {
+            // Completed rules stay in the start indexes, they just never fire again
+            if (rules[index].state != TriggerState::COMPLETED) {
+                process_rule(index, &context_obj, model, ctx, slot);
+            }
         }
 
-        return all_triggered_actions;
+        return triggered_actions;
     }
 
     void reset() {
-        rules_by_id.clear();
+        rules.clear();
+        rule_ids.clear();
+        rebuild_indexes();
+        candidates.clear();
+        triggered_actions.clear();
         current_id = 0;
     }
 };
@@ -3,10 +3,12 @@
 
 #include "llama-model.h"
 #include "sampling.h"
+#include "fused_sampler.hpp"
 #include <iostream>
 
 /*
  * A very minimal abstraction over lcpp samplers primarily to expose to bindings.
+ * Samplers the fused path can run are wrapped in a step recording their parameters, see fused_sampler.hpp.
  */
 
 llama_sampler* sampler_make() {
@@ -31,15 +33,25 @@ llama_sampler* sampler_llguidance(llama_sampler* chain, const llama_model* model
 }
 
 llama_sampler* sampler_dist(llama_sampler* chain, const uint32_t seed) {
-    return add_sampler(chain, llama_sampler_init_dist(seed));
+    return add_sampler(chain, fusable_step_init(
+        llama_sampler_init_dist(seed), {FusableKind::DIST, 0.0f, 0, 1, {}, seed}));
 }
 
 llama_sampler* sampler_greedy(llama_sampler* chain) {
-    return add_sampler(chain, llama_sampler_init_greedy());
+    return add_sampler(chain, fusable_step_init(llama_sampler_init_greedy(), {FusableKind::GREEDY}));
 }
 
 llama_sampler* sampler_min_p(llama_sampler* chain, const float min_p, const size_t min_keep) {
-    return add_sampler(chain, llama_sampler_init_min_p(min_p, min_keep));
+    llama_sampler* sampler = llama_sampler_init_min_p(min_p, min_keep);
+    if (min_p <= 0.0f) {
+        return add_sampler(chain, fusable_step_init(sampler, {FusableKind::NEUTRAL}));
+    }
+
+    // Keeping more than the max when the cut leaves fewer isn't fused
+    if (min_keep > 1) {
+        return add_sampler(chain, sampler);
+    }
+    return add_sampler(chain, fusable_step_init(sampler, {FusableKind::MIN_P, min_p}));
 }
 
 llama_sampler* sampler_mirostat_v2(llama_sampler* chain, const uint32_t seed, const float tau, const float eta) {
@@ -48,12 +60,16 @@ llama_sampler* sampler_mirostat_v2(llama_sampler* chain, const uint32_t seed, co
 
 llama_sampler* sampler_penalties(llama_sampler* chain, const int penalty_last_n, const float penalty_repeat,
                                  const float penalty_freq, const float penalty_present) {
-    return add_sampler(chain, llama_sampler_init_penalties(
-        penalty_last_n, penalty_repeat, penalty_freq, penalty_present));
+    llama_sampler* sampler = llama_sampler_init_penalties(
+        penalty_last_n, penalty_repeat, penalty_freq, penalty_present);
+    if (penalty_last_n == 0 || (penalty_repeat == 1.0f && penalty_freq == 0.0f && penalty_present == 0.0f)) {
+        return add_sampler(chain, fusable_step_init(sampler, {FusableKind::NEUTRAL}));
+    }
+    return add_sampler(chain, sampler);
 }
 
 llama_sampler* sampler_temp(llama_sampler* chain, const float temp) {
-    return add_sampler(chain, llama_sampler_init_temp(temp));
+    return add_sampler(chain, fusable_step_init(llama_sampler_init_temp(temp), {FusableKind::TEMP, temp}));
 }
 
 llama_sampler* sampler_temp_ext(llama_sampler* chain, const float temp,
@@ -62,15 +78,21 @@ llama_sampler* sampler_temp_ext(llama_sampler* chain, const float temp,
 }
 
 llama_sampler* sampler_top_k(llama_sampler* chain, const int top_k) {
-    return add_sampler(chain, llama_sampler_init_top_k(top_k));
+    const FusableKind kind = top_k <= 0 ? FusableKind::NEUTRAL : FusableKind::TOP_K;
+    return add_sampler(chain, fusable_step_init(llama_sampler_init_top_k(top_k), {kind, 0.0f, top_k}));
 }
 
 llama_sampler* sampler_top_p(llama_sampler* chain, const float top_p, const size_t min_keep) {
-    return add_sampler(chain, llama_sampler_init_top_p(top_p, min_keep));
+    const FusableKind kind = top_p >= 1.0f ? FusableKind::NEUTRAL : FusableKind::TOP_P;
+    return add_sampler(chain, fusable_step_init(llama_sampler_init_top_p(top_p, min_keep), {kind, top_p, 0, min_keep}));
 }
 
 llama_sampler* sampler_typical(llama_sampler* chain, const float typical_p, const size_t min_keep) {
-    return add_sampler(chain, llama_sampler_init_typical(typical_p, min_keep));
+    llama_sampler* sampler = llama_sampler_init_typical(typical_p, min_keep);
+    if (typical_p >= 1.0f) {
+        return add_sampler(chain, fusable_step_init(sampler, {FusableKind::NEUTRAL}));
+    }
+    return add_sampler(chain, sampler);
 }
 
 llama_sampler* sampler_top_n_sigma(llama_sampler* chain, const float n_sigma) {
@@ -101,8 +123,12 @@ llama_sampler* sampler_infill(llama_sampler* chain, const llama_model* model) {
 
 llama_sampler* sampler_logit_bias(llama_sampler* chain, const llama_model* model,
                                   const int32_t n_bias, const llama_logit_bias* logit_bias) {
-    return add_sampler(chain, llama_sampler_init_logit_bias(
-        llama_vocab_n_tokens(&model->vocab), n_bias, logit_bias));
+    llama_sampler* sampler = llama_sampler_init_logit_bias(llama_vocab_n_tokens(&model->vocab), n_bias, logit_bias);
+    if (n_bias == 0) {
+        return add_sampler(chain, fusable_step_init(sampler, {FusableKind::NEUTRAL}));
+    }
+    return add_sampler(chain, fusable_step_init(sampler, {
+        FusableKind::LOGIT_BIAS, 0.0f, 0, 1, std::vector(logit_bias, logit_bias + n_bias)}));
 }
 
 llama_sampler* sampler_mirostat(llama_sampler* chain, const llama_model* model, const uint32_t seed,
@@ -1,8 +1,9 @@
 #ifndef SEQUENCE_STREAM_HPP
 #define SEQUENCE_STREAM_HPP
 #include <string>
+#include <string_view>
 #include <vector>
-#include "trie.hpp"
+#include "match_automaton.hpp"
 
 /*
  *  The sequence stream is responsible for monitoring sequence events in the inference stream.
@@ -11,16 +12,30 @@
  *  A lightweight buffer that indicates the status of the stream and how the processor should proceed.
  *
  *  Mechanism
- *  A sequence buffer and matching trie that checks for stops or rewinds, and indicates when we should buffer inputs.
+ *  A sequence buffer and a streaming matcher that checks for stops or rewinds, and indicates when we should buffer inputs.
+ *  The matcher only sees each piece once, its state stands for whatever is buffered.
+ *  Results are views into the buffer. A resolved sequence is only dropped on the next change, so the views stay valid
+ *  until then and the buffer keeps its capacity across tokens.
  */
 
 class SequenceStream {
     int buffered_seq_size {};
-    MatchTrie* match_trie = nullptr;
-
-public:
+    MatchAutomaton matcher;
     std::string sequence_buffer;
 
+    // The buffer holds an already resolved sequence, it is logically empty
+    bool resolved {false};
+
+    void drop_resolved() {
+        if (resolved) {
+            sequence_buffer.clear();
+            buffered_seq_size = 0;
+            matcher.reset();
+            resolved = false;
+        }
+    }
+
+public:
     enum SequenceStatus {
         ACCEPT = 1,
         BUFFER = 2,
@@ -29,31 +44,52 @@ public:
     };
 
     // Contains the result of what was in the buffer during the status.
+    // The views are valid until the next append, truncate or bind_sequences on the same stream.
     struct SequenceContext {
         SequenceStatus sequence_status {};
         int current_sequence_size {};
-        std::string current_text_piece {};
-        std::string current_sequence {};
-        std::string unmatched_sequence {};
+        std::string_view current_text_piece {};
+        std::string_view current_sequence {};
+        std::string_view unmatched_sequence {};
     };
 
     SequenceStream() = default;
 
     void bind_sequences(const std::vector<std::string>& stop_seq, const std::vector<std::string>& rewind_seq) {
-        // Delete nullptr is safe
-        delete match_trie;
-        match_trie = new MatchTrie();
-        match_trie->add_matchable_words(stop_seq, MatchType::STOP);
-        match_trie->add_matchable_words(rewind_seq, MatchType::REWIND);
+        matcher.build(stop_seq, rewind_seq);
+
+        sequence_buffer.clear();
+        buffered_seq_size = 0;
+        resolved = false;
+    }
+
+    // Bytes held back waiting for a match to resolve
+    [[nodiscard]] size_t buffered_size() const {
+        return resolved ? 0 : sequence_buffer.size();
+    }
+
+    // Drops held back bytes past length, e.g. back to a rewind snapshot's size, and brings the matcher up to it
+    void truncate(const size_t length) {
+        drop_resolved();
+        if (length >= sequence_buffer.size()) {
+            return;
+        }
 
-        this->sequence_buffer.clear();
+        sequence_buffer.resize(length);
+        matcher.reset();
+        matcher.feed(sequence_buffer, 0);
     }
 
     SequenceContext append(const std::string_view& next_item) {
+        drop_resolved();
+
+        const size_t offset = sequence_buffer.size();
         sequence_buffer += next_item;
         buffered_seq_size++;
 
-        const auto [result, unmatched] = match_trie->check_buffer(sequence_buffer);
+        const auto [result, match_start] = matcher.feed(next_item, offset);
+        const bool matched = result == MatchResult::MATCHED_REWIND || result == MatchResult::MATCHED_STOP;
+
         auto status = SequenceStatus::BUFFER;
         switch (result) {
             case MatchResult::NO:
@@ -70,20 +106,18 @@ public:
                 break;
         }
 
+        const std::string_view buffer = sequence_buffer;
         const auto seq_ctx = SequenceContext{
             status,
             buffered_seq_size,
-            std::string(next_item),
-            std::string(sequence_buffer),
-            std::string(unmatched)};
+            buffer.substr(offset),
+            buffer,
+            matched ? buffer.substr(0, match_start) : buffer};
 
-        if (result != MatchResult::MAYBE) {
-            buffered_seq_size = 0;
-            sequence_buffer.clear();
-        }
+        resolved = result != MatchResult::MAYBE;
 
         return seq_ctx;
     }
 };
 
-#endif // SEQUENCE_STREAM_HPP
\ No newline at end of file
+#endif // SEQUENCE_STREAM_HPP
@@ -3,11 +3,15 @@
 
 #include <string>
 #include <vector>
+#include <utility>
 #include "llama.h"
 #include "tokenization.hpp"
 #include "sequence_stream.hpp"
 #include "generation_resources.hpp"
 #include "presampler.hpp"
+#include "fused_sampler.hpp"
+#include "ngram_drafter.hpp"
+#include "logprobs.hpp"
 
 /*
  *  Slots are essentially just a data container holding the current inference state for a single complete inference.
@@ -30,20 +34,20 @@ struct Slot {
         int n_past{};
         int i_batch{};
         llama_token last_token{};
-        std::string previous_seq_stream_buffer;
+        size_t previous_seq_stream_size{};
         int32_t previous_kv_pos{};
 
-        static SlotSnapshot snapshot_slot(const Slot& slot, llama_memory_t mem, const bool during_prompt) {
+        static SlotSnapshot snapshot_slot(const Slot& slot) {
             SlotSnapshot snapshot;
             snapshot.prompt_tokens_processed = slot.prompt_tokens_processed;
             snapshot.tokens_generated = slot.tokens_generated;
             snapshot.n_past = slot.n_past;
             snapshot.i_batch = slot.i_batch;
             snapshot.last_token = slot.last_token;
-            snapshot.previous_seq_stream_buffer = slot.sequence_stream->sequence_buffer;
+            snapshot.previous_seq_stream_size = slot.sequence_stream->buffered_size();
 
-            // During the prompt because we do not call decode, we need a special case to update the kv pos for prompt
-            snapshot.previous_kv_pos = during_prompt ? slot.n_past : llama_memory_seq_pos_max(mem, slot.slot_id) + 1;
+            // n_past rather than the KV max position, speculative decoding leaves unverified drafts past it
+            snapshot.previous_kv_pos = slot.n_past;
             return snapshot;
         }
 
@@ -53,28 +57,56 @@ struct Slot {
             slot.n_past = n_past;
             slot.i_batch = i_batch;
             slot.last_token = last_token;
-            slot.sequence_stream->sequence_buffer = previous_seq_stream_buffer;
+            slot.sequence_stream->truncate(previous_seq_stream_size);
             return previous_kv_pos;
         }
     };
 
     int job_index{-1};
     int request_id{-1};
+    int priority{0};
     int slot_id{0};
     uint32_t n_ctx_max{0};
     State state = State::IDLE;
 
     std::vector<llama_token> prompt_tokens;
     size_t prompt_tokens_processed{0};
+
+    // Tokens held by this slot's KV sequence, by position. Survives the end of a job for prefix reuse.
+    std::vector<llama_token> cache_tokens;
     int tokens_generated{0};
 
     int n_past{0};
     int i_batch{-1};
 
+    // Speculative draft being verified in the current batch, and the request's draft statistics
+    std::vector<llama_token> draft;
+    NgramDrafter ngram_drafter;
+    int draft_tokens{0};
+    int draft_accepted{0};
+
+    // Logprob records of tokens whose text isn't in the readback buffer yet. -1 top_k means disabled.
+    int logprobs_top_k{-1};
+    std::vector<TokenLogprob> pending_logprobs;
+
+    // First prompt index whose logprob is reported by a scoring request, -1 for generation
+    int score_from{-1};
+
+    // Bumped on every rewind, so a caller can tell process_token rewound the slot
+    int rewinds{0};
+
     double slot_start_time{0.0};
     double prompt_end_time{0.0};
     double generating_end_time{0.0};
 
+    // Latency breakdown. Submit and queued times come with the request, slot_start_time is when it left the queue.
+    double submit_time{0.0};
+    double queued_time{0.0};
+    double first_token_time{0.0};
+    double last_token_time{0.0};
+    size_t prefix_reuse_tokens{0};
+    std::vector<float> token_gaps;
+
     llama_token last_token{0};
     std::string generated_text;
 
@@ -86,11 +118,19 @@ struct Slot {
     Presampler presampler;
     llama_sampler* sampler{nullptr};
 
+    // Scratch of the sampling and logprob paths, belongs to the slot rather than the request.
+    // Per slot so slots can sample in parallel.
+    FusedSampler fused_sampler;
+    std::vector<llama_token_data> candidates;
+    LogprobCollector logprob_collector;
+
+    // Logits rows of the current batch the slot samples from, one per drafted position plus the real token.
+    // Fetched by the worker before slots sample in parallel, valid until the next decode.
+    std::vector<const float*> logits_rows;
+
     GenerationResources* gen_resources{nullptr};
     class RuleStream* rule_stream{nullptr};
 
-    bool cancelled{false};
-
     explicit Slot(const llama_model* model, llama_context* ctx): presampler() {
         detokenizer = new TokenStreamDetokenizer(ctx);
         sequence_stream = new SequenceStream();
@@ -108,19 +148,33 @@ struct Slot {
 
     void clear() {
         request_id = -1;
+        priority = 0;
         state = State::IDLE;
         prompt_tokens_processed = 0;
         tokens_generated = 0;
         n_past = 0;
         i_batch = -1;
+        draft.clear();
+        ngram_drafter.configure(0, 0);
+        draft_tokens = 0;
+        draft_accepted = 0;
+        rewinds = 0;
+        logprobs_top_k = -1;
+        pending_logprobs.clear();
+        score_from = -1;
         last_token = 0;
         slot_start_time = 0;
         prompt_end_time = 0.0;
         generating_end_time = 0.0;
+        submit_time = 0.0;
+        queued_time = 0.0;
+        first_token_time = 0.0;
+        last_token_time = 0.0;
+        prefix_reuse_tokens = 0;
+        token_gaps.clear();
         generated_text.clear();
         detokenizer->reset();
         presampler.reset();
-        cancelled = false;
     }
 
     State previous_state{State::IDLE};
@@ -135,6 +189,49 @@ struct Slot {
         state = previous_state;
     }
 
+    // Exchanges everything belonging to the running request with another slot, used to park a preempted request.
+    // The sequence id, job index and cache tokens describe the KV sequence rather than the request, so they stay.
+    void swap_request_state(Slot& other) noexcept {
+        using std::swap;
+        swap(request_id, other.request_id);
+        swap(priority, other.priority);
+        swap(n_ctx_max, other.n_ctx_max);
+        swap(state, other.state);
+        swap(previous_state, other.previous_state);
+        swap(prompt_tokens, other.prompt_tokens);
+        swap(prompt_tokens_processed, other.prompt_tokens_processed);
+        swap(tokens_generated, other.tokens_generated);
+        swap(n_past, other.n_past);
+        swap(i_batch, other.i_batch);
+        swap(draft, other.draft);
+        swap(ngram_drafter, other.ngram_drafter);
+        swap(draft_tokens, other.draft_tokens);
+        swap(draft_accepted, other.draft_accepted);
+        swap(rewinds, other.rewinds);
+        swap(logprobs_top_k, other.logprobs_top_k);
+        swap(pending_logprobs, other.pending_logprobs);
+        swap(score_from, other.score_from);
+        swap(slot_start_time, other.slot_start_time);
+        swap(prompt_end_time, other.prompt_end_time);
+        swap(generating_end_time, other.generating_end_time);
+        swap(submit_time, other.submit_time);
+        swap(queued_time, other.queued_time);
+        swap(first_token_time, other.first_token_time);
+        swap(last_token_time, other.last_token_time);
+        swap(prefix_reuse_tokens, other.prefix_reuse_tokens);
+        swap(token_gaps, other.token_gaps);
+        swap(last_token, other.last_token);
+        swap(generated_text, other.generated_text);
+        swap(detokenizer, other.detokenizer);
+        swap(sequence_stream, other.sequence_stream);
+        swap(rewind_snapshot, other.rewind_snapshot);
+        swap(rule_chain, other.rule_chain);
+        swap(presampler, other.presampler);
+        swap(sampler, other.sampler);
+        swap(gen_resources, other.gen_resources);
+        swap(rule_stream, other.rule_stream);
+    }
+
     void end(const int new_id, llama_context* ctx) {
         clear();
         job_index = new_id;
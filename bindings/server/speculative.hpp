@@ -0,0 +1,206 @@
+#ifndef SPECULATIVE_HPP
+#define SPECULATIVE_HPP
+
+#include <vector>
+#include <algorithm>
+#include "llama.h"
+
+/*
+ * A small draft model that proposes tokens for the target model to verify.
+ *
+ * Provides:
+ * Greedy drafts of up to n_draft tokens per sequence, batched over every sequence that asks for one.
+ * A draft KV cache that follows the target sequences, whatever happened to them in the meantime.
+ *
+ * Mechanism:
+ * The draft context mirrors the target's sequence ids. Every sequence remembers the tokens its draft KV holds.
+ * Before drafting, the draft KV is cut to the common prefix with the target tokens and the difference is decoded.
+ * This covers new prompts, rewinds, rejected drafts and preemption without the processor having to tell it.
+ * Catching up decodes at most one draft batch per step over all sequences. A sequence still behind gets no draft.
+ */
+
+class DraftModel {
+public:
+    struct Job {
+        llama_seq_id seq_id;
+        const std::vector<llama_token>* context;
+        llama_token last_token;
+        int n_draft;
+        std::vector<llama_token>* out;
+    };
+
+private:
+    llama_model* model{nullptr};
+    llama_context* ctx{nullptr};
+    llama_memory_t mem{nullptr};
+    llama_batch batch{};
+    int32_t batch_size{0};
+    int32_t n_vocab{0};
+    int n_draft_max{0};
+
+    // Tokens held by the draft KV, by sequence id
+    std::vector<std::vector<llama_token>> seq_tokens;
+
+    // Batch index of the logits each job is waiting on, -1 if none
+    std::vector<int32_t> job_logits;
+
+    void add(const llama_seq_id seq_id, const llama_token token, const bool logits) {
+        auto& tokens = seq_tokens[seq_id];
+
+        batch.token[batch.n_tokens] = token;
+        batch.pos[batch.n_tokens] = static_cast<llama_pos>(tokens.size());
+        batch.n_seq_id[batch.n_tokens] = 1;
+        batch.seq_id[batch.n_tokens][0] = seq_id;
+        batch.logits[batch.n_tokens] = static_cast<int8_t>(logits);
+
+        batch.n_tokens++;
+        tokens.push_back(token);
+    }
+
+    [[nodiscard]] llama_token argmax(const int32_t i_batch) const {
+        const float* logits = llama_get_logits_ith(ctx, i_batch);
+        return static_cast<llama_token>(std::max_element(logits, logits + n_vocab) - logits);
+    }
+
+    // Decodes the pending batch and collects the draft token for every job that was waiting on logits.
+    bool decode(std::vector<Job>& jobs) {
+        if (batch.n_tokens == 0) {
+            return true;
+        }
+
+        if (llama_decode(ctx, batch) != 0) {
+            return false;
+        }
+
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (job_logits[i] >= 0) {
+                jobs[i].out->push_back(argmax(job_logits[i]));
+                job_logits[i] = -1;
+            }
+        }
+
+        batch.n_tokens = 0;
+        return true;
+    }
+
+    void reset(const std::vector<Job>& jobs) {
+        for (const auto& job : jobs) {
+            llama_memory_seq_rm(mem, job.seq_id, 0, -1);
+            seq_tokens[job.seq_id].clear();
+            job.out->clear();
+        }
+        batch.n_tokens = 0;
+    }
+
+public:
+    DraftModel() = default;
+
+    DraftModel(const DraftModel&) = delete;
+    DraftModel& operator=(const DraftModel&) = delete;
+
+    ~DraftModel() {
+        if (ctx) {
+            llama_batch_free(batch);
+        }
+    }
+
+    void init(llama_model* draft_model, llama_context* draft_ctx, const int num_slots, const int n_draft) {
+        if (!draft_model || !draft_ctx || n_draft <= 0) {
+            return;
+        }
+
+        model = draft_model;
+        ctx = draft_ctx;
+        mem = llama_get_memory(ctx);
+        n_draft_max = n_draft;
+        batch_size = static_cast<int32_t>(llama_n_batch(ctx));
+        n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+        batch = llama_batch_init(batch_size, 0, 1);
+        seq_tokens.resize(num_slots);
+    }
+
+    [[nodiscard]] bool enabled() const {
+        return ctx != nullptr;
+    }
+
+    [[nodiscard]] int max_draft() const {
+        return n_draft_max;
+    }
+
+    // Drafts tokens following context + last_token for every job. On failure, or while the draft KV is still
+    // catching up with a long context, a job gets no draft.
+    void draft(std::vector<Job>& jobs) {
+        job_logits.assign(jobs.size(), -1);
+        batch.n_tokens = 0;
+
+        // Catch the draft KV up with the target a chunk at a time, so a long prompt or a restore never stalls a step
+        size_t catch_up_left = batch_size;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            auto& job = jobs[i];
+            auto& tokens = seq_tokens[job.seq_id];
+            const auto& context = *job.context;
+            job.out->clear();
+
+            size_t common = 0;
+            while (common < tokens.size() && common < context.size() && tokens[common] == context[common]) {
+                common++;
+            }
+
+            if (common < tokens.size()) {
+                llama_memory_seq_rm(mem, job.seq_id, static_cast<llama_pos>(common), -1);
+                tokens.resize(common);
+            }
+
+            const size_t chunk_end = common + std::min(context.size() - common, catch_up_left);
+            catch_up_left -= chunk_end - common;
+            for (size_t pos = common; pos <= chunk_end; pos++) {
+                if (batch.n_tokens == batch_size && !decode(jobs)) {
+                    reset(jobs);
+                    return;
+                }
+
+                if (pos < chunk_end) {
+                    add(job.seq_id, context[pos], false);
+                } else if (chunk_end == context.size()) {
+                    job_logits[i] = batch.n_tokens;
+                    add(job.seq_id, job.last_token, true);
+                }
+            }
+        }
+
+        if (!decode(jobs)) {
+            reset(jobs);
+            return;
+        }
+
+        // Extend every draft one token per decode
+        for (int step = 1; step < n_draft_max; step++) {
+            for (size_t i = 0; i < jobs.size(); i++) {
+                auto& job = jobs[i];
+                if (static_cast<int>(job.out->size()) >= job.n_draft || job.out->empty()) {
+                    continue;
+                }
+
+                job_logits[i] = batch.n_tokens;
+                add(job.seq_id, job.out->back(), true);
+            }
+
+            if (batch.n_tokens == 0) {
+                break;
+            }
+
+            if (!decode(jobs)) {
+                reset(jobs);
+                return;
+            }
+        }
+
+        for (auto& job : jobs) {
+            if (static_cast<int>(job.out->size()) > job.n_draft) {
+                job.out->resize(job.n_draft);
+            }
+        }
+    }
+};
+
+#endif // SPECULATIVE_HPP
@@ -0,0 +1,135 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/*
+ * A small fixed-size pool for work that shouldn't run on the caller's thread.
+ *
+ * Provides:
+ * Fire-and-forget tasks, run in submission order by whichever worker is free.
+ * Blocking parallel loops, where the caller works through the items alongside the workers.
+ *
+ * Mechanism:
+ * One locked queue and a condition variable. Shutting down runs the tasks already queued before joining,
+ * a submitted task is never dropped.
+ * A parallel loop queues one helper per free worker. Helpers and the caller claim items from a shared counter,
+ * so a slow item never holds up a fixed share of the others.
+ */
+
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping{false};
+
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(mutex);
+                cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            task();
+        }
+    }
+
+public:
+    explicit ThreadPool(const unsigned num_threads) {
+        workers.reserve(num_threads);
+        for (unsigned i = 0; i < num_threads; i++) {
+            workers.emplace_back(&ThreadPool::run, this);
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        shutdown();
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    [[nodiscard]] size_t size() const {
+        return workers.size();
+    }
+
+    // Calls fn(i) for every i below n and returns once all calls are done. Items run in no particular order.
+    // Not for use from the pool's own tasks, or while other work keeps the workers busy.
+    template<typename F>
+    void parallel_for(const size_t n, F&& fn) {
+        const size_t n_helpers = std::min(workers.size(), n > 0 ? n - 1 : 0);
+        if (n_helpers == 0) {
+            for (size_t i = 0; i < n; i++) {
+                fn(i);
+            }
+            return;
+        }
+
+        std::atomic<size_t> next{0};
+        const auto work = [&] {
+            for (size_t i = next.fetch_add(1); i < n; i = next.fetch_add(1)) {
+                fn(i);
+            }
+        };
+
+        // Helpers reference this frame, so wait for every one of them to leave rather than for the items
+        std::mutex done_mutex;
+        std::condition_variable done_cv;
+        size_t n_running = n_helpers;
+        for (size_t h = 0; h < n_helpers; h++) {
+            submit([&] {
+                work();
+
+                std::lock_guard lock(done_mutex);
+                if (--n_running == 0) {
+                    done_cv.notify_one();
+                }
+            });
+        }
+
+        work();
+
+        std::unique_lock lock(done_mutex);
+        done_cv.wait(lock, [&] { return n_running == 0; });
+    }
+
+    // Runs what's left in the queue and joins the workers. Later submissions are never run.
+    void shutdown() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+
+        for (auto& worker : workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+};
+
+#endif // THREAD_POOL_HPP
@@ -0,0 +1,489 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "llama.h"
+#include "common.h"
+#include "json_status.hpp"
+#include "match_automaton.hpp"
+#include "presampler.hpp"
+#include "rule_stream.hpp"
+#include "sequence_stream.hpp"
+#include "slot.hpp"
+#include "tokenization.hpp"
+
+/*
+ * Micro-benchmarks of the text pipeline every generated token goes through, outside of llama_decode.
+ *
+ * Provides:
+ * ns and operator new calls per token for the stop string matcher, the sequence stream, the detokenizer's UTF-8
+ * buffering and the rule engine, repeated for each slot count so the per-step overhead can be read off directly.
+ * Per call costs of the finish status JSON, of sampling a vocab-sized logits row through the llama.cpp chain and
+ * the fused path, and with a vocab of the presampler ban updates and the piece lookup.
+ *
+ * Mechanism:
+ * A synthetic token stream of ASCII words with split multi-byte characters, and stop strings built from the same
+ * words so partial matches keep the sequence buffer busy. Every slot owns its own objects and starts at a different
+ * offset of the stream, a step advances every slot by one token like a decode step would.
+ * Allocations are counted by replacing the global operator new. Components needing a vocab run only with --vocab,
+ * which loads a GGUF's tokenizer without weights.
+ *
+ * Usage:
+ * token_pipeline_bench [--tokens 4096] [--slots 1,8,64] [--stop-strings 200] [--vocab path.gguf] [--passes 5]
+ */
+
+namespace {
+
+std::atomic<uint64_t> allocation_count{0};
+
+// Results are folded in here so the optimizer can't drop the work being measured
+volatile size_t sink = 0;
+
+int timed_passes = 5;
+
+}
+
+void* operator new(const size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](const size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+    int tokens = 4096;
+    std::vector<int> slot_counts = {1, 8, 64};
+    int stop_strings = 200;
+    std::string vocab_path;
+    unsigned seed = 1337;
+};
+
+struct SyntheticStream {
+    std::vector<std::string> pieces;
+    std::vector<llama_token> tokens;
+    std::vector<std::string> stop_strings;
+
+    // What SequenceStream made of every piece, for feeding the rule engine
+    std::vector<SequenceStream::SequenceStatus> statuses;
+};
+
+struct Measurement {
+    std::string name;
+    std::string unit;
+    int slots;
+    double ns_per_op;
+    double allocs_per_op;
+    double ns_per_step;
+};
+
+const char* usage =
+    "token_pipeline_bench [--tokens N (4096)] [--slots LIST (1,8,64)] [--stop-strings N (200)]\n"
+    "                     [--vocab PATH] [--seed N (1337)] [--passes N (5)]\n";
+
+bool parse_options(const int argc, char** argv, BenchOptions& opts) {
+    for (int i = 1; i < argc; i++) {
+        const std::string key = argv[i];
+        if (key == "--help" || key == "-h" || i + 1 >= argc) {
+            return false;
+        }
+
+        const std::string value = argv[++i];
+        if (key == "--tokens") opts.tokens = std::max(1, std::stoi(value));
+        else if (key == "--stop-strings") opts.stop_strings = std::stoi(value);
+        else if (key == "--vocab") opts.vocab_path = value;
+        else if (key == "--seed") opts.seed = std::stoul(value);
+        else if (key == "--passes") timed_passes = std::max(1, std::stoi(value));
+        else if (key == "--slots") {
+            opts.slot_counts.clear();
+            std::stringstream list(value);
+            for (std::string item; std::getline(list, item, ',');) {
+                opts.slot_counts.push_back(std::max(1, std::stoi(item)));
+            }
+        }
+        else {
+            std::cerr << "Unknown option " << key << std::endl;
+            return false;
+        }
+    }
+
+    return !opts.slot_counts.empty();
+}
+
+SyntheticStream make_stream(const BenchOptions& opts) {
+    std::mt19937 rng(opts.seed);
+    SyntheticStream stream;
+
+    std::uniform_int_distribution<int> letter('a', 'z');
+    std::uniform_int_distribution<int> word_length(2, 7);
+    std::vector<std::string> words(256);
+    for (auto& word : words) {
+        const int length = word_length(rng);
+        for (int i = 0; i < length; i++) {
+            word += static_cast<char>(letter(rng));
+        }
+    }
+
+    std::uniform_int_distribution<size_t> pick_word(0, words.size() - 1);
+    std::uniform_int_distribution<llama_token> pick_token(0, 31999);
+    std::bernoulli_distribution multibyte(0.04);
+    const std::vector<std::string> wide_chars = {"\xC3\xA9", "\xE6\x97\xA5", "\xF0\x9F\x99\x82"};
+    std::uniform_int_distribution<size_t> pick_wide(0, wide_chars.size() - 1);
+
+    while (static_cast<int>(stream.pieces.size()) < opts.tokens) {
+        if (multibyte(rng)) {
+            const std::string& wide = wide_chars[pick_wide(rng)];
+            stream.pieces.push_back(wide.substr(0, 1));
+            stream.pieces.push_back(wide.substr(1));
+        } else {
+            stream.pieces.push_back(" " + words[pick_word(rng)]);
+        }
+    }
+    stream.pieces.resize(opts.tokens);
+
+    for (size_t i = 0; i < stream.pieces.size(); i++) {
+        stream.tokens.push_back(pick_token(rng));
+    }
+
+    std::uniform_int_distribution<int> phrase_length(1, 3);
+    for (int i = 0; i < opts.stop_strings; i++) {
+        std::string stop;
+        const int length = phrase_length(rng);
+        for (int w = 0; w < length; w++) {
+            stop += (w > 0 || i % 2 == 0 ? " " : "") + words[pick_word(rng)];
+        }
+        stream.stop_strings.push_back(stop);
+    }
+
+    SequenceStream sequence_stream;
+    sequence_stream.bind_sequences(stream.stop_strings, {});
+
+    for (const auto& piece : stream.pieces) {
+        stream.statuses.push_back(sequence_stream.append(piece).sequence_status);
+    }
+
+    return stream;
+}
+
+// One untimed pass to warm caches and grow buffers, then the fastest of the timed passes of steps x slots operations
+template<typename F>
+Measurement measure(const std::string& name, const std::string& unit, const int slots, const int steps, F&& pass) {
+    pass();
+
+    double best_ns = 0.0;
+    uint64_t best_allocs = 0;
+    for (int i = 0; i < timed_passes; i++) {
+        const uint64_t allocs_before = allocation_count.load(std::memory_order_relaxed);
+        const auto start = Clock::now();
+        pass();
+        const double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        const uint64_t allocs = allocation_count.load(std::memory_order_relaxed) - allocs_before;
+
+        if (i == 0 || ns < best_ns) {
+            best_ns = ns;
+            best_allocs = allocs;
+        }
+    }
+
+    const double ops = static_cast<double>(steps) * slots;
+    return {name, unit, slots, best_ns / ops, static_cast<double>(best_allocs) / ops, best_ns / steps};
+}
+
+void run_token_components(const SyntheticStream& stream, const int slots, const llama_model* vocab_model,
+                          std::vector<Measurement>& results) {
+    const int steps = static_cast<int>(stream.pieces.size());
+    const auto at = [&](const int step, const int slot) {
+        return static_cast<size_t>(step + slot * 97) % stream.pieces.size();
+    };
+
+    {
+        // Fed like SequenceStream does, pending text is kept until the matcher rules it out
+        std::vector<std::unique_ptr<MatchAutomaton>> matchers;
+        std::vector<size_t> pending(slots, 0);
+        for (int s = 0; s < slots; s++) {
+            matchers.push_back(std::make_unique<MatchAutomaton>());
+            matchers.back()->build(stream.stop_strings, {});
+        }
+
+        results.push_back(measure("match_automaton_feed", "token", slots, steps, [&] {
+            for (int step = 0; step < steps; step++) {
+                for (int s = 0; s < slots; s++) {
+                    const std::string& piece = stream.pieces[at(step, s)];
+                    const auto [result, match_start] = matchers[s]->feed(piece, pending[s]);
+                    pending[s] += piece.size();
+                    if (result != MatchResult::MAYBE) {
+                        matchers[s]->reset();
+                        pending[s] = 0;
+                    }
+                    sink += match_start;
+                }
+            }
+        }));
+    }
+
+    {
+        std::vector<std::unique_ptr<SequenceStream>> sequence_streams;
+        for (int s = 0; s < slots; s++) {
+            sequence_streams.push_back(std::make_unique<SequenceStream>());
+            sequence_streams.back()->bind_sequences(stream.stop_strings, {});
+        }
+
+        results.push_back(measure("sequence_stream_append", "token", slots, steps, [&] {
+            for (int step = 0; step < steps; step++) {
+                for (int s = 0; s < slots; s++) {
+                    sink += sequence_streams[s]->append(stream.pieces[at(step, s)]).sequence_status;
+                }
+            }
+        }));
+    }
+
+    {
+        std::vector<std::unique_ptr<TokenStreamDetokenizer>> detokenizers;
+        for (int s = 0; s < slots; s++) {
+            detokenizers.push_back(std::make_unique<TokenStreamDetokenizer>(nullptr));
+        }
+
+        results.push_back(measure("detokenizer_process_piece", "token", slots, steps, [&] {
+            for (int step = 0; step < steps; step++) {
+                for (int s = 0; s < slots; s++) {
+                    sink += detokenizers[s]->process_piece(stream.pieces[at(step, s)]).size();
+                }
+            }
+        }));
+
+        // process_token minus the context lookup, the vocab-only model has no context
+        if (vocab_model) {
+            const llama_vocab* vocab = llama_model_get_vocab(vocab_model);
+            const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+            results.push_back(measure("detokenizer_process_token", "token", slots, steps, [&] {
+                for (int step = 0; step < steps; step++) {
+                    for (int s = 0; s < slots; s++) {
+                        const llama_token token = stream.tokens[at(step, s)] % n_vocab;
+                        sink += detokenizers[s]->process_piece(common_token_to_piece(vocab, token, false)).size();
+                    }
+                }
+            }));
+        }
+    }
+
+    {
+        std::vector<std::unique_ptr<Slot>> slot_states;
+        std::vector<std::unique_ptr<RuleStream>> rule_streams;
+        for (int s = 0; s < slots; s++) {
+            slot_states.push_back(std::make_unique<Slot>(vocab_model, nullptr));
+            rule_streams.push_back(std::make_unique<RuleStream>());
+
+            // What every generation request carries. Stop tokens never match, min tokens needs a vocab for its bans.
+            Slot& slot = *slot_states.back();
+            RuleStream& rules = *rule_streams.back();
+            RuleEngine::rule_max_tokens(rules, 1 << 30, vocab_model, nullptr, slot);
+            RuleEngine::rule_stop_tokens(rules, {-1, -2}, vocab_model, nullptr, slot);
+            if (vocab_model) {
+                RuleEngine::rule_min_tokens(rules, 1 << 30, vocab_model, nullptr, slot);
+            }
+        }
+
+        results.push_back(measure("rule_stream_apply_engine", "token", slots, steps, [&] {
+            for (int step = 0; step < steps; step++) {
+                for (int s = 0; s < slots; s++) {
+                    const size_t index = at(step, s);
+                    const std::string_view piece = stream.pieces[index];
+                    const SequenceStream::SequenceContext seq_ctx{stream.statuses[index], 1, piece, piece, piece};
+                    sink += rule_streams[s]->apply_engine(
+                        stream.tokens[index], seq_ctx, vocab_model, nullptr, *slot_states[s]).size();
+                    slot_states[s]->tokens_generated++;
+                }
+            }
+        }));
+
+        for (const auto& slot : slot_states) {
+            slot->presampler.reset();
+        }
+    }
+}
+
+void run_request_components(const SyntheticStream& stream, const llama_model* vocab_model,
+                            std::vector<Measurement>& results) {
+    constexpr int calls = 1024;
+
+    {
+        Slot slot(vocab_model, nullptr);
+        slot.prompt_tokens_processed = 1024;
+        slot.tokens_generated = static_cast<int>(stream.pieces.size());
+        slot.slot_start_time = 1.0;
+        slot.prompt_end_time = 120.0;
+        slot.generating_end_time = 5000.0;
+        for (size_t i = 0; i < stream.pieces.size(); i++) {
+            slot.token_gaps.push_back(static_cast<float>(10 + i % 7));
+        }
+
+        results.push_back(measure("make_json_status_string", "request", 1, calls, [&] {
+            for (int i = 0; i < calls; i++) {
+                sink += make_json_status_string(slot, "StopString", "\n\nUser:").size();
+            }
+        }));
+    }
+
+    {
+        // The usual request chain on a row the size of a large vocab, with a few rows so the picks vary
+        constexpr int32_t n_vocab = 151936;
+        constexpr int rows = 8;
+        std::mt19937 rng(1337);
+        std::normal_distribution<float> logit(0.0f, 3.0f);
+        std::vector<float> logits(static_cast<size_t>(n_vocab) * rows);
+        for (auto& value : logits) {
+            value = logit(rng);
+        }
+        for (int r = 0; r < rows; r++) {
+            logits[static_cast<size_t>(r) * n_vocab + rng() % n_vocab] += 12.0f;
+        }
+
+        llama_sampler* chain = sampler_make();
+        sampler_penalties(chain, 64, 1.0f, 0.0f, 0.0f);
+        sampler_temp(chain, 0.8f);
+        sampler_top_k(chain, 40);
+        sampler_top_p(chain, 0.95f, 1);
+        sampler_min_p(chain, 0.05f, 1);
+        sampler_typical(chain, 1.0f, 1);
+        sampler_dist(chain, 1337);
+
+        constexpr int sample_calls = 64;
+        std::vector<llama_token_data> candidates(n_vocab);
+        results.push_back(measure("sample_llama_chain", "sample", 1, sample_calls, [&] {
+            for (int i = 0; i < sample_calls; i++) {
+                const float* row = logits.data() + static_cast<size_t>(i % rows) * n_vocab;
+                for (llama_token token = 0; token < n_vocab; token++) {
+                    candidates[token] = {token, row[token], 0.0f};
+                }
+                llama_token_data_array cur_p{candidates.data(), candidates.size(), -1, false};
+                llama_sampler_apply(chain, &cur_p);
+                const llama_token token = cur_p.data[cur_p.selected].id;
+                llama_sampler_accept(chain, token);
+                sink += token;
+            }
+        }));
+
+        FusedSampler fused;
+        if (fused.recognize(chain)) {
+            results.push_back(measure("sample_fused", "sample", 1, sample_calls, [&] {
+                for (int i = 0; i < sample_calls; i++) {
+                    const float* row = logits.data() + static_cast<size_t>(i % rows) * n_vocab;
+                    sink += fused.sample(chain, row, n_vocab, nullptr);
+                }
+            }));
+        }
+
+        sampler_free(chain);
+    }
+
+    if (vocab_model) {
+        const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(vocab_model));
+        Presampler presampler;
+        presampler.add_eos_ban(vocab_model, {llama_vocab_eos(llama_model_get_vocab(vocab_model))});
+
+        // A rewind bans one more token, the next accepted token clears the bans again
+        results.push_back(measure("presampler_ban_update", "update", 1, 2 * calls, [&] {
+            for (int i = 0; i < calls; i++) {
+                presampler.add_rewind_bans(vocab_model, {stream.tokens[i % stream.tokens.size()] % n_vocab});
+                presampler.clear_rewind_bans(vocab_model);
+            }
+        }));
+
+        presampler.reset();
+    }
+}
+
+llama_model* load_vocab(const std::string& path) {
+    llama_model_params params = llama_model_default_params();
+    params.vocab_only = true;
+    return llama_model_load_from_file(path.c_str(), params);
+}
+
+}
+
+int main(const int argc, char** argv) {
+    BenchOptions opts;
+    if (!parse_options(argc, argv, opts)) {
+        std::cerr << usage;
+        return 1;
+    }
+
+    llama_model* vocab_model = nullptr;
+    if (!opts.vocab_path.empty()) {
+        llama_backend_init();
+        vocab_model = load_vocab(opts.vocab_path);
+        if (!vocab_model) {
+            std::cerr << "Failed to load the vocab of " << opts.vocab_path << std::endl;
+            return 1;
+        }
+    }
+
+    const SyntheticStream stream = make_stream(opts);
+
+    std::vector<Measurement> results;
+    for (const int slots : opts.slot_counts) {
+        run_token_components(stream, slots, vocab_model, results);
+    }
+    run_request_components(stream, vocab_model, results);
+
+    std::ostringstream ss;
+    ss << "{\"config\":{"
+       << "\"tokens\":" << opts.tokens
+       << ",\"stopStrings\":" << opts.stop_strings
+       << ",\"vocab\":" << (vocab_model ? "true" : "false")
+       << ",\"seed\":" << opts.seed
+       << ",\"passes\":" << timed_passes
+       << "},\"results\":[";
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto& result = results[i];
+        ss << (i > 0 ? "," : "") << "{"
+           << "\"name\":\"" << result.name << "\""
+           << ",\"unit\":\"" << result.unit << "\""
+           << ",\"slots\":" << result.slots
+           << ",\"nsPerOp\":" << result.ns_per_op
+           << ",\"allocsPerOp\":" << result.allocs_per_op
+           << ",\"nsPerStep\":" << result.ns_per_step
+           << "}";
+    }
+    ss << "]}";
+
+    std::cout << ss.str() << std::endl;
+
+    if (vocab_model) {
+        llama_model_free(vocab_model);
+        llama_backend_free();
+    }
+
+    return 0;
+}
@@ -39,7 +39,11 @@ public:
     }
 
     std::string process_token(const llama_token token, const bool parse_special) {
-        const std::string piece = common_token_to_piece(ctx, token, parse_special);
+        return process_piece(common_token_to_piece(ctx, token, parse_special));
+    }
+
+    // Buffers the piece and returns the longest complete UTF-8 prefix of what's buffered
+    std::string process_piece(const std::string_view& piece) {
         utf_buffer += piece;
 
         const size_t valid_bytes = validate_utf8(utf_buffer);
@@ -0,0 +1,181 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "llama.h"
+
+/*
+ * Opt-in timeline of what the processor's threads spend their time on.
+ *
+ * Provides:
+ * Spans tagged with a slot and request id, dumped as Chrome trace-event JSON (chrome://tracing, Perfetto).
+ *
+ * Mechanism:
+ * Every thread writes into its own fixed-size ring, the oldest spans are overwritten. A ring's lock is only
+ * contended while a dump copies it. A disabled tracer costs one relaxed load per span, nothing is written.
+ */
+
+struct TraceEvent {
+    const char* name;
+    int64_t begin_us;
+    int64_t end_us;
+    int32_t slot_id;
+    int32_t request_id;
+};
+
+class TraceRing {
+    std::vector<TraceEvent> events;
+    size_t next{0};
+    bool wrapped{false};
+    mutable std::mutex mutex;
+
+public:
+    const uint32_t thread_index;
+
+    TraceRing(const size_t capacity, const uint32_t thread_index)
+        : events(capacity), thread_index(thread_index) {
+    }
+
+    void push(const TraceEvent& event) {
+        std::lock_guard lock(mutex);
+        events[next] = event;
+        next++;
+        if (next == events.size()) {
+            next = 0;
+            wrapped = true;
+        }
+    }
+
+    // Oldest first
+    void copy_to(std::vector<TraceEvent>& out) const {
+        std::lock_guard lock(mutex);
+        if (wrapped) {
+            out.insert(out.end(), events.begin() + static_cast<long>(next), events.end());
+        }
+        out.insert(out.end(), events.begin(), events.begin() + static_cast<long>(next));
+    }
+
+    void clear() {
+        std::lock_guard lock(mutex);
+        next = 0;
+        wrapped = false;
+    }
+};
+
+class Tracer {
+    static constexpr size_t ring_capacity = 1 << 16;
+
+    std::atomic<bool> enabled{false};
+
+    // Rings live as long as the tracer, threads find theirs by the tracer's unique id
+    std::vector<std::unique_ptr<TraceRing>> rings;
+    std::mutex rings_mutex;
+    const uint64_t tracer_id;
+
+    static uint64_t make_tracer_id() {
+        static std::atomic<uint64_t> next_id{1};
+        return next_id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    TraceRing* ring_for_this_thread() {
+        thread_local uint64_t cached_tracer_id = 0;
+        thread_local TraceRing* cached_ring = nullptr;
+        if (cached_tracer_id == tracer_id) {
+            return cached_ring;
+        }
+
+        std::lock_guard lock(rings_mutex);
+        rings.push_back(std::make_unique<TraceRing>(ring_capacity, static_cast<uint32_t>(rings.size())));
+        cached_tracer_id = tracer_id;
+        cached_ring = rings.back().get();
+        return cached_ring;
+    }
+
+public:
+    Tracer() : tracer_id(make_tracer_id()) {
+    }
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    [[nodiscard]] bool is_enabled() const {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    // Enabling starts a fresh timeline
+    void set_enabled(const bool enable) {
+        if (enable && !is_enabled()) {
+            std::lock_guard lock(rings_mutex);
+            for (const auto& ring : rings) {
+                ring->clear();
+            }
+        }
+        enabled.store(enable, std::memory_order_relaxed);
+    }
+
+    void record(const TraceEvent& event) {
+        ring_for_this_thread()->push(event);
+    }
+
+    // Chrome trace-event JSON of every ring, complete events with ts and dur in microseconds
+    std::string dump() {
+        std::vector<TraceEvent> events;
+        std::ostringstream ss;
+        ss << R"({"displayTimeUnit":"ms","traceEvents":[)";
+
+        bool first = true;
+        std::lock_guard lock(rings_mutex);
+        for (const auto& ring : rings) {
+            events.clear();
+            ring->copy_to(events);
+
+            for (const auto& event : events) {
+                if (!first) {
+                    ss << ",";
+                }
+                first = false;
+
+                ss << R"({"name":")" << event.name
+                   << R"(","ph":"X","pid":1,"tid":)" << ring->thread_index
+                   << R"(,"ts":)" << event.begin_us
+                   << R"(,"dur":)" << event.end_us - event.begin_us
+                   << R"(,"args":{"slot":)" << event.slot_id
+                   << R"(,"request":)" << event.request_id << "}}";
+            }
+        }
+
+        ss << "]}";
+        return ss.str();
+    }
+};
+
+// Records the enclosing scope as a span, if the tracer was enabled when the scope began. Names must be literals.
+class TraceSpan {
+    Tracer* tracer;
+    TraceEvent event{};
+
+public:
+    TraceSpan(Tracer& tracer, const char* name, const int32_t slot_id = -1, const int32_t request_id = -1)
+        : tracer(tracer.is_enabled() ? &tracer : nullptr) {
+        if (this->tracer) {
+            event = {name, ggml_time_us(), 0, slot_id, request_id};
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    ~TraceSpan() {
+        if (tracer) {
+            event.end_us = ggml_time_us();
+            tracer->record(event);
+        }
+    }
+};
+
+#endif // TRACE_HPP
@@ -47,10 +47,81 @@ export default {
             "buffer", // stopping_tokens: const int32_t*
             "u32", // num_stopping_tokens: unsigned
             "bool", // add_special: bool
+            "i32", // priority: int
+            "i32", // ngram_size: int
+            "i32", // ngram_draft_tokens: int
+            "bool", // logprobs: bool
+            "i32", // top_logprobs: int
+            "buffer", // fork_resources: GenerationResources**
+            "u32", // num_forks: unsigned
         ],
         result: "i32", // int
     },
 
+    processor_submit_tokens: {
+        parameters: [
+            "pointer", // processor: Processor*
+            "buffer", // prompt_tokens: const int32_t*
+            "u32", // num_prompt_tokens: unsigned
+            "pointer", // gen_resources: GenerationResources*
+            "i32", // max_tokens: int
+            "i32", // min_tokens: int
+            "u32", // max_slot_n_ctx: unsigned
+            "u32", // seed: unsigned
+            "buffer", // rewind_strings: const char**
+            "u32", // num_rewind_strings: unsigned
+            "buffer", // stopping_strings: const char**
+            "u32", // num_stopping_strings: unsigned
+            "buffer", // stopping_tokens: const int32_t*
+            "u32", // num_stopping_tokens: unsigned
+            "i32", // priority: int
+            "i32", // ngram_size: int
+            "i32", // ngram_draft_tokens: int
+            "bool", // logprobs: bool
+            "i32", // top_logprobs: int
+            "buffer", // fork_resources: GenerationResources**
+            "u32", // num_forks: unsigned
+        ],
+        result: "i32", // int
+    },
+
+    processor_submit_scoring: {
+        parameters: [
+            "pointer", // processor: Processor*
+            "buffer", // context: const char*
+            "buffer", // candidates: const char**
+            "u32", // num_candidates: unsigned
+            "pointer", // gen_resources: GenerationResources*
+            "buffer", // candidate_resources: GenerationResources**
+            "u32", // max_slot_n_ctx: unsigned
+            "bool", // add_special: bool
+            "i32", // priority: int
+            "i32", // top_logprobs: int
+        ],
+        result: "i32", // int
+    },
+
+    processor_set_tracing: {
+        parameters: [
+            "pointer", // processor: Processor*
+            "bool", // enable: bool
+        ],
+        result: "void",
+    },
+
+    processor_dump_trace: {
+        parameters: ["pointer"], // processor: Processor*
+        result: "pointer", // char*
+    },
+
+    processor_get_metrics: {
+        parameters: [
+            "pointer", // processor: Processor*
+            "buffer", // out: ProcessorMetrics*
+        ],
+        result: "void",
+    },
+
     processor_cancel_work: {
         parameters: [
             "pointer", // processor: Processor*
@@ -65,11 +136,36 @@ export default {
             "pointer", // ctx: llama_context*
             "pointer", // mem: llama_memory_t
             "i32", // num_processor_slots: int
+            "u32", // step_token_budget: uint32_t
+            "i32", // prefill_policy: int
+            "u32", // host_cache_mb: uint32_t
+            "buffer", // disk_cache_dir: const char*
+            "u32", // disk_cache_mb: uint32_t
+            "i32", // cache_type_k: int
+            "i32", // cache_type_v: int
+            "bool", // flash_attn: bool
+            "pointer", // draft_model: llama_model*
+            "pointer", // draft_ctx: llama_context*
+            "i32", // num_draft_tokens: int
+            "pointer", // embedding_ctx: llama_context*
         ],
         result: "pointer", // Processor*
         nonblocking: true,
     },
 
+    processor_submit_embeddings: {
+        parameters: [
+            "pointer", // processor: Processor*
+            "pointer", // buffer: EmbeddingBuffer*
+            "buffer", // inputs: const char**
+            "u32", // num_inputs: unsigned
+            "bool", // add_special: bool
+            "bool", // normalize: bool
+        ],
+        result: "bool", // bool
+        nonblocking: true,
+    },
+
     processor_free: {
         parameters: [
             "pointer", // processor: Processor*
@@ -138,6 +234,11 @@ export default {
         result: "i32", // int32_t
     },
 
+    model_vocab_n_tokens: {
+        parameters: ["pointer"], // model: const llama_model*
+        result: "i32", // int32_t
+    },
+
     model_vocab_token_to_string: {
         parameters: [
             "pointer", // model: const llama_model*
@@ -146,6 +247,16 @@ export default {
         result: "pointer", // const char*
     },
 
+    model_vocab_token_to_piece: {
+        parameters: [
+            "pointer", // model: const llama_model*
+            "i32", // token: llama_token
+            "buffer", // buf: char*
+            "i32", // buf_size: int32_t
+        ],
+        result: "i32", // int32_t
+    },
+
     // Context functions
     ctx_make: {
         parameters: [
@@ -167,6 +278,19 @@ export default {
         nonblocking: true,
     },
 
+    ctx_make_embedding: {
+        parameters: [
+            "pointer", // model: llama_model*
+            "u32", // num_batch_tokens: unsigned
+            "i32", // num_seqs: int32_t
+            "i32", // num_threads: int32_t
+            "bool", // flash_attn: bool
+            "i32", // pooling_type: int
+        ],
+        result: "pointer", // llama_context*
+        nonblocking: true,
+    },
+
     ctx_max_seq_len: {
         parameters: ["pointer"], // ctx: const llama_context*
         result: "u32", // uint32_t
@@ -200,9 +324,45 @@ export default {
             "pointer", // outToken: llama_token*
         ],
         result: "bool", // bool
+    },
+
+    readback_read_batch: {
+        parameters: [
+            "pointer", // buffer: ReadbackBuffer*
+            "buffer", // out_text: char*
+            "u32", // text_capacity: uint32_t
+            "buffer", // out_lengths: uint32_t*
+            "buffer", // out_tokens: llama_token*
+            "u32", // max_entries: unsigned
+            "buffer", // out_bytes: uint32_t*
+        ],
+        result: "u32", // unsigned
+    },
+
+    readback_wait: {
+        parameters: [
+            "pointer", // buffer: ReadbackBuffer*
+            "u32", // timeout_ms: uint32_t
+        ],
+        result: "bool", // bool
         nonblocking: true,
     },
 
+    readback_logprobs_top_k: {
+        parameters: ["pointer"], // buffer: ReadbackBuffer*
+        result: "i32", // int
+    },
+
+    readback_read_logprobs: {
+        parameters: [
+            "pointer", // buffer: ReadbackBuffer*
+            "buffer", // out_logprobs: TokenLogprob*
+            "buffer", // out_entries: uint32_t*
+            "u32", // max_tokens: unsigned
+        ],
+        result: "u32", // unsigned
+    },
+
     readback_read_status: {
         parameters: ["pointer"], // buffer: const ReadbackBuffer*
         result: "pointer", // char*
@@ -390,6 +550,57 @@ export default {
         result: "void",
     },
 
+    embedding_buffer_make: {
+        parameters: [],
+        result: "pointer", // EmbeddingBuffer*
+    },
+
+    embedding_buffer_release: {
+        parameters: [
+            "pointer", // EmbeddingBuffer* buffer
+        ],
+        result: "void",
+    },
+
+    embedding_buffer_is_finished: {
+        parameters: ["pointer"], // buffer: const EmbeddingBuffer*
+        result: "bool", // bool
+    },
+
+    embedding_buffer_wait: {
+        parameters: [
+            "pointer", // buffer: EmbeddingBuffer*
+            "u32", // timeout_ms: uint32_t
+        ],
+        result: "bool", // bool
+        nonblocking: true,
+    },
+
+    embedding_buffer_status: {
+        parameters: ["pointer"], // buffer: const EmbeddingBuffer*
+        result: "pointer", // const char*
+    },
+
+    embedding_buffer_data: {
+        parameters: ["pointer"], // buffer: const EmbeddingBuffer*
+        result: "pointer", // const float*
+    },
+
+    embedding_buffer_n_embd: {
+        parameters: ["pointer"], // buffer: const EmbeddingBuffer*
+        result: "i32", // int32_t
+    },
+
+    embedding_buffer_n_inputs: {
+        parameters: ["pointer"], // buffer: const EmbeddingBuffer*
+        result: "i32", // int32_t
+    },
+
+    embedding_buffer_n_tokens: {
+        parameters: ["pointer"], // buffer: const EmbeddingBuffer*
+        result: "i32", // int32_t
+    },
+
     has_llguidance: {
         parameters: [],
         result: "bool",
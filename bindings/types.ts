@@ -16,6 +16,18 @@ export enum GGMLTensorSplitMode {
     row = 2,
 }
 
+export enum PrefillPolicy {
+    slot_order = 0,
+    fair = 1,
+}
+
+export enum PoolingType {
+    model = -1,
+    mean = 1,
+    cls = 2,
+    last = 3,
+}
+
 export type ReadbackFinishReason =
     | "CtxExceeded"
     | "BatchDecode"
@@ -23,13 +35,24 @@ export type ReadbackFinishReason =
     | "MaxNewTokens"
     | "StopString"
     | "TokenEncode"
+    | "Scored"
     | "Aborted";
 
 // MARK: C++ chunks
+export interface TokenLogprob {
+    token: number;
+    logprob: number;
+}
+
+export interface ReadbackTokenLogprobs extends TokenLogprob {
+    top: TokenLogprob[];
+}
+
 export interface ReadbackStreamChunk {
     kind: "data";
     text: string;
     token: number;
+    logprobs?: ReadbackTokenLogprobs[];
 }
 
 export interface ReadbackFinishChunk {
@@ -47,19 +70,48 @@ export interface ReadbackFinishChunk {
 
     genTokensPerSec: number;
     promptTokensPerSec: number;
+
+    draftTokens: number;
+    draftAcceptedTokens: number;
+    draftAcceptRate: number;
+
+    // Latency breakdown, measured from submission
+    tokenizeMs: number;
+    queueMs: number;
+    ttftMs: number;
+    prefixReuseTokens: number;
+    itlP50Ms: number;
+    itlP99Ms: number;
+    itlMaxMs: number;
+
     finishReason: ReadbackFinishReason;
     stopToken: string;
+
+    // Tokens that didn't produce text of their own, like the stop token
+    logprobs?: ReadbackTokenLogprobs[];
 }
 
 export type ReadbackGenerationChunk = ReadbackStreamChunk | ReadbackFinishChunk;
 
 // MARK: API chunks
 
+export interface LogprobToken {
+    token: number;
+    text: string;
+    bytes: number[];
+    logprob: number;
+}
+
+export interface TokenLogprobs extends LogprobToken {
+    top: LogprobToken[];
+}
+
 interface BaseChunk {
     kind: string;
     taskIdx: number;
     requestId: string;
     text: string;
+    logprobs?: TokenLogprobs[];
 }
 
 export interface StreamChunk extends BaseChunk {
@@ -69,6 +121,7 @@ export interface StreamChunk extends BaseChunk {
 export interface FinishChunk extends BaseChunk {
     kind: "finish";
     fullText: string;
+    fullLogprobs?: TokenLogprobs[];
 
     promptTokens: number;
     genTokens: number;
@@ -79,6 +132,19 @@ export interface FinishChunk extends BaseChunk {
     promptTokensPerSec: number;
     genTokensPerSec: number;
 
+    draftTokens: number;
+    draftAcceptedTokens: number;
+    draftAcceptRate: number;
+
+    // Latency breakdown, measured from submission
+    tokenizeMs: number;
+    queueMs: number;
+    ttftMs: number;
+    prefixReuseTokens: number;
+    itlP50Ms: number;
+    itlP99Ms: number;
+    itlMaxMs: number;
+
     finishReason: ReadbackFinishReason;
     stopToken: string;
 
@@ -86,3 +152,12 @@ export interface FinishChunk extends BaseChunk {
 }
 
 export type GenerationChunk = StreamChunk | FinishChunk;
+
+// A scored continuation. Tokens are the candidate's, or the whole prompt's without candidates.
+export interface ScoreResult {
+    tokens: TokenLogprobs[];
+    sumLogprob: number;
+
+    // Every token was the model's most likely one, needs at least one top logprob
+    isGreedy: boolean;
+}
@@ -1,5 +1,10 @@
 import * as z from "@/common/myZod.ts";
-import { GGMLTensorSplitMode, GGMLType } from "@/bindings/types.ts";
+import {
+    GGMLTensorSplitMode,
+    GGMLType,
+    PoolingType,
+    PrefillPolicy,
+} from "@/bindings/types.ts";
 
 export const NetworkConfig = z.object({
     host: z.string().nullish().coalesce("127.0.0.1"),
@@ -31,6 +36,18 @@ export const ModelConfig = z.object({
     cache_size: z.number().cleanOptional(),
     chunk_size: z.number().nullish().coalesce(512),
     physical_chunk_size: z.number().cleanOptional(),
+    step_token_budget: z.number().cleanOptional(),
+    prefill_policy: z.union([
+        z.enum(["slot_order", "fair"]).transform((str) =>
+            PrefillPolicy[str as keyof typeof PrefillPolicy]
+        ),
+        z.number(),
+    ])
+        .nullish()
+        .coalesce(PrefillPolicy.fair),
+    host_cache_size: z.number().nullish().coalesce(0),
+    disk_cache_dir: z.string().cleanOptional(),
+    disk_cache_size: z.number().nullish().coalesce(8192),
     num_gpu_layers: z.number().nullish().coalesce(0),
     gpu_split: z.array(z.number()).nullish().coalesce([]),
     gpu_split_mode: z.union([
@@ -68,6 +85,19 @@ export const ModelConfig = z.object({
     override_tensor: z.array(z.string()).nullish().coalesce([]),
     n_cpu_moe: z.union([z.number(), z.literal("all")]).cleanOptional(),
     mmap: z.boolean().nullish().coalesce(true),
+    draft_model_name: z.string().cleanOptional(),
+    draft_num_tokens: z.number().nullish().coalesce(4),
+    draft_num_gpu_layers: z.number().cleanOptional(),
+    embeddings: z.boolean().nullish().coalesce(false),
+    embedding_batch_size: z.number().cleanOptional(),
+    embedding_pooling: z.union([
+        z.enum(["model", "mean", "cls", "last"]).transform((str) =>
+            PoolingType[str as keyof typeof PoolingType]
+        ),
+        z.number(),
+    ])
+        .nullish()
+        .coalesce(PoolingType.model),
 });
 
 export type ModelConfig = z.infer<typeof ModelConfig>;
@@ -91,6 +121,7 @@ export type SamplingConfig = z.infer<typeof SamplingConfig>;
 
 export const DeveloperConfig = z.object({
     realtime_process_priority: z.boolean().nullish().coalesce(true),
+    trace: z.boolean().nullish().coalesce(false),
 });
 
 export const ConfigSchema = z.object({
@@ -28,6 +28,32 @@ const GenerationOptionsSchema = z.aliasedObject(
             .describe("Aliases: ignore_eos"),
         seed: z.number().nullish()
             .samplerOverride("seed"),
+        priority: z.number().nullish()
+            .samplerOverride("priority")
+            .coalesce(0)
+            .describe(
+                "Higher values are scheduled first and can preempt lower ones",
+            ),
+        prompt_lookup: z.boolean().nullish()
+            .samplerOverride("prompt_lookup")
+            .coalesce(false)
+            .describe(
+                "Speculate by copying continuations of n-grams seen earlier in the context",
+            ),
+        prompt_lookup_ngram_size: z.number().gte(1).nullish()
+            .samplerOverride("prompt_lookup_ngram_size")
+            .coalesce(3),
+        prompt_lookup_num_tokens: z.number().gte(1).nullish()
+            .samplerOverride("prompt_lookup_num_tokens")
+            .coalesce(8),
+        logprobs: z.union([z.boolean(), z.number().gte(0).lte(20)]).nullish()
+            .samplerOverride("logprobs")
+            .describe(
+                "Return token logprobs. A number also sets the top alternatives per token",
+            ),
+        top_logprobs: z.number().gte(0).lte(20).nullish()
+            .samplerOverride("top_logprobs")
+            .coalesce(0),
         logit_bias: z.record(z.string(), z.number()).nullish()
             .samplerOverride("logit_bias")
             .coalesce({}),